@@ -1,77 +1,17 @@
+#include "archiver.h"
 #include <errno.h>
-#include <fcntl.h>
-#include <getopt.h>
-#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <unistd.h>
-#define FILENAME_LENGTH 256
-#define HEADER_ENDING_SIZE 4
-#define BUFFER_SIZE 1024
 #define HR_FS_BUFFER_SIZE 20
 
 /**
- * \mainpage archiver.c - простой архиватор
- *
- * ## Описание формата архива
- * Архив имеет следующую структуру: вначале последовательно идут структуры
- * file_info, после этого - содержимое файлов, идущее подряд. Конец заголовка -
- * 4 нулевых байтов (0000 0000). Для эффективной работы с заголовком архива
- * (структуры file_info вначале) существует связный список fi_list.
- * При добавлении (insert) информация о файле добавляется в конец заголовка, а
- * данные добавляются в таком же порядке в конец файла
- *
- * __Ограничения__:
- * * Файл должен быть регулярным
- * * Имена файлов не должны повторяться (ничего не сломается, просто не надо)
- *
- * ## Тонкости
- * При указании файла по какому-то сложному пути во время добавления файла в
- * архив программа обрезает путь, занося в архив только название
- *
- * \todo Сделать проверку на уникальность файла, который мы вставляем
- * \todo Сделать вставку контроллирующей последовательности в начало архива,
- * чтобы программа могла отличать файлы-архивы от файлов-неархивов
- * \todo Добавить независимость от endianness процессора (для структуры
- * file_info)
+ * \file archiver.c
+ * Утилита archiver: разбор аргументов и вывод сообщений. Вся работа с
+ * архивом - в libarchiver (см. archiver.h)
  */
 
-/**
- * Информация о файле в архиве
- *
- * \note Для переносимости файла архива используются следующие техники:
- * * Определяется выравнивание `#pragma pack(1)`
- * * Используются независимые от платформы типы: uint8_t, uint64_t
- */
-struct file_info;
-typedef struct file_info file_info_t;
-
-; // Штука, чтобы предотварить ошибочное предупреждение clangd
-#pragma pack(push, 1)
-struct file_info
-{
-    uint8_t filename[FILENAME_LENGTH]; //!< Имя файла
-    uint64_t filesize; //!< Размер файла (в файле)
-    uint64_t mask; //!< Маска прав доступа к файлу
-    uint64_t _offset; //!< Положение файла в архиве
-};
-#pragma pack(pop)
-
-/**
- * Декодированный заголовок архива
- *
- * fi_list->eof  - конец связного списка
- */
-struct fi_list
-{
-    file_info_t data;
-    struct fi_list* next;
-    char eof; //!< Конец списка
-};
-typedef struct fi_list fi_list_t;
-
 /**
  * Состояния программы
  *
@@ -83,6 +23,10 @@ enum prog_mode
     MODE_REMOVE, //!< Удалить файл из архива
     MODE_EXTRACT, //!< Получить файлы из архива
     MODE_STAT, //!< Получить информацию о файлах в архиве
+    MODE_VERIFY, //!< Проверить контрольные суммы файлов архива
+    MODE_COMPACT, //!< Освободить место, занятое удаленными файлами
+    MODE_GREP, //!< Найти строки в файлах архива без извлечения
+    MODE_CAT, //!< Вывести файл архива (или его часть) в stdout
     MODE_HELP, //!< Вывести информацию о файлах в архиве
     MODE_UNDEF //!< Неопознанное состояние (ошибка в аргументах)
 };
@@ -97,8 +41,9 @@ enum err_code
     ERR_ARGS, //!< Ошибка при парсинге аргументов
     ERR_INPUT_NOFILES, //!< Не переданы файлы для вставки в архив
     ERR_OPEN, //!< Ошибка при открытии файла
-    ERR_INPUT_NOAPP, //!< Никакой из новых файлов не вставлен
-    ERR_REMOVE_NOFILES //!< Не переданы файлы для удаления из архива
+    ERR_REMOVE_NOFILES, //!< Не переданы файлы для удаления из архива
+    ERR_STREAM_MODE, //!< Режим не работает с потоковым архивом ("-")
+    ERR_STREAM_TTY //!< Потоковый архив пишется в терминал
 };
 
 /**
@@ -122,74 +67,57 @@ void print_help();
 void print_err(enum err_code code);
 
 /**
- * Поместить в архив файлы
- * \param archive Название ошибки
- * \param fnums Количество файлов
- * \param fnames Массив названий файлов
+ * Вывести сообщение об ошибке библиотеки и завершить программу
+ * \param err Код ARCHIVE_E*
  */
-void input_files(char* archive, int fnums, char** fnames);
+void print_lib_err(int err);
 
 /**
- * Читает заголовок (см. документацию \ref index "к основной странице"),
- * заполняя связный список head. После устанавливает указатель в файле на начало
- * (rewind)
- * \param head Указатель на начало связного списка
- * \param arch_fd Файловый дескриптор архива
+ * Архив "-" - потоковый: пишется в stdout и читается из stdin
  */
-void read_header(fi_list_t* head, int arch_fd);
+static int is_stream(const char* archive)
+{
+    return strcmp(archive, "-") == 0;
+}
 
 /**
- * Очищает связный список head
+ * Открыть архив, а при ошибке - завершить программу
+ * \param flags Флаги archive_open
  */
-void free_fi_list(fi_list_t* head);
+archive_t* open_archive(char* archive, int flags);
 
 /**
- * Возвращает конец связного списка head
- *
- * \return Указатель на конец global_fi_list или NULL, если не инициализировано
+ * Поместить в архив файлы
+ * \param archive Название ошибки
+ * \param fnums Количество файлов
+ * \param fnames Массив названий файлов
+ * \param opts Флаги вставки (сжатие, количество потоков)
  */
-fi_list_t* end_fi_list(fi_list_t* head);
+void input_files(
+    char* archive, int fnums, char** fnames, struct archive_opts* opts);
 
 /**
- * Создает пустую ноду в конце связного списка head
+ * Проверить контрольные суммы файлов архива
  *
- * \return Новую ноду в конце head
- */
-fi_list_t* make_new_node_in_fi_list(fi_list_t* head);
-
-/**
- * Создает связный список
- */
-fi_list_t* init_fi_list();
-
-/**
- * Обновляет заголовок, вставляя информацию о файлах fnames в конец заголовка
- * \param Указатель на начало связного списка - заголовка архива
- * \param start Указатель на переменную, куда функция запишет позицию в списке,
- * откуда начинаются новые файлы. Если start == 0, то ничего не будет записано
- * \return количество вставленных файлов
- */
-int update_header_for_input(
-    fi_list_t* header, int fnums, char** fnames, fi_list_t** start);
-
-/**
- * Обновляет оффсеты в заголовке
+ * Файлы проверяются в opts->jobs потоков. Несовпадения выводятся в stderr;
+ * если они есть, программа завершается с кодом EXIT_FAILURE
+ * \param fnums Количество файлов. Если 0, проверяется весь архив
  */
-void update_offsets_in_header(fi_list_t* header);
+void verify_archive(
+    char* archive, int fnums, char** fnames, struct archive_opts* opts);
 
 /**
- * Непосредственно вставляет файлы в архив
+ * Найти строки по регулярному выражению в файлах архива. Процедура для флага
+ * "--grep"
  *
- * Вставка происходит посредством создания нового файла и копирования туда всего
- * содержимого из старого архива
- * \param header Заголовок архива
- * \param oldfd Файловый дескриптор открытого архива
- * \param newfd Файловый дескриптор нового архива, куда будут добавлены файлы
- * \param fnums Количество файлов
- * \param fnames Массив названий файлов, которые необходимо добавить в архив
+ * Найденные строки выводятся в stdout как "файл:номер:строка". Если ни одной
+ * строки не нашлось, программа завершается с кодом EXIT_FAILURE, как grep
+ * \param argc Количество аргументов после флагов: шаблон и файлы архива
+ * \param argv Шаблон, за ним файлы. Если файлов нет, поиск идет по всему
+ * архиву
  */
-void insert_files_routine(
-    fi_list_t* header, int oldfd, int newfd, int fnums, char** fnames);
+void grep_archive(
+    char* archive, int argc, char** argv, struct archive_opts* opts);
 
 /**
  * "Human-readable" размер файла
@@ -207,92 +135,112 @@ void hr_file_size(uint64_t s, char buf[HR_FS_BUFFER_SIZE]);
  */
 void stat_archive(char* archive);
 
+/**
+ * Разбирает необязательные флаги, идущие сразу после флага режима:
+ * "-j N" ("--jobs N"), "-c" ("--compress"), "-d" ("--dedup"), "-u"
+ * ("--update") и "--hash". Флаг, который режим не использует, - ошибка
+ * аргументов
+ * \param mode Режим работы
+ * \param opts Куда записать флаги
+ * \return Количество аргументов, занятых флагами
+ */
+int parse_opts(
+    enum prog_mode mode, int argc, char** argv, struct archive_opts* opts);
+
 /**
  * Получить файлы из архива
+ *
+ * При opts->jobs > 1 файлы раздаются пулу из jobs потоков. Все потоки читают
+ * общий дескриптор архива только позиционно (copy_file не двигает его
+ * позицию), а каждый файл пишется через свой дескриптор. Если файлов меньше,
+ * чем потоков, оставшиеся потоки распаковывают блоки сжатых файлов
  * \param archive Название архива
  * \param fnums Количество файлов, которые надо извлечь. Если передан 0, то
  * будет извлечен весь архив
  * \param fnames Массив файлов, которые необходимо извлачь
+ * \param opts Флаги (количество потоков)
  */
-void extract_files(char* archive, int fnums, char** fnames);
+void extract_files(
+    char* archive, int fnums, char** fnames, struct archive_opts* opts);
 
 /**
- * Удаляет ноду, следующую за _to_ из связного списка _h_
- * \warning Перед использованием функции добавьте фиктивный узел в начало
- * списка, и передавайте этот фиктивный узел в _h_
- *
- * \code
- * fi_list_t *header = init_fi_list();
- * //...
- * fi_list_t fictive;
- * fictive.next = header;
- * fictive.eof = 0;
- * for (fi_list_t *i = &fictive; !i->next->eof; )
- * {
- *     if (something_wrong_with(i->next))
- *     {
- *         remove_node_from_fi_list(&fictive, i);
- *         header = fictive.next;
- *         continue;
- *     }
- *     i = i->next;
- * }
- *
- * \endcode
- * \param h - голова связного списка
- * \param to - нода, предыдущая той, которую надо удалить или нода, следующая за
- * головой, если is_head == 1
- * \return 0, если _to_ был удален из h, -1 - иначе
+ * Тоже ясно. Процедура для флага "-r"
  */
-int remove_node_from_fi_list(fi_list_t* h, fi_list_t* to);
+void remove_files(char* archive, int fnums, char** fnames);
 
 /**
- * Ясно
- * \param delete_existed Флаг, определяющий, что удалять. 1 - удалять то, что
- * указано в fnames. 0 - удалять то, что __НЕ__ указано в fnames
+ * Уплотнить архив. Процедура для флага "--compact"
+ * \param argc Количество аргументов после флага
+ * \param argv Аргументы после флага: "-t N" ("--threshold N") и "--rewrite"
  */
-void remove_files_from_header(
-    fi_list_t** header, int fnums, char** fnames, char delete_existed);
+void compact_archive(char* archive, int argc, char** argv);
 
 /**
- * Копирует _bytes_ байт из файла _old_ в файл _new_
- *
- * Копирование происходит в конец файла _new_
+ * Вывести файл архива или диапазон его байт в stdout. Процедура для флага
+ * "--cat"
  *
- * \param old Дескриптор файла, откуда копируем. Должен быть открыт на чтение
- * \param new Дескриптор файла, куда копируем. Должен быть открыт на запись
- * \param bytes Количество байт с начала файла _old_, которые нужно скопировать
- * \param pos Позиция в _old_, откуда начинается копирование
+ * В канал данные несжатого файла идут через splice, не покидая ядра, так что
+ * просмотр конца огромного файла стоит только прочитанного
+ * \param argc Количество аргументов после флага
+ * \param argv Имя файла и необязательный "--range НАЧАЛО:ДЛИНА". Длину можно
+ * не указывать (до конца файла), а отрицательное начало отсчитывается от
+ * конца: "--range -4096" - последние 4 КБ
  */
-void copy_file(int old, int new, uint64_t bytes, off_t pos);
+void cat_member(char* archive, int argc, char** argv);
 
 /**
- * Тоже ясно. Процедура для флага "-r"
+ * Убирает из аргументов флаг "--stats" (он может стоять где угодно после
+ * архива, но до "--") и, если он был, включает сбор статистики. При выходе
+ * статистика выводится в stderr одной строкой JSON: stdout занят потоковым
+ * архивом и выводом --grep
+ * \return Новое количество аргументов
  */
-void remove_files(char* archive, int fnums, char** fnames);
+int take_stats_flag(int argc, char** argv);
 
 int main(int argc, char** argv)
 {
-    switch (parse_args(argc, argv))
+    struct archive_opts opts;
+    argc = take_stats_flag(argc, argv);
+    enum prog_mode mode = parse_args(argc, argv);
+    int skip = mode == MODE_HELP || mode == MODE_COMPACT || mode == MODE_CAT
+        ? 0
+        : parse_opts(mode, argc, argv, &opts);
+    switch (mode)
     {
     case MODE_HELP:
         print_help();
         break;
 
     case MODE_INPUT:
-        input_files(argv[1], argc - 3, argv + 3);
+        input_files(argv[1], argc - 3 - skip, argv + 3 + skip, &opts);
         break;
 
     case MODE_STAT:
         stat_archive(argv[1]);
         break;
 
+    case MODE_VERIFY:
+        verify_archive(argv[1], argc - 3 - skip, argv + 3 + skip, &opts);
+        break;
+
     case MODE_EXTRACT:
-        extract_files(argv[1], argc - 3, argv + 3);
+        extract_files(argv[1], argc - 3 - skip, argv + 3 + skip, &opts);
         break;
 
     case MODE_REMOVE:
-        remove_files(argv[1], argc - 3, argv + 3);
+        remove_files(argv[1], argc - 3 - skip, argv + 3 + skip);
+        break;
+
+    case MODE_COMPACT:
+        compact_archive(argv[1], argc - 3, argv + 3);
+        break;
+
+    case MODE_GREP:
+        grep_archive(argv[1], argc - 3 - skip, argv + 3 + skip, &opts);
+        break;
+
+    case MODE_CAT:
+        cat_member(argv[1], argc - 3, argv + 3);
         break;
 
     case MODE_UNDEF:
@@ -305,6 +253,38 @@ int main(int argc, char** argv)
     exit(EXIT_SUCCESS);
 }
 
+static void print_stats(void)
+{
+    archive_stats_write(STDERR_FILENO);
+}
+
+int take_stats_flag(int argc, char** argv)
+{
+    // После "--" идут только имена файлов, "--stats" там - тоже имя
+    int kept = 2, i = 2;
+    for (; i < argc && strcmp(argv[i], "--") != 0; ++i)
+    {
+        if (strcmp(argv[i], "--stats") != 0)
+            argv[kept++] = argv[i];
+    }
+    if (kept == i)
+        return argc;
+    for (; i < argc; ++i)
+        argv[kept++] = argv[i];
+    argv[kept] = NULL;
+    archive_stats_enable(1);
+
+    // Если ARCHIVER_STATS и так выводит статистику в stderr, второй раз ее
+    // печатать не нужно
+    const char* env = getenv("ARCHIVER_STATS");
+    if (!env
+        || (*env != '\0' && strcmp(env, "-") != 0 && strcmp(env, "1") != 0))
+    {
+        atexit(print_stats);
+    }
+    return kept;
+}
+
 enum prog_mode parse_args(int argc, char** argv)
 {
     if (argc < 2) // without args
@@ -342,49 +322,151 @@ enum prog_mode parse_args(int argc, char** argv)
         return MODE_STAT;
     }
 
+    if (strcmp(argv[2], "-v") == 0 || strcmp(argv[2], "--verify") == 0)
+    {
+        return MODE_VERIFY;
+    }
+
+    if (strcmp(argv[2], "--compact") == 0)
+    {
+        return MODE_COMPACT;
+    }
+
+    if (strcmp(argv[2], "--grep") == 0)
+    {
+        return MODE_GREP;
+    }
+
+    if (strcmp(argv[2], "--cat") == 0)
+    {
+        return MODE_CAT;
+    }
+
     return MODE_UNDEF;
 }
 
+int parse_opts(
+    enum prog_mode mode, int argc, char** argv, struct archive_opts* opts)
+{
+    archive_opts_init(opts);
+
+    // Сжатие, дедупликация и обновление касаются только вставки, а потоки -
+    // всего, что читает или пишет данные файлов
+    int insert = mode == MODE_INPUT;
+    int jobs_ok = insert || mode == MODE_EXTRACT || mode == MODE_VERIFY
+        || mode == MODE_GREP;
+    int i = 3;
+    while (i < argc)
+    {
+        int jobs_flag =
+            strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0;
+        int insert_flag = strcmp(argv[i], "-c") == 0
+            || strcmp(argv[i], "--compress") == 0
+            || strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dedup") == 0
+            || strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--update") == 0
+            || strcmp(argv[i], "--hash") == 0;
+        if ((jobs_flag && !jobs_ok) || (insert_flag && !insert))
+            print_err(ERR_ARGS);
+
+        if (jobs_flag)
+        {
+            char* end = NULL;
+            long jobs = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (i + 1 >= argc || *end != '\0' || jobs < 1
+                || jobs > ARCHIVE_MAX_JOBS)
+            {
+                print_err(ERR_ARGS);
+            }
+            opts->jobs = jobs;
+            i += 2;
+        }
+        else if (strcmp(argv[i], "-c") == 0
+            || strcmp(argv[i], "--compress") == 0)
+        {
+            opts->compress = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--dedup") == 0)
+        {
+            opts->dedup = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-u") == 0
+            || strcmp(argv[i], "--update") == 0)
+        {
+            if (!opts->update)
+                opts->update = ARCHIVE_UPDATE_MTIME;
+            i++;
+        }
+        else if (strcmp(argv[i], "--hash") == 0)
+        {
+            opts->update = ARCHIVE_UPDATE_HASH;
+            i++;
+        }
+        else
+        {
+            if (strcmp(argv[i], "--") == 0)
+                i++;
+            break;
+        }
+    }
+    return i - 3;
+}
+
 void print_help()
 {
     printf("archiver - простой архиватор\n"
            "Флаги:\n"
            " [АРХИВ] -r(--remove)  [ФАЙЛ,...] - Удалить файл(ы) из архива\n"
            " [АРХИВ] -i(--insert)  [ФАЙЛ,...] - Вставить файл(ы) в архив\n"
+           " [АРХИВ] -i -c [-j N]  [ФАЙЛ,...] - Вставить со сжатием (в N "
+           "потоков)\n"
+           " [АРХИВ] -i -d [-c]    [ФАЙЛ,...] - Вставить с дедупликацией (и "
+           "сжатием)\n"
+           " [АРХИВ] -i -u [--hash] [ФАЙЛ,...] - Добавить только новые и "
+           "измененные\n"
+           "         файлы (по размеру и времени изменения, с --hash - еще "
+           "и по CRC)\n"
+           "         Директории вставляются рекурсивно, с путями от самой "
+           "директории\n"
            " [АРХИВ] -e(--extract) [ФАЙЛ,...] - Получить файлы из архива\n"
            "         Если не указывать файлы, то извлечется все содержимое "
            "архива\n"
+           " [АРХИВ] -e -j N       [ФАЙЛ,...] - То же, в N потоков\n"
            " [АРХИВ] -s(--stat)               - Вывести информацию о архиве\n"
+           " [АРХИВ] -v(--verify) [-j N] [ФАЙЛ,...] - Проверить контрольные "
+           "суммы\n"
+           " [АРХИВ] --compact [-t N] [--rewrite] - Освободить место после "
+           "удаления,\n"
+           "         если мертвые данные занимают не меньше N%% архива. "
+           "--rewrite\n"
+           "         переписывает архив вместо пробивания дыр\n"
+           " [АРХИВ] --grep [-j N] ШАБЛОН [ФАЙЛ,...] - Найти строки по "
+           "регулярному\n"
+           "         выражению (ERE) в файлах архива, не извлекая их. "
+           "Вывод:\n"
+           "         \"файл:номер:строка\"\n"
+           " [АРХИВ] --cat ФАЙЛ [--range НАЧАЛО:ДЛИНА] - Вывести файл или "
+           "его часть\n"
+           "         в stdout. Без длины - до конца, НАЧАЛО < 0 - от конца "
+           "файла\n"
+           "С флагом --stats (в любом месте после архива, но до \"--\") "
+           "при выходе в stderr\n"
+           "выводится строка JSON: время фаз, системные вызовы, самые "
+           "медленные файлы\n"
+           "Если вместо архива указать \"-\", -i пишет потоковый архив в "
+           "stdout,\n"
+           "а -e и -v читают его из stdin:\n"
+           "  archiver - -i -c [ФАЙЛ,...] | ssh host archiver - -e\n"
            "---\n"
            "prod. by dmsukhikh\n");
 }
 
-void print_err(enum err_code code)
+/**
+ * Выводит сообщение errmsg (и errno, если он выставлен) и завершает программу
+ */
+static void die(const char* errmsg)
 {
-    char* errmsg = 0;
-    switch (code)
-    {
-    case ERR_ARGS:
-        errmsg = "Ошибка при разборе аргументов";
-        break;
-
-    case ERR_INPUT_NOFILES:
-        errmsg = "Не указаны файлы для вставки в архив";
-        break;
-
-    case ERR_OPEN:
-        errmsg = "Ошибка при открытии файла";
-        break;
-
-    case ERR_INPUT_NOAPP:
-        errmsg = "Не добавлен ни один указанный файл";
-        break;
-
-    case ERR_REMOVE_NOFILES:
-        errmsg = "Не указаны файлы для удаления из архива";
-        break;
-    }
-
     if (errno == 0)
     {
         fprintf(stderr, "[archiver]: %s. См. \"archiver --help\" для справки\n",
@@ -399,270 +481,172 @@ void print_err(enum err_code code)
     exit(EXIT_FAILURE);
 }
 
-void input_files(char* archive, int fnums, char** fnames)
+void print_err(enum err_code code)
 {
-    const char* new_fd_name = ".supertemp.egleser";
-
-    int new_fd = open(new_fd_name, O_CREAT | O_RDWR, 0666);
-    int fd = open(archive, O_CREAT | O_RDONLY, 0666);
-    if (fd == -1 || new_fd == -1)
-    {
-        print_err(ERR_OPEN);
-    }
-
-    fi_list_t* new_header = init_fi_list();
-    read_header(new_header, fd);
-
-    if (fnums == 0)
-    {
-        close(fd);
-        close(new_fd);
-        free_fi_list(new_header);
-        print_err(ERR_INPUT_NOFILES);
-    }
-
-    if (update_header_for_input(new_header, fnums, fnames, 0) == 0)
+    char* errmsg = 0;
+    switch (code)
     {
-        close(fd);
-        close(new_fd);
-        free_fi_list(new_header);
-        print_err(ERR_INPUT_NOAPP);
-    }
-
-    update_offsets_in_header(new_header);
-    insert_files_routine(new_header, fd, new_fd, fnums, fnames);
-
-    remove(archive);
-    rename(new_fd_name,
-        archive); // странно, но это работает
-                  // Если мы назовем файл "temp/nice.txt", то все сработает
+    case ERR_ARGS:
+        errmsg = "Ошибка при разборе аргументов";
+        break;
 
-    close(fd);
-    close(new_fd);
-    free_fi_list(new_header);
-}
+    case ERR_INPUT_NOFILES:
+        errmsg = "Не указаны файлы для вставки в архив";
+        break;
 
-void read_header(fi_list_t* header, int arch_fd)
-{
-    uint32_t header_ending = 0, buf;
-    for (;;)
-    {
-        // check for header ending
-        if (read(arch_fd, &buf, HEADER_ENDING_SIZE) == 0)
-        {
-            if (!errno)
-                break; // empty file
-            else
-            {
-                close(arch_fd);
-                free_fi_list(header);
-                perror("err: ");
-                exit(EXIT_FAILURE);
-            }
-        }
+    case ERR_OPEN:
+        errmsg = "Ошибка при открытии файла";
+        break;
 
-        // Здесь, нас не заботит byte order, поскольку значение 0x0 симметрично
-        // Если условие выполняется, заголовок кончился
-        if (header_ending == buf)
-            break;
-        // Возвращаемся назад...
-        lseek(arch_fd, -HEADER_ENDING_SIZE, SEEK_CUR);
+    case ERR_REMOVE_NOFILES:
+        errmsg = "Не указаны файлы для удаления из архива";
+        break;
 
-        // ... И читаем file_info
-        fi_list_t* info = make_new_node_in_fi_list(header);
+    case ERR_STREAM_MODE:
+        errmsg = "Потоковый архив (\"-\") можно только вставить (-i), "
+                 "извлечь (-e) или проверить (-v)";
+        break;
 
-        read(arch_fd, &info->data, sizeof(file_info_t));
+    case ERR_STREAM_TTY:
+        errmsg = "Потоковый архив не выводится в терминал: перенаправьте "
+                 "stdout";
+        break;
     }
-    lseek(arch_fd, 0, SEEK_SET);
+    die(errmsg);
 }
 
-void free_fi_list(fi_list_t* header)
+void print_lib_err(int err)
 {
-    for (fi_list_t* i = header; i != NULL;) // тут именно != NULL, а не !eof
-    {
-        fi_list_t* d = i->next;
-        free(i);
-        i = d;
-    }
+    if (err != ARCHIVE_EIO)
+        errno = 0;
+    die(archive_strerror(err));
 }
 
-fi_list_t* end_fi_list(fi_list_t* header)
+archive_t* open_archive(char* archive, int flags)
 {
-    fi_list_t* i = header;
-    if (!i)
-        return i;
-
-    for (; !i->eof; i = i->next);
-    return i;
+    archive_t* a;
+    int err = archive_open(archive, flags, &a);
+    if (err == ARCHIVE_EIO)
+        print_err(ERR_OPEN);
+    if (err)
+        print_lib_err(err);
+    return a;
 }
 
-fi_list_t* make_new_node_in_fi_list(fi_list_t* h)
+/**
+ * Сообщение о файле, пропущенном при вставке
+ */
+static void report_input(const char* name, int err, void* ctx)
 {
-    fi_list_t* i = h;
-    for (; !i->eof; i = i->next);
-
-    i->next = init_fi_list();
-    i->eof = 0;
-    return i;
+    (void)ctx;
+    fprintf(stderr,
+        "[archiver]: Ошибка при вставке файла \"%s\": %s. Пропущено\n", name,
+        err == ARCHIVE_EIO ? strerror(errno) : archive_strerror(err));
 }
 
-int update_header_for_input(
-    fi_list_t* header, int fnums, char** fnames, fi_list_t** start)
+void input_files(
+    char* archive, int fnums, char** fnames, struct archive_opts* opts)
 {
-    int inserted_files = 0;
-    struct stat stat_file;
-    for (int i = 0; i < fnums; ++i)
+    if (fnums == 0)
     {
-        if (stat(fnames[i], &stat_file) == -1)
-        {
-            fprintf(stderr,
-                "[archiver]: Ошибка при вставке файла \"%s\": %s. Пропущено\n",
-                fnames[i], strerror(errno));
-            continue;
-        }
-
-        if (!S_ISREG(stat_file.st_mode))
-        {
-            fprintf(stderr,
-                "[archiver]: Ошибка при вставке файла \"%s\": Файл не "
-                "регулярный. Пропущено\n",
-                fnames[i]);
-            continue;
-        }
-
-        file_info_t fi;
-        char* start_plain_name = strrchr(fnames[i], '/');
-
-        if (start_plain_name == NULL)
-        {
-            memcpy(fi.filename, fnames[i], strlen(fnames[i]) + 1);
-        }
-        else
-        {
-            memcpy(fi.filename, start_plain_name + 1,
-                strlen(start_plain_name + 1) + 1);
-        }
-
-        // Добавляем размер файла
-        {
-            // Мы открывали файл раньше, так что проверок не делаем
-            int _offset_fd = open(fnames[i], O_RDONLY);
-            fi.filesize = lseek(_offset_fd, 0, SEEK_END);
-            close(_offset_fd);
-        }
-
-        fi.mask = stat_file.st_mode & 0777;
-        fi._offset = 0; // Будет добавлено позднее в коде
-
-        fi_list_t* n = make_new_node_in_fi_list(header);
-
-        if (start != NULL && *start == 0)
-            *start = n;
-
-        memcpy(&n->data, &fi, sizeof(file_info_t));
-        inserted_files++;
+        print_err(ERR_INPUT_NOFILES);
     }
 
-    return inserted_files;
-}
-
-void insert_files_routine(
-    fi_list_t* header, int fd, int new_fd, int fnums, char** fnames)
-{
-    for (fi_list_t* i = header; !i->eof; i = i->next)
+    opts->report = report_input;
+    if (is_stream(archive))
     {
-        write(new_fd, &i->data, sizeof(file_info_t));
+        if (isatty(STDOUT_FILENO))
+            print_err(ERR_STREAM_TTY);
+        int ret = archive_stream_write(STDOUT_FILENO, fnums, fnames, opts);
+        if (ret < 0)
+            print_lib_err(ret);
+        return;
     }
 
-    // Пишем заголовок
-    uint32_t t = 0;
-    write(new_fd, &t, HEADER_ENDING_SIZE);
+    archive_t* a = open_archive(archive, ARCHIVE_RDWR | ARCHIVE_CREATE);
+    int ret = archive_insert(a, fnums, fnames, opts);
+    archive_close(a);
+    if (ret < 0)
+        print_lib_err(ret);
+}
 
-    // Читаем старый архив
-    fi_list_t* oldh = init_fi_list();
-    read_header(oldh, fd);
-    uint64_t off = oldh->data._offset;
-    free_fi_list(oldh);
+void stat_archive(char* archive)
+{
+    if (is_stream(archive))
+        print_err(ERR_STREAM_MODE);
 
-    // Перемещение к началу сырых данных
-    if (lseek(fd, 0, SEEK_END) != 0) // Проверка на непустой массив
-    {
-        lseek(fd, off, SEEK_SET);
-    }
-    char buf[BUFFER_SIZE];
-    ssize_t reads = 0;
+    archive_t* a = open_archive(archive, ARCHIVE_RDONLY);
+    struct archive_info info;
+    archive_info(a, &info);
 
-    while ((reads = read(fd, buf, BUFFER_SIZE)) > 0)
+    // выравнивание
+    unsigned int name_align = 4, size_align = 6;
+    uint64_t total = 0, total_stored = info.chunk_bytes;
+    archive_iter_t it;
+    archive_member_t m;
+    archive_iter_init(a, &it);
+    while (archive_iter_next(&it, &m))
     {
-        write(new_fd, buf, reads);
+        char buf[HR_FS_BUFFER_SIZE];
+        hr_file_size(m.size, buf);
+        size_align = size_align > strlen(buf) ? size_align : strlen(buf);
+        name_align
+            = name_align > strlen(m.name) ? name_align : strlen(m.name);
+        total += m.size;
+        total_stored += m.stored_size;
     }
 
-    for (int i = 0; i < fnums; ++i)
-    {
-        int app_fd = open(fnames[i], O_RDONLY);
-        if (fd == -1)
-            continue;
-        while ((reads = read(app_fd, buf, BUFFER_SIZE)) > 0)
+    // Кириллица в заголовках занимает по 2 байта на букву, отсюда + 4 и + 6
+    printf("--- Архив: %s ---\n", archive);
+    printf("%-*s %-*s %s\n", name_align + 4 + 1, "Файл", size_align + 6 + 1,
+        "Размер", "Сжатие");
+    archive_iter_init(a, &it);
+    while (archive_iter_next(&it, &m))
+    {
+        char buf[HR_FS_BUFFER_SIZE], ratio[HR_FS_BUFFER_SIZE] = "-";
+        hr_file_size(m.size, buf);
+        if ((m.flags & (ARCHIVE_MEMBER_COMPRESSED | ARCHIVE_MEMBER_SPARSE))
+            && m.size)
         {
-            write(new_fd, buf, reads);
+            snprintf(ratio, HR_FS_BUFFER_SIZE, "%.1f%%",
+                100.0 * m.stored_size / m.size);
         }
-        close(app_fd);
+        else if (m.flags & ARCHIVE_MEMBER_DEDUP)
+        {
+            // Чанки могут быть общими, так что долю конкретного файла не
+            // посчитать
+            snprintf(ratio, HR_FS_BUFFER_SIZE, "дедуп.");
+        }
+        printf("%-*s %-*s %s\n", name_align + 1, m.name, size_align + 1, buf,
+            ratio);
     }
-}
 
-void update_offsets_in_header(fi_list_t* header)
-{
-    uint64_t raw_off = 0, total_header_nodes = 0;
-
-    for (fi_list_t* i = header; !i->eof; i = i->next, total_header_nodes++);
-
-    for (fi_list_t* i = header; !i->eof; i = i->next)
+    if (total_stored != total && total)
     {
-        i->data._offset = sizeof(file_info_t) * total_header_nodes
-            + HEADER_ENDING_SIZE + raw_off;
-        raw_off += i->data.filesize;
+        char buf[HR_FS_BUFFER_SIZE], sbuf[HR_FS_BUFFER_SIZE];
+        hr_file_size(total, buf);
+        hr_file_size(total_stored, sbuf);
+        printf("Всего: %s, в архиве: %s (%.1f%%)\n", buf, sbuf,
+            100.0 * total_stored / total);
     }
-}
-
-fi_list_t* init_fi_list()
-{
-    fi_list_t* t = malloc(sizeof(fi_list_t));
-    t->next = NULL;
-    t->eof = 1;
-    return t;
-}
-
-void stat_archive(char* archive)
-{
-    int fd = open(archive, O_RDONLY);
-    if (fd == -1)
+    if (info.chunks)
     {
-        print_err(ERR_OPEN);
+        printf("Уникальных чанков: %lu\n", info.chunks);
     }
-
-    fi_list_t* h = init_fi_list();
-    read_header(h, fd);
-
-    // выравнивание
-    unsigned int name_align = 4, size_align = 6;
-    for (fi_list_t* i = h; !i->eof; i = i->next)
+    if (info.dead_bytes)
     {
         char buf[HR_FS_BUFFER_SIZE];
-        hr_file_size(i->data.filesize, buf);
-        size_align = size_align > strlen(buf) ? size_align : strlen(buf);
-        name_align = name_align > strlen((char*)i->data.filename)
-            ? size_align
-            : strlen((char*)i->data.filename);
+        hr_file_size(info.dead_bytes, buf);
+        // Мертвые данные бывают и без надгробий: прежние каталоги и чанки,
+        // на которые больше никто не ссылается
+        if (info.deleted)
+            printf("Удаленных файлов: %lu, ", info.deleted);
+        printf("%s: %s (%.1f%%), см. --compact\n",
+            info.deleted ? "мертвых данных" : "Мертвых данных", buf,
+            100.0 * info.dead_bytes / info.used_bytes);
     }
 
-    printf("--- Архив: %s ---\n", archive);
-    printf("%-*s %-*s\n", name_align + 4 + 1, "Файл", size_align + 6 + 1, "Размер");
-    for (fi_list_t* i = h; !i->eof; i = i->next)
-    {
-        char buf[HR_FS_BUFFER_SIZE];
-        hr_file_size(i->data.filesize, buf);
-        printf("%-*s %-*s\n", name_align + 1, i->data.filename, size_align + 1, buf);
-    }
+    archive_close(a);
 }
 
 void hr_file_size(uint64_t s, char buf[HR_FS_BUFFER_SIZE])
@@ -687,135 +671,254 @@ void hr_file_size(uint64_t s, char buf[HR_FS_BUFFER_SIZE])
     }
 }
 
-void extract_files(char* archive, int fnums, char** fnames)
+/**
+ * Сообщение о файле, который не удалось извлечь
+ */
+static void report_extract(const char* name, int err, void* ctx)
 {
-    int fd = open(archive, O_RDONLY);
-    if (fd == -1)
+    (void)ctx;
+    if (err == ARCHIVE_EIO)
+        fprintf(stderr, "[archiver]: Ошибка! %s. Пропущено\n", strerror(errno));
+    else
+        fprintf(stderr, "[archiver]: Файл \"%s\" в архиве поврежден\n", name);
+}
+
+void extract_files(
+    char* archive, int fnums, char** fnames, struct archive_opts* opts)
+{
+    opts->report = report_extract;
+    if (is_stream(archive))
     {
-        print_err(ERR_OPEN);
+        int ret = archive_stream_extract(STDIN_FILENO, fnums, fnames, opts);
+        if (ret < 0)
+            print_lib_err(ret);
+        return;
     }
 
-    fi_list_t* header = init_fi_list();
-    read_header(header, fd);
+    archive_t* a = open_archive(archive, ARCHIVE_RDONLY);
+    int ret = archive_extract(a, fnums, fnames, opts);
+    archive_close(a);
+    if (ret < 0)
+        print_lib_err(ret);
+}
 
-    if (fnums != 0)
+void remove_files(char* archive, int fnums, char** fnames)
+{
+    if (fnums == 0)
     {
-        remove_files_from_header(&header, fnums, fnames, 0);
+        print_err(ERR_REMOVE_NOFILES);
     }
+    if (is_stream(archive))
+        print_err(ERR_STREAM_MODE);
 
-    for (fi_list_t* i = header; !i->eof; i = i->next)
+    archive_t* a = open_archive(archive, ARCHIVE_RDWR);
+    int ret = archive_remove(a, fnums, fnames);
+    archive_close(a);
+    if (ret < 0)
+        print_lib_err(ret);
+}
+
+void compact_archive(char* archive, int argc, char** argv)
+{
+    if (is_stream(archive))
+        print_err(ERR_STREAM_MODE);
+
+    int threshold = 0, flags = 0;
+    for (int i = 0; i < argc; ++i)
     {
-        int new_fd = open((const char*)i->data.filename, O_CREAT | O_WRONLY);
-        if (new_fd == -1)
+        if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--threshold") == 0)
         {
-            fprintf(
-                stderr, "[archiver]: Ошибка! %s. Пропущено\n", strerror(errno));
-            continue;
+            char* end = NULL;
+            long t = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : -1;
+            if (i + 1 >= argc || *end != '\0' || t < 0 || t > 100)
+                print_err(ERR_ARGS);
+            threshold = t;
+            i++;
+        }
+        else if (strcmp(argv[i], "--rewrite") == 0)
+        {
+            flags |= ARCHIVE_COMPACT_REWRITE;
+        }
+        else
+        {
+            print_err(ERR_ARGS);
         }
-        chmod((const char*)i->data.filename, i->data.mask);
-
-        copy_file(fd, new_fd, i->data.filesize, i->data._offset);
-        close(new_fd);
     }
 
-    free_fi_list(header);
-    close(fd);
+    archive_t* a = open_archive(archive, ARCHIVE_RDWR);
+    struct archive_info before, after;
+    archive_info(a, &before);
+    int ret = archive_compact(a, threshold, flags);
+    archive_info(a, &after);
+    archive_close(a);
+    if (ret < 0)
+        print_lib_err(ret);
+
+    char buf[HR_FS_BUFFER_SIZE];
+    if (ret == 0)
+    {
+        hr_file_size(before.dead_bytes, buf);
+        printf("Мертвых данных: %s, меньше порога - уплотнение не нужно\n",
+            buf);
+        return;
+    }
+    // Занятое место может и не уменьшиться: уплотнение на месте дописывает
+    // новый каталог. Освобождено то, что перестало быть мертвым
+    hr_file_size(before.dead_bytes > after.dead_bytes
+            ? before.dead_bytes - after.dead_bytes
+            : 0,
+        buf);
+    printf("Освобождено: %s\n", buf);
 }
 
-int remove_node_from_fi_list(fi_list_t* h, fi_list_t* to)
+/**
+ * Сообщение о файле с несовпавшей контрольной суммой
+ */
+static void report_verify(const char* name, int err, void* ctx)
 {
-    if (h->eof || to->eof)
-        return -1; // Мы не хотим удалить конец, сломав список
-
-    fi_list_t* to_del = to->next;
-    to->next = to->next->next;
-    free(to_del);
-    return 0;
+    (void)err;
+    (void)ctx;
+    fprintf(stderr,
+        "[archiver]: Файл \"%s\": контрольная сумма не совпадает\n", name);
 }
 
-void remove_files_from_header(
-    fi_list_t** header, int fnums, char** fnames, char flag)
+void verify_archive(
+    char* archive, int fnums, char** fnames, struct archive_opts* opts)
 {
-    fi_list_t fictive;
-    fictive.eof = 0;
-    fictive.next = *header;
-    for (fi_list_t* i = &fictive; !i->next->eof;)
+    struct archive_verify_stats stats;
+    opts->report = report_verify;
+    int ret;
+    if (is_stream(archive))
     {
-        char is_there = 0;
-        for (int j = 0; j < fnums; ++j)
-            is_there
-                |= strcmp((const char*)i->next->data.filename, fnames[j]) == 0;
-
-        if (flag ? is_there : !is_there)
-        {
-            remove_node_from_fi_list(&fictive, i);
-            *header = fictive.next;
-            continue;
-        }
-        i = i->next;
+        ret = archive_stream_verify(STDIN_FILENO, fnums, fnames, opts, &stats);
     }
-}
-
-void remove_files(char* archive, int fnums, char** fnames)
-{
-    if (fnums == 0)
+    else
     {
-        print_err(ERR_REMOVE_NOFILES);
+        archive_t* a = open_archive(archive, ARCHIVE_RDONLY);
+        ret = archive_verify(a, fnums, fnames, opts, &stats);
+        archive_close(a);
     }
+    if (ret < 0)
+        print_lib_err(ret);
 
-    int arch_fd = open(archive, O_RDONLY);
-    if (arch_fd == -1)
-    {
-        print_err(ERR_OPEN);
-    }
+    printf("Проверено файлов: %zu, повреждено: %zu", stats.checked,
+        stats.failed);
+    if (stats.unchecked)
+        printf(", без контрольной суммы: %zu", stats.unchecked);
+    putchar('\n');
 
-    const char* temp_file_name = ".supertemp.egleser";
-    int new_fd = open(temp_file_name, O_CREAT | O_WRONLY, 0666);
+    if (stats.failed)
+        exit(EXIT_FAILURE);
+}
 
-    // new_header - то, что будет записано в заголовок нового архива
-    // old_header - то же самое, но со старыми оффсетами. Мы будем обходить его
-    // и писать содержимое старого архива в новый
-    fi_list_t *new_header = init_fi_list(), *old_header = init_fi_list();
-    read_header(new_header, arch_fd);
-    read_header(old_header, arch_fd);
-    remove_files_from_header(&new_header, fnums, fnames, 1);
-    remove_files_from_header(&old_header, fnums, fnames, 1);
-    update_offsets_in_header(new_header);
+/**
+ * Вывод найденной строки. Библиотека не вызывает его одновременно из
+ * нескольких потоков
+ */
+static void print_hit(const char* name, uint64_t lineno, const char* line,
+    size_t len, void* ctx)
+{
+    (void)ctx;
+    printf("%s:%lu:", name, lineno);
+    fwrite(line, 1, len, stdout);
+    putchar('\n');
+}
 
-    for (fi_list_t* i = new_header; !i->eof; i = i->next)
-    {
-        write(new_fd, &i->data, sizeof(file_info_t));
-    }
-    uint32_t end = 0;
-    write(new_fd, &end, HEADER_ENDING_SIZE);
+/**
+ * Сообщение о файле, который не удалось просмотреть
+ */
+static void report_grep(const char* name, int err, void* ctx)
+{
+    (void)ctx;
+    fprintf(stderr, "[archiver]: Файл \"%s\": %s. Пропущено\n", name,
+        err == ARCHIVE_EIO ? strerror(errno) : archive_strerror(err));
+}
+
+void grep_archive(
+    char* archive, int argc, char** argv, struct archive_opts* opts)
+{
+    if (argc < 1)
+        print_err(ERR_ARGS);
+    if (is_stream(archive))
+        print_err(ERR_STREAM_MODE);
+
+    opts->report = report_grep;
+    archive_t* a = open_archive(archive, ARCHIVE_RDONLY);
+    int ret = archive_grep(a, argv[0], argc - 1, argv + 1, opts, print_hit,
+        NULL);
+    archive_close(a);
+    if (ret < 0)
+        print_lib_err(ret);
+    if (ret == 0)
+        exit(EXIT_FAILURE);
+}
+
+/**
+ * Разбирает диапазон "НАЧАЛО[:[ДЛИНА]]" файла размера size
+ * \return 0 или -1, если диапазон записан неверно
+ */
+static int parse_range(
+    const char* range, uint64_t size, uint64_t* off, uint64_t* len)
+{
+    char* end = NULL;
+    errno = 0;
+    long long start = strtoll(range, &end, 10);
+    if (end == range || errno != 0 || (*end != '\0' && *end != ':'))
+        return -1;
+    // Отступ от конца считается в беззнаковых: -LLONG_MIN не помещается в
+    // long long
+    uint64_t back = 0 - (uint64_t)start;
+    if (start >= 0)
+        *off = start;
+    else
+        *off = back < size ? size - back : 0;
 
-    for (fi_list_t* i = old_header; !i->eof; i = i->next)
+    *len = UINT64_MAX;
+    if (*end == ':' && end[1] != '\0')
     {
-        copy_file(arch_fd, new_fd, i->data.filesize, i->data._offset);
+        const char* from = end + 1;
+        unsigned long long n = strtoull(from, &end, 10);
+        if (*from == '-' || *end != '\0' || errno != 0)
+            return -1;
+        *len = n;
     }
-
-    remove(archive);
-    rename(temp_file_name, archive);
-    free_fi_list(new_header);
-    free_fi_list(old_header);
-    close(arch_fd);
-    close(new_fd);
+    return 0;
 }
 
-void copy_file(int old, int new, uint64_t bytes, off_t pos)
+void cat_member(char* archive, int argc, char** argv)
 {
-    lseek(old, pos, SEEK_SET);
-    char buf[BUFFER_SIZE];
-    while (bytes > BUFFER_SIZE)
+    if (is_stream(archive))
+        print_err(ERR_STREAM_MODE);
+
+    const char* name = NULL;
+    const char* range = "0";
+    for (int i = 0; i < argc; ++i)
     {
-        read(old, buf, BUFFER_SIZE);
-        write(new, buf, BUFFER_SIZE);
-        bytes -= BUFFER_SIZE;
+        if (strcmp(argv[i], "--range") == 0)
+        {
+            if (i + 1 >= argc)
+                print_err(ERR_ARGS);
+            range = argv[++i];
+        }
+        else if (!name)
+            name = argv[i];
+        else
+            print_err(ERR_ARGS);
     }
+    if (!name)
+        print_err(ERR_ARGS);
 
-    if (bytes > 0)
+    archive_t* a = open_archive(archive, ARCHIVE_RDONLY);
+    archive_member_t m;
+    int ret = archive_lookup(a, name, &m);
+    uint64_t off, len;
+    if (ret == 0 && parse_range(range, m.size, &off, &len) == -1)
     {
-        read(old, buf, bytes);
-        write(new, buf, bytes);
+        archive_close(a);
+        print_err(ERR_ARGS);
     }
+    int64_t done = ret ? ret : archive_cat(a, &m, off, len, STDOUT_FILENO);
+    archive_close(a);
+    if (done < 0)
+        print_lib_err(done);
 }
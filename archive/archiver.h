@@ -0,0 +1,399 @@
+#ifndef ARCHIVER_H
+#define ARCHIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * \file archiver.h
+ * Публичный интерфейс библиотеки libarchiver
+ *
+ * Библиотека открывает архив один раз (archive_open), после чего файлы архива
+ * можно искать по имени (archive_lookup), перебирать (archive_iter_next) и
+ * читать с произвольного места (archive_pread), не извлекая их на диск.
+ * Функции не завершают программу: при ошибке возвращается отрицательный код
+ * ARCHIVE_E*, текст которого дает archive_strerror(). При ARCHIVE_EIO
+ * причина остается в errno.
+ *
+ * Чтение (archive_lookup, archive_iter_next, archive_pread, archive_info)
+ * можно вызывать из нескольких потоков одновременно. Изменение архива
+ * (archive_insert, archive_remove) должно быть единственной операцией над
+ * этим archive_t в данный момент.
+ *
+ * archive_grep ищет строки по регулярному выражению прямо в файлах архива,
+ * параллельно и без извлечения на диск, а archive_cat выводит диапазон
+ * байт одного файла в канал или другой дескриптор.
+ *
+ * Потоковый архив (archive_stream_*) пишется и читается через любой
+ * дескриптор, в том числе канал, за один последовательный проход. Открыть
+ * его через archive_open нельзя.
+ *
+ * Утилита archiver - тонкая обертка над этой библиотекой.
+ */
+
+/**
+ * Открытый архив
+ */
+typedef struct archive archive_t;
+
+/**
+ * Коды ошибок библиотеки. Все функции возвращают их со знаком минус
+ */
+enum archive_error
+{
+    ARCHIVE_OK = 0, //!< Успех
+    ARCHIVE_EIO = -1, //!< Ошибка ввода-вывода, подробности в errno
+    ARCHIVE_ENOMEM = -2, //!< Не хватает памяти
+    ARCHIVE_EFORMAT = -3, //!< Каталог архива поврежден
+    ARCHIVE_EVERSION = -4, //!< Архив записан неподдерживаемой версией формата
+    ARCHIVE_ENOENT = -5, //!< Такого файла в архиве нет
+    ARCHIVE_ECORRUPT = -6, //!< Данные файла повреждены
+    ARCHIVE_EINVAL = -7, //!< Неверные аргументы
+    ARCHIVE_ENOFILES = -8, //!< Не добавлен ни один указанный файл
+    ARCHIVE_ENOTREG = -9, //!< Файл не регулярный
+    ARCHIVE_ESTREAM = -10 //!< Это потоковый архив (archive_stream_*)
+};
+
+/**
+ * Флаги archive_open
+ */
+#define ARCHIVE_RDONLY 0x0 //!< Только чтение
+#define ARCHIVE_RDWR 0x1 //!< Чтение и вставка файлов
+#define ARCHIVE_CREATE 0x2 //!< Создать архив, если его нет (с ARCHIVE_RDWR)
+
+#define ARCHIVE_MAX_JOBS 256 //!< Наибольшее archive_opts::jobs
+
+/**
+ * Флаги файла архива (archive_member::flags)
+ */
+#define ARCHIVE_MEMBER_COMPRESSED 0x1 //!< Файл сжат
+#define ARCHIVE_MEMBER_DEDUP 0x2 //!< Файл дедуплицирован
+#define ARCHIVE_MEMBER_CHECKSUM 0x4 //!< Для файла хранится CRC32C
+#define ARCHIVE_MEMBER_SPARSE 0x10 //!< Файл разреженный, дыры не хранятся
+
+/**
+ * Описание файла архива
+ *
+ * name указывает внутрь archive_t и действителен до archive_close или до
+ * первого изменения архива. То же относится ко всей структуре: после
+ * archive_insert/archive_remove ее надо получить заново
+ */
+struct archive_member
+{
+    const char* name; //!< Имя файла
+    uint64_t size; //!< Исходный размер файла
+    uint64_t stored_size; //!< Размер данных в архиве
+    uint32_t mode; //!< Права доступа
+    uint32_t flags; //!< Флаги ARCHIVE_MEMBER_*
+    uint32_t checksum; //!< CRC32C содержимого (если ARCHIVE_MEMBER_CHECKSUM)
+    size_t index; //!< Номер записи в каталоге
+};
+typedef struct archive_member archive_member_t;
+
+/**
+ * Итератор по файлам архива в порядке каталога
+ */
+struct archive_iter
+{
+    archive_t* archive;
+    size_t next;
+};
+typedef struct archive_iter archive_iter_t;
+
+/**
+ * Сообщение о проблеме с отдельным файлом во время массовой операции. Сама
+ * операция при этом продолжается. При вставке директорий вызывается из
+ * нескольких потоков обхода одновременно
+ * \param name Имя файла (путь при вставке)
+ * \param err Код ARCHIVE_E*; при ARCHIVE_EIO errno еще не испорчен
+ * \param ctx archive_opts::report_ctx
+ */
+typedef void (*archive_report_fn)(const char* name, int err, void* ctx);
+
+/**
+ * Параметры массовых операций (вставка, извлечение, проверка)
+ */
+struct archive_opts
+{
+    int jobs; //!< Количество потоков
+    int compress; //!< Сжимать вставляемые файлы
+    int dedup; //!< Дедуплицировать вставляемые файлы
+    int update; //!< Режим обновления при вставке: 0 или ARCHIVE_UPDATE_*
+    archive_report_fn report; //!< Куда сообщать о проблемах с файлами
+    void* report_ctx;
+};
+
+/**
+ * Вставлять только новые и изменившиеся файлы: неизменившимся считается
+ * файл с тем же размером, правами и временем изменения, что и его последняя
+ * копия в архиве
+ */
+#define ARCHIVE_UPDATE_MTIME 1
+
+/**
+ * Как ARCHIVE_UPDATE_MTIME, но если изменилось только время, файл читается
+ * и сравнивается с архивом по CRC32C. Совпавший не вставляется заново, а
+ * только получает в каталоге новое время
+ */
+#define ARCHIVE_UPDATE_HASH 2
+
+/**
+ * Сводная информация об архиве
+ */
+struct archive_info
+{
+    uint64_t members; //!< Количество файлов
+    uint64_t chunks; //!< Количество уникальных чанков
+    uint64_t chunk_bytes; //!< Сколько места занимают чанки
+    uint64_t deleted; //!< Удаленных файлов, еще не убранных уплотнением
+    uint64_t used_bytes; //!< Сколько места на диске занимает архив
+    uint64_t dead_bytes; //!< Из них занято данными, на которые никто не ссылается
+};
+
+/**
+ * Флаги archive_compact
+ */
+#define ARCHIVE_COMPACT_REWRITE 0x1 //!< Переписать архив, а не пробивать дыры
+
+/**
+ * Итоги проверки контрольных сумм
+ */
+struct archive_verify_stats
+{
+    size_t checked; //!< Проверено файлов
+    size_t failed; //!< Из них повреждено
+    size_t unchecked; //!< Файлов без контрольной суммы
+};
+
+/**
+ * Заполняет opts значениями по умолчанию: один поток, без сжатия и
+ * дедупликации, без сообщений
+ */
+void archive_opts_init(struct archive_opts* opts);
+
+/**
+ * Открывает архив и читает его каталог
+ *
+ * Архив блокируется (flock) до archive_close: с ARCHIVE_RDONLY - общей
+ * блокировкой, с ARCHIVE_RDWR - исключительной. Поэтому читать архив могут
+ * сразу несколько процессов, а изменяющий его ждет, пока они закончат, и
+ * сам не пускает никого. Тот же архив, открытый второй раз в одном процессе
+ * для записи, ждет первого открытия
+ * \param path Путь к архиву
+ * \param flags ARCHIVE_RDONLY или ARCHIVE_RDWR (| ARCHIVE_CREATE)
+ * \param out Куда записать открытый архив
+ * \return 0 или код ошибки
+ */
+int archive_open(const char* path, int flags, archive_t** out);
+
+/**
+ * Закрывает архив и освобождает его память. a может быть NULL
+ */
+void archive_close(archive_t* a);
+
+/**
+ * Текстовое описание кода ошибки
+ */
+const char* archive_strerror(int err);
+
+/**
+ * Заполняет сводную информацию об архиве
+ */
+void archive_info(archive_t* a, struct archive_info* info);
+
+/**
+ * Ищет файл по имени. Если файл вставлялся несколько раз, находится
+ * последняя копия
+ * \return 0 или ARCHIVE_ENOENT
+ */
+int archive_lookup(archive_t* a, const char* name, archive_member_t* member);
+
+/**
+ * Ставит итератор на первый файл архива
+ */
+void archive_iter_init(archive_t* a, archive_iter_t* it);
+
+/**
+ * Выдает очередной файл архива
+ * \return 1 - member заполнен, 0 - файлы кончились
+ */
+int archive_iter_next(archive_iter_t* it, archive_member_t* member);
+
+/**
+ * Читает len байт файла member, начиная с offset (в исходных, несжатых
+ * данных). Сжатые и дедуплицированные файлы распаковываются только в нужном
+ * диапазоне
+ * \return Количество прочитанных байт (меньше len только в конце файла) или
+ * код ошибки
+ */
+ssize_t archive_pread(archive_t* a, const archive_member_t* member, void* buf,
+    size_t len, uint64_t offset);
+
+/**
+ * Пишет в out_fd len байт файла member, начиная с offset, - как
+ * archive_pread, но без буфера вызывающего. Несжатый файл читается с
+ * подсказками posix_fadvise (SEQUENTIAL на весь диапазон, WILLNEED на его
+ * начало) и в канал идет через splice, так что данные не покидают ядро и
+ * читается только нужный диапазон. Сжатые и дедуплицированные файлы
+ * распаковываются кусками. Диапазон за концом файла обрезается
+ * \param out_fd Канал, терминал, сокет или файл (пишется с текущей позиции)
+ * \return Количество записанных байт или код ошибки
+ */
+int64_t archive_cat(archive_t* a, const archive_member_t* member,
+    uint64_t offset, uint64_t len, int out_fd);
+
+/**
+ * Вставляет файлы в архив (архив должен быть открыт с ARCHIVE_RDWR). Файлы,
+ * которые не удалось прочитать, пропускаются с сообщением через opts->report
+ * \param fnums Количество файлов
+ * \param fnames Пути к файлам; в архив попадает только имя. Директории
+ * обходятся рекурсивно (параллельно, без перехода по символическим ссылкам),
+ * их файлы попадают в архив с путями от самой директории: "a/src" дает
+ * "src/main.c"
+ *
+ * С opts->update неизменившиеся файлы пропускаются, а изменившиеся
+ * дописываются в архив, и их старые копии с тем же именем помечаются
+ * удаленными (как archive_remove). Так стоимость обновления зависит от
+ * объема изменений, а не от размера дерева
+ * \return Количество вставленных файлов или код ошибки (ARCHIVE_ENOFILES,
+ * если не вставлен ни один; с opts->update это не ошибка, а 0)
+ */
+int archive_insert(
+    archive_t* a, int fnums, char** fnames, const struct archive_opts* opts);
+
+/**
+ * Удаляет файлы из архива (архив должен быть открыт с ARCHIVE_RDWR). Записи
+ * только помечаются удаленными, и дописывается новый каталог, так что
+ * удаление стоит O(каталог); место освобождает archive_compact
+ * \return Количество удаленных записей или код ошибки
+ */
+int archive_remove(archive_t* a, int fnums, char** fnames);
+
+/**
+ * Освобождает место, занятое удаленными файлами и старыми каталогами
+ * (архив должен быть открыт с ARCHIVE_RDWR)
+ *
+ * По умолчанию мертвые участки освобождаются на месте через
+ * fallocate(FALLOC_FL_PUNCH_HOLE): архив не копируется, но его размер
+ * (st_size) не меняется. Если ФС этого не умеет или указан
+ * ARCHIVE_COMPACT_REWRITE, живые данные переносятся в новый файл
+ * (copy_file_range, без копирования через память), заодно выбрасываются
+ * чанки, на которые больше не ссылается ни один файл
+ * \param threshold Уплотнять, только если мертвые данные занимают не меньше
+ * threshold процентов архива (0 - всегда)
+ * \param flags ARCHIVE_COMPACT_*
+ * \return 1 - архив уплотнен, 0 - мертвых данных меньше порога, или код
+ * ошибки
+ */
+int archive_compact(archive_t* a, int threshold, int flags);
+
+/**
+ * Извлекает файлы архива в текущую директорию
+ * \param fnums Количество файлов. Если 0, извлекается весь архив
+ * \return Количество файлов, которые не удалось извлечь целыми, или код
+ * ошибки
+ */
+int archive_extract(
+    archive_t* a, int fnums, char** fnames, const struct archive_opts* opts);
+
+/**
+ * Проверяет контрольные суммы файлов архива
+ * \param fnums Количество файлов. Если 0, проверяется весь архив
+ * \param stats Куда записать итоги
+ * \return 0 или код ошибки
+ */
+int archive_verify(archive_t* a, int fnums, char** fnames,
+    const struct archive_opts* opts, struct archive_verify_stats* stats);
+
+/**
+ * Строка файла архива, в которой нашлось совпадение (см. archive_grep).
+ * Вызывается из потоков поиска, но никогда одновременно: строки одного файла
+ * приходят по порядку
+ * \param name Имя файла
+ * \param lineno Номер строки, с 1
+ * \param line Строка без '\n'. Не обязательно кончается '\0' и действительна
+ * только до возврата
+ * \param len Длина строки
+ * \param ctx ctx из archive_grep
+ */
+typedef void (*archive_grep_fn)(const char* name, uint64_t lineno,
+    const char* line, size_t len, void* ctx);
+
+/**
+ * Ищет строки, подходящие под расширенное регулярное выражение POSIX
+ * pattern, в файлах архива, не извлекая их. Файлы раздаются opts->jobs
+ * потокам; несжатые файлы просматриваются прямо в отображении архива
+ * (mmap), остальные распаковываются кусками в буфер. Поврежденные файлы
+ * пропускаются с сообщением через opts->report
+ * \param fnums Количество файлов. Если 0, поиск идет по всему архиву
+ * \param hit Куда передавать найденные строки
+ * \return Количество файлов, в которых нашлось совпадение, или код ошибки
+ * (ARCHIVE_EINVAL, если pattern не компилируется)
+ */
+int archive_grep(archive_t* a, const char* pattern, int fnums, char** fnames,
+    const struct archive_opts* opts, archive_grep_fn hit, void* ctx);
+
+/**
+ * Включает (on != 0) или выключает сбор статистики: время фаз (чтение
+ * каталога, stat, перенос данных, запись каталога, fdatasync, rename),
+ * счетчики системных вызовов и байт, скорость переноса каждого файла и
+ * самые медленные файлы. Статистика общая для всех архивов процесса и
+ * копится, пока ее не сбросит archive_stats_reset. Выключенный сбор почти
+ * ничего не стоит
+ *
+ * Без изменения программы сбор включается переменной окружения
+ * ARCHIVER_STATS: тогда при выходе из программы статистика дописывается
+ * строкой JSON (archive_stats_write) в файл из переменной ("-", "1" или
+ * пустая строка - stderr)
+ */
+void archive_stats_enable(int on);
+
+/**
+ * Обнуляет статистику и начинает отсчет общего времени заново
+ */
+void archive_stats_reset(void);
+
+/**
+ * Пишет статистику в fd одной строкой JSON:
+ *
+ *     {"wall_ms":..., "phases_ms":{"header":...,...}, "counters":{...},
+ *      "members":{"count":...,"bytes":...,"busy_ms":...,"mb_s":...},
+ *      "slowest":[{"name":...,"bytes":...,"ms":...,"mb_s":...},...]}
+ *
+ * Мелкие файлы, которые переносятся пачками через io_uring, считаются в
+ * счетчиках, но не в members
+ * \return 0 или код ошибки
+ */
+int archive_stats_write(int fd);
+
+/**
+ * Пишет файлы потоковым архивом в out_fd (например, в канал). Дескриптор
+ * не закрывается. Дедупликация в потоке не поддерживается
+ * \param fnames Пути к файлам; в архив попадает только имя. Директории
+ * обходятся рекурсивно, как в archive_insert
+ * \return Количество записанных файлов или код ошибки (ARCHIVE_EINVAL при
+ * opts->dedup или opts->update, ARCHIVE_ENOFILES, если не записан ни один)
+ */
+int archive_stream_write(
+    int out_fd, int fnums, char** fnames, const struct archive_opts* opts);
+
+/**
+ * Читает потоковый архив из in_fd и извлекает файлы в текущую директорию
+ * \param fnums Количество файлов. Если 0, извлекается весь архив
+ * \return Количество файлов, которые не удалось извлечь целыми, или код
+ * ошибки, после которой поток нельзя дочитать
+ */
+int archive_stream_extract(
+    int in_fd, int fnums, char** fnames, const struct archive_opts* opts);
+
+/**
+ * Читает потоковый архив из in_fd и проверяет контрольные суммы файлов
+ * \param fnums Количество файлов. Если 0, проверяется весь архив
+ * \param stats Куда записать итоги
+ * \return 0 или код ошибки
+ */
+int archive_stream_verify(int in_fd, int fnums, char** fnames,
+    const struct archive_opts* opts, struct archive_verify_stats* stats);
+
+#endif
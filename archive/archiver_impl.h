@@ -0,0 +1,963 @@
+#ifndef ARCHIVER_IMPL_H
+#define ARCHIVER_IMPL_H
+
+#include "archiver.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * \file archiver_impl.h
+ * Внутренности libarchiver: формат архива и функции, общие для единиц
+ * трансляции библиотеки. Наружу (в libarchiver.so) не экспортируются
+ */
+
+#define FILENAME_LENGTH 256
+#define HEADER_ENDING_SIZE 4
+#define ARCH_MAGIC "EGLESER"
+#define ARCH_MAGIC_SIZE 8
+#define ARCH_VERSION 9
+#define ARCH_DIR_ALIGN 64 //!< Выравнивание каталога в архиве
+#define ARCH_HOST_LE (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define COPY_BUFFER_MIN (64 * 1024)
+#define COPY_BUFFER_MAX (4 * 1024 * 1024)
+#define COPY_CHUNK (1024 * 1024 * 1024)
+#define HEADER_CHUNK 4096
+#define MAX_JOBS ARCHIVE_MAX_JOBS
+#define LZ_BLOCK_SIZE (128 * 1024)
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_END_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+#define LZ_RAW_BLOCK 0x80000000u
+#define LZ_BATCH_PER_JOB 4
+#define FI_COMPRESSED ARCHIVE_MEMBER_COMPRESSED
+#define FI_DEDUP ARCHIVE_MEMBER_DEDUP
+#define FI_CHECKSUM ARCHIVE_MEMBER_CHECKSUM
+#define FI_DELETED 0x8 //!< Надгробие: файл удален, данные ждут уплотнения
+#define FI_SPARSE ARCHIVE_MEMBER_SPARSE
+#define SPARSE_PIECE_MAX (1u << 30) //!< Наибольший кусок карты разреженного файла
+#define CRC32C_POLY 0x82f63b78u
+#define VERIFY_BUFFER_SIZE (4 * 1024 * 1024)
+#define CDC_MIN_CHUNK (2 * 1024)
+#define CDC_MAX_CHUNK (64 * 1024)
+#define CDC_MASK 0xfff8000000000000ull
+#define CDC_BUFFER_SIZE (4 * 1024 * 1024)
+#define CHUNK_HASH_SIZE 16
+#define STREAM_MAGIC "EGLSTRM"
+#define STREAM_VERSION 4
+#define STREAM_NAME_MAX 4096 //!< Наибольшая длина имени в потоке
+#define STREAM_TAG_SIZE 4
+#define STREAM_TAG_MEMBER "MEMB"
+#define STREAM_TAG_TRAILER "TRLR"
+#define STREAM_FRAME_SIZE (1024 * 1024)
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+#define URING_ENV "ARCHIVER_IO_URING" //!< "0" в окружении отключает io_uring
+#define URING_ENTRIES 128 //!< Размер очереди отправки
+#define URING_BATCH 64 //!< Мелких файлов в одной пачке io_uring
+#define URING_SMALL_FILE (64 * 1024) //!< Наибольший "мелкий" файл
+#define URING_OP_BITS 6
+#define WALK_BATCH_SIZE 1024 //!< Файлов в одной пачке обхода директорий
+#define WALK_MIN_JOBS 4 //!< Наименьшее число потоков обхода
+#define WALK_MAX_OPEN_DIRS 256 //!< Сколько директорий обхода держать открытыми
+#define PIPE_BUFFER_SIZE COPY_BUFFER_MAX //!< Буфер конвейера вставки
+#define PIPE_DEPTH 2 //!< Буферов в кольце одного читателя конвейера
+#define PIPE_MIN_READERS 4 //!< Наименьшее число читателей конвейера
+#define GREP_BUFFER_SIZE (4 * 1024 * 1024) //!< Буфер поиска в сжатых файлах
+#define GREP_OUT_SIZE (256 * 1024) //!< Сколько найденных строк копить
+#define CAT_READAHEAD (8 * 1024 * 1024) //!< Сколько просить заранее (--cat)
+#define CAT_BUFFER_SIZE (1024 * 1024) //!< Буфер --cat для сжатых файлов
+#define STATS_ENV "ARCHIVER_STATS" //!< Файл для статистики при выходе
+#define TEMP_SUFFIX ".XXXXXX" //!< Имя временного файла без O_TMPFILE
+#define TEMP_ATTEMPTS 100 //!< Сколько имен пробовать для linkat
+#define STATS_SLOWEST 10 //!< Сколько самых медленных файлов помнить
+
+/**
+ * Информация о файле в архиве
+ *
+ * \note Для переносимости файла архива используются следующие техники:
+ * * Используются независимые от платформы типы: uint32_t, uint64_t
+ * * Поля упорядочены так, что выравнивание естественное и без дыр: запись -
+ *   ровно 64 байта, и каталог можно отобразить в память и читать на месте
+ * * В архиве все числа little-endian (см. file_info_le)
+ */
+struct file_info;
+typedef struct file_info file_info_t;
+
+struct file_info
+{
+    uint64_t name_offset; //!< Положение имени в таблице строк каталога
+    uint64_t filesize; //!< Размер файла (исходный)
+    uint64_t mask; //!< Маска прав доступа к файлу
+    uint64_t _offset; //!< Положение файла в архиве
+    uint64_t stored_size; //!< Размер данных файла в архиве
+    uint64_t flags; //!< Флаги FI_*
+    uint64_t mtime; //!< Время изменения исходного файла, нс; 0 - неизвестно
+    uint32_t name_length; //!< Длина имени без завершающего '\0'
+    uint32_t checksum; //!< CRC32C исходного содержимого (если FI_CHECKSUM)
+};
+_Static_assert(sizeof(file_info_t) == 64, "file_info - 64 байта без дыр");
+
+/**
+ * Чанк дедуплицированных данных
+ */
+struct chunk_info
+{
+    uint8_t hash[CHUNK_HASH_SIZE]; //!< Хеш содержимого (MurmurHash3 x64 128)
+    uint64_t _offset; //!< Положение чанка в архиве
+    uint32_t size; //!< Размер чанка
+    uint32_t stored_size; //!< Размер в архиве. Меньше size - чанк сжат
+};
+typedef struct chunk_info chunk_info_t;
+_Static_assert(sizeof(chunk_info_t) == 32, "chunk_info - 32 байта без дыр");
+
+/**
+ * Запись заголовка архива старого формата (без суперблока)
+ */
+struct legacy_file_info
+{
+    uint8_t filename[FILENAME_LENGTH];
+    uint64_t filesize;
+    uint64_t mask;
+    uint64_t _offset;
+} __attribute__((packed));
+typedef struct legacy_file_info legacy_file_info_t;
+
+/**
+ * Суперблок архива
+ *
+ * Лежит в самом начале архива и указывает на актуальный каталог. Перезапись
+ * суперблока - момент фиксации изменений архива
+ */
+struct arch_super;
+typedef struct arch_super arch_super_t;
+
+#pragma pack(push, 1)
+struct arch_super
+{
+    uint8_t magic[ARCH_MAGIC_SIZE]; //!< Сигнатура ARCH_MAGIC
+    uint32_t version; //!< Версия формата, ARCH_VERSION
+    uint32_t dir_crc; //!< CRC32C каталога
+    uint64_t dir_offset; //!< Положение каталога в архиве
+    uint64_t dir_count; //!< Количество записей в каталоге
+    uint64_t names_size; //!< Размер таблицы строк за записями каталога
+    uint64_t chunk_count; //!< Количество чанков в таблице за строками
+};
+#pragma pack(pop)
+
+/**
+ * Таблица чанков с хеш-индексом по содержимому (открытая адресация, в
+ * index лежат номера чанков +1, 0 - пусто)
+ */
+struct chunk_table
+{
+    chunk_info_t* items;
+    size_t count;
+    size_t cap;
+    size_t* index;
+    size_t index_cap; //!< Степень двойки
+    char mapped; //!< items лежат в отображении каталога (fi_table::dir_map)
+};
+typedef struct chunk_table chunk_table_t;
+
+/**
+ * Декодированный заголовок архива
+ *
+ * Записи лежат в непрерывном массиве items в порядке каталога, а их имена -
+ * подряд в таблице строк names, каждое с завершающим '\0', так что имя
+ * записи - это просто names + name_offset (fi_table_name). Для поиска по
+ * имени используется хеш-таблица с цепочками: buckets[h] - номер первой записи
+ * с хешем h (+1, 0 - пусто), chain[i] - номер следующей записи в той же
+ * цепочке (+1). Записи с одинаковыми именами попадают в одну цепочку, поэтому
+ * их можно перебрать через fi_table_find_next()
+ *
+ * Каталог архива на little-endian хосте не копируется:
+ * он отображается в память (MAP_PRIVATE), и items, names и chunks.items
+ * указывают прямо в отображение. Массив копируется в кучу, только когда ему
+ * нужно вырасти; правки записей на месте остаются в памяти процесса
+ */
+struct fi_table
+{
+    file_info_t* items; //!< Записи каталога
+    const char** src; //!< Пути к исходным файлам (только для вставляемых файлов)
+    size_t count; //!< Количество записей
+    size_t cap; //!< Вместимость items, src и chain
+    char* names; //!< Таблица строк
+    size_t names_size; //!< Занято в names
+    size_t names_cap; //!< Вместимость names
+    size_t* buckets; //!< Корзины хеш-индекса
+    size_t* chain; //!< Следующая запись в цепочке
+    size_t nbuckets; //!< Количество корзин (степень двойки)
+    chunk_table_t chunks; //!< Таблица чанков дедуплицированных файлов
+    void* dir_map; //!< Отображение каталога или NULL
+    size_t dir_map_size;
+};
+typedef struct fi_table fi_table_t;
+
+/**
+ * Заголовок потокового архива
+ */
+struct stream_head
+{
+    uint8_t magic[ARCH_MAGIC_SIZE]; //!< Сигнатура STREAM_MAGIC
+    uint32_t version; //!< Версия формата, STREAM_VERSION
+    uint32_t reserved;
+} __attribute__((packed));
+
+/**
+ * Окончание файла в потоковом архиве (идет за последним кадром данных)
+ */
+struct stream_member_end
+{
+    uint64_t filesize; //!< Сколько байт файла на самом деле прочитано
+    uint64_t stored_size; //!< Размер кадров файла в потоке
+    uint32_t checksum; //!< CRC32C содержимого
+} __attribute__((packed));
+
+/**
+ * Самый конец потокового архива: позволяет найти индекс, если поток был
+ * сохранен в файл
+ */
+struct stream_tail
+{
+    uint64_t trailer_offset; //!< Положение индекса от начала потока
+    uint8_t magic[ARCH_MAGIC_SIZE]; //!< Сигнатура STREAM_MAGIC
+} __attribute__((packed));
+
+/**
+ * Участок с данными разреженного файла
+ */
+struct sparse_extent
+{
+    uint64_t offset; //!< Начало участка в файле
+    uint64_t length; //!< Длина участка
+};
+
+/**
+ * Один блок для параллельного сжатия/распаковки
+ */
+struct lz_task
+{
+    const uint8_t* src; //!< Входные данные
+    size_t src_len;
+    uint8_t* dst; //!< Выходной буфер
+    size_t dst_len; //!< Вместимость dst; после сжатия - размер результата
+    char raw; //!< Блок хранится без сжатия
+    char failed; //!< Блок не удалось распаковать
+};
+
+/**
+ * Кусок сжатого или дедуплицированного файла: блок LZ или чанк. Нужен для
+ * чтения с произвольного места (archive_pread)
+ */
+struct piece
+{
+    uint64_t orig_off; //!< Начало куска в исходных данных
+    uint64_t stored_off; //!< Положение куска в архиве
+    uint32_t orig_len; //!< Исходный размер
+    uint32_t stored_len; //!< Размер в архиве
+    char raw; //!< Кусок лежит без сжатия
+    char hole; //!< Дыра разреженного файла: читается как нули
+};
+
+/**
+ * Карта кусков одного файла, по возрастанию orig_off
+ */
+struct piece_map
+{
+    size_t count;
+    struct piece items[];
+};
+
+/**
+ * Регулярный файл, найденный обходом директорий
+ */
+struct walk_entry
+{
+    size_t path; //!< Положение пути к файлу в arena пачки
+    size_t name; //!< Положение имени в архиве (суффикса пути) в arena
+    uint64_t size; //!< Размер файла
+    uint64_t mask; //!< Права доступа
+    uint64_t mtime; //!< Время изменения, нс
+};
+
+/**
+ * Пачка файлов, найденных обходом. Пути лежат подряд в arena
+ */
+struct walk_batch
+{
+    struct walk_batch* next; //!< Следующая готовая пачка
+    size_t count;
+    struct walk_entry items[WALK_BATCH_SIZE];
+    char* arena;
+    size_t arena_size;
+    size_t arena_cap;
+};
+
+/**
+ * Обход дерева директорий (walk.c)
+ */
+struct walker;
+
+/**
+ * Конвейер вставки (pipeline.c)
+ */
+struct pipeline;
+
+/**
+ * Операции фаз io_uring. В user_data лежит номер файла пачки, сдвинутый на
+ * URING_OP_BITS, и операция
+ */
+enum uring_op
+{
+    URING_OPEN_READ = 1, //!< Открыть исходный файл на чтение
+    URING_READ_FILE = 2, //!< Прочитать исходный файл целиком
+    URING_READ_ARCH = 4, //!< Прочитать данные файла из архива
+    URING_OPEN_CREATE = 8, //!< Создать файл для извлечения
+    URING_WRITE_FILE = 16, //!< Записать данные в созданный файл
+    URING_CLOSE = 32, //!< Закрыть файл
+};
+
+/**
+ * Мелкий файл в пачке io_uring
+ */
+struct small_file
+{
+    const char* path; //!< Путь к исходному файлу или к извлекаемому
+    uint8_t* buf; //!< Данные файла
+    uint64_t off; //!< Положение данных в архиве (для извлечения)
+    uint32_t size; //!< Размер; после чтения файла - сколько прочитано
+    uint32_t mask; //!< Права создаваемого файла
+    int fd;
+    int err; //!< errno первой неудачной операции или 0
+    uint8_t failed_op; //!< Неудачная операция (uring_op)
+};
+
+/**
+ * Кольцо io_uring (uring.c). fd = -1 - io_uring недоступен
+ */
+struct uring
+{
+    int fd;
+    unsigned entries; //!< Размер очереди отправки
+    unsigned queued; //!< Поставлено, но еще не отправлено
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* ring; //!< Общее отображение SQ и CQ
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+/**
+ * Фазы работы, время которых считает статистика (см. stats.c)
+ */
+enum stats_phase
+{
+    STATS_HEADER, //!< Открытие архива и чтение каталога
+    STATS_STAT, //!< stat вставляемых файлов и обход директорий
+    STATS_COPY, //!< Перенос данных файлов
+    STATS_DIRECTORY, //!< Запись каталога
+    STATS_SYNC, //!< fdatasync и запись суперблока
+    STATS_RENAME, //!< Подмена переписанного архива
+    STATS_PHASES
+};
+
+/**
+ * Счетчики системных вызовов и байт статистики
+ */
+enum stats_counter
+{
+    STATS_READ_CALLS,
+    STATS_READ_BYTES,
+    STATS_WRITE_CALLS,
+    STATS_WRITE_BYTES,
+    STATS_COPY_RANGE_CALLS,
+    STATS_SENDFILE_CALLS,
+    STATS_SPLICE_CALLS,
+    STATS_KERNEL_COPY_BYTES, //!< Скопировано copy_file_range, sendfile, splice
+    STATS_URING_ENTER_CALLS,
+    STATS_OPEN_CALLS,
+    STATS_STAT_CALLS,
+    STATS_SYNC_CALLS,
+    STATS_COUNTERS
+};
+
+/**
+ * Открытый архив
+ */
+struct archive
+{
+    char* path; //!< Путь к архиву (для переписывания)
+    int fd; //!< Файловый дескриптор архива
+    int flags; //!< Флаги archive_open
+    fi_table_t header; //!< Каталог
+    struct piece_map** maps; //!< Карты кусков файлов, строятся по требованию
+    pthread_mutex_t maps_lock; //!< Защищает maps
+};
+
+#pragma GCC visibility push(hidden)
+
+/**
+ * Читает заголовок (см. документацию \ref index "к основной странице") и
+ * дописывает его записи, имена и чанки в таблицу header. После устанавливает
+ * указатель в файле на начало. Понимает как новый формат (с суперблоком), так
+ * и старый.
+ *
+ * Каталог нового формата в пустую таблицу отображается в память (MAP_PRIVATE,
+ * см. fi_table::dir_map), иначе читается копией по суперблоку; старый
+ * заголовок - большими кусками по HEADER_CHUNK записей. Заголовок читается
+ * один раз за открытие архива и дальше переиспользуется всеми операциями
+ * \param header Таблица, в которую добавляются записи
+ * \param arch_fd Файловый дескриптор архива
+ * \return 0 или код ошибки (ARCHIVE_EFORMAT, если каталог поврежден)
+ */
+int read_header(fi_table_t* header, int arch_fd);
+
+/**
+ * Читает ровно n байт с позиции off, повторяя pread при коротком чтении
+ * \return Количество прочитанных байт (меньше n только в конце файла) или -1
+ */
+ssize_t pread_full(int fd, void* buf, size_t n, off_t off);
+
+/**
+ * Записывает n байт с позиции off, повторяя pwrite при короткой записи
+ * \return 0 или -1 при ошибке
+ */
+int pwrite_full(int fd, const void* buf, size_t n, off_t off);
+
+/**
+ * Читает n байт с текущей позиции (в том числе из канала), повторяя read
+ * \return Количество прочитанных байт (меньше n только в конце потока) или -1
+ */
+ssize_t read_full(int fd, void* buf, size_t n);
+
+/**
+ * Записывает n байт в текущую позицию (в том числе в канал), повторяя write
+ * \return 0 или -1 при ошибке
+ */
+int write_full(int fd, const void* buf, size_t n);
+
+/**
+ * Переставляет байты n чисел между порядком хоста и little-endian порядком
+ * архива. Перестановка симметрична, так что одна функция годится и для
+ * записи, и для чтения; на little-endian хосте ничего не делает
+ */
+void le32_array(uint32_t* v, size_t n);
+
+/**
+ * То же для 64-битных чисел
+ */
+void le64_array(uint64_t* v, size_t n);
+
+/**
+ * То же для всех полей n записей каталога
+ */
+void file_info_le(file_info_t* fi, size_t n);
+
+/**
+ * То же для n записей таблицы чанков (хеш - байты, он не трогается)
+ */
+void chunk_info_le(chunk_info_t* ci, size_t n);
+
+/**
+ * Читает суперблок архива
+ * \param arch_fd Файловый дескриптор архива
+ * \param sb Куда записать суперблок
+ * \return 1, если архив в новом формате, 0 - если это пустой файл или архив
+ * старого формата, ARCHIVE_EVERSION - если архив записан неподдерживаемой
+ * версией формата, ARCHIVE_ESTREAM - если это потоковый архив
+ */
+int read_super(int arch_fd, arch_super_t* sb);
+
+/**
+ * Заполняет суперблок текущей версии, указывающий на каталог dir_offset
+ */
+void fill_super(arch_super_t* sb, uint64_t dir_offset, uint64_t dir_count,
+    uint64_t names_size, uint64_t chunk_count);
+
+/**
+ * Конец зафиксированной части архива (конец актуального каталога, таблицы
+ * строк и таблицы чанков). С этой позиции начинается дозапись при вставке
+ */
+uint64_t super_data_end(const arch_super_t* sb);
+
+/**
+ * Записывает каталог (все записи header), таблицу строк и таблицу чанков в
+ * архив с позиции off, выровненной вверх до ARCH_DIR_ALIGN. Числа пишутся в
+ * little-endian
+ * \param sb Куда записать суперблок, указывающий на каталог (с его суммой);
+ * конец каталога - super_data_end(sb)
+ * \return 0, ARCHIVE_EIO или ARCHIVE_ENOMEM
+ */
+int write_directory(
+    const fi_table_t* header, int arch_fd, uint64_t off, arch_super_t* sb);
+
+/**
+ * Фиксирует изменения: сбрасывает данные на диск и только после этого
+ * перезаписывает суперблок sb
+ * \return 0 или ARCHIVE_EIO
+ */
+int commit_super(int arch_fd, const arch_super_t* sb);
+
+/**
+ * Переписывает архив целиком: копирует данные всех файлов из header во
+ * временный файл нового формата в директории архива и атомарно подменяет им
+ * архив (rename). Временный файл безымянный (O_TMPFILE) или, если ФС этого
+ * не умеет, с уникальным именем, так что переписывания разных архивов в
+ * одной директории друг другу не мешают. Права архива сохраняются.
+ * Оффсеты в header обновляются на новые
+ * \param archive Название архива
+ * \param arch_fd Файловый дескриптор открытого архива
+ * \param header Файлы, которые останутся в архиве
+ * \return 0 или код ошибки. При ошибке архив остается прежним
+ */
+int rewrite_archive(const char* archive, int arch_fd, fi_table_t* header);
+
+/**
+ * Инициализирует пустую таблицу
+ */
+void fi_table_init(fi_table_t* t);
+
+/**
+ * Освобождает память таблицы t
+ */
+void fi_table_free(fi_table_t* t);
+
+/**
+ * Резервирует в таблице место под cap записей
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+int fi_table_reserve(fi_table_t* t, size_t cap);
+
+/**
+ * Добавляет запись в конец таблицы и в хеш-индекс
+ * \param fi Запись каталога; name_offset и name_length заполняются здесь
+ * \param name Имя файла, копируется в таблицу строк
+ * \param src Путь к исходному файлу или NULL
+ * \return Номер новой записи или ARCHIVE_ENOMEM
+ */
+ssize_t fi_table_push(
+    fi_table_t* t, const file_info_t* fi, const char* name, const char* src);
+
+/**
+ * Имя записи fi таблицы t
+ */
+const char* fi_table_name(const fi_table_t* t, const file_info_t* fi);
+
+/**
+ * Перестраивает хеш-индекс по текущему содержимому items. Вызывается после
+ * массовой загрузки или удаления записей
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+int fi_table_reindex(fi_table_t* t);
+
+/**
+ * Ищет запись с именем name
+ * \return Номер первой найденной записи или -1, если такой нет
+ */
+ssize_t fi_table_find(const fi_table_t* t, const char* name);
+
+/**
+ * Ищет следующую после from запись с тем же именем
+ * \return Номер записи или -1, если такой нет
+ */
+ssize_t fi_table_find_next(const fi_table_t* t, size_t from);
+
+/**
+ * Ищет последнюю в каталоге живую запись с именем name - ту, что
+ * извлекается поверх остальных копий
+ * \return Номер записи или -1, если такой нет
+ */
+ssize_t fi_table_find_last(const fi_table_t* t, const char* name);
+
+/**
+ * Выбирает записи каталога с именами из fnames (все, если fnums == 0) в
+ * порядке каталога. Каталог при этом не меняется
+ * \param last Брать только последнюю живую запись каждого имени: при
+ * извлечении более старые копии все равно перезаписываются, а параллельно
+ * они писали бы в один файл наперегонки
+ * \param out Куда записать массив номеров записей (освобождается free)
+ * \return Количество выбранных записей или ARCHIVE_ENOMEM
+ */
+ssize_t select_members(const fi_table_t* header, int fnums, char** fnames,
+    char last, size_t** out);
+
+/**
+ * Хеш имени файла (FNV-1a)
+ */
+uint64_t fi_hash(const char* name);
+
+/**
+ * Помечает записи заголовка по списку имен удаленными (FI_DELETED) и убирает
+ * их из хеш-индекса. Сами записи и данные остаются на месте до уплотнения.
+ * Поиск идет через хеш-индекс, поэтому работает за O(N + M)
+ * \param delete_existed Флаг, определяющий, что удалять. 1 - удалять то, что
+ * указано в fnames. 0 - удалять то, что __НЕ__ указано в fnames
+ * \return Количество помеченных записей или ARCHIVE_ENOMEM
+ */
+ssize_t remove_files_from_header(
+    fi_table_t* header, int fnums, char** fnames, char delete_existed);
+
+/**
+ * Выбрасывает из заголовка записи, помеченные FI_DELETED
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+int fi_table_purge(fi_table_t* t);
+
+/**
+ * Освобождает память таблицы чанков и делает ее пустой
+ */
+void chunk_table_free(chunk_table_t* ct);
+
+/**
+ * Добавляет чанк в таблицу и индекс
+ * \return Номер чанка или ARCHIVE_ENOMEM
+ */
+ssize_t chunk_table_push(chunk_table_t* ct, const chunk_info_t* ci);
+
+/**
+ * Перестраивает индекс таблицы чанков
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+int chunk_table_reindex(chunk_table_t* ct);
+
+/**
+ * Ищет чанк с хешем hash
+ * \return Номер чанка или -1
+ */
+ssize_t chunk_table_find(const chunk_table_t* ct, const uint8_t* hash);
+
+/**
+ * 128-битный хеш содержимого чанка (MurmurHash3 x64 128)
+ */
+void chunk_hash(const uint8_t* data, size_t n, uint8_t out[CHUNK_HASH_SIZE]);
+
+/**
+ * Ищет границу следующего чанка в data (content-defined chunking, gear-хеш)
+ * \param n Сколько байт доступно
+ * \param last 1, если за data данных больше нет
+ * \return Длина чанка или 0, если для решения нужно больше данных
+ */
+size_t cdc_next_chunk(const uint8_t* data, size_t n, char last);
+
+/**
+ * Дедуплицирует size байт файла in_fd: новые чанки дописываются в архив с
+ * позиции *off и попадают в header->chunks, за ними пишется рецепт файла
+ * \param size Сколько байт читать; сюда же записывается, сколько байт файла
+ * прочитано на самом деле
+ * \param off Позиция записи; сюда же записывается конец записанных данных
+ * \param compress Сжимать новые чанки
+ * \param recipe_off Куда записать положение рецепта
+ * \param recipe_size Куда записать размер рецепта
+ * \param crc Куда записать CRC32C исходных данных
+ * \return 0 или код ошибки
+ */
+int dedup_store_member(fi_table_t* header, int in_fd, uint64_t* size,
+    int arch_fd, uint64_t* off, char compress, uint64_t* recipe_off,
+    uint64_t* recipe_size, uint32_t* crc);
+
+/**
+ * Собирает дедуплицированный файл fi из чанков архива в out_fd
+ * \param out_fd Куда писать или -1, если данные нужны только для crc
+ * \param crc Куда записать CRC32C собранных данных или NULL
+ * \return 0 или -1, если данные повреждены или не удалось записать
+ */
+int dedup_load_member(const fi_table_t* header, const file_info_t* fi,
+    int arch_fd, int out_fd, uint32_t* crc);
+
+/**
+ * Продолжает CRC32C (Castagnoli) crc на n байт buf. Для начала подсчета
+ * передайте crc = 0
+ */
+uint32_t crc32c(uint32_t crc, const void* buf, size_t n);
+
+/**
+ * Продолжает CRC32C crc на n нулевых байт за O(log n), не читая их (для дыр
+ * разреженных файлов)
+ */
+uint32_t crc32c_zeros(uint32_t crc, uint64_t n);
+
+/**
+ * Копирует _bytes_ байт из файла _old_ в файл _new_
+ *
+ * Копирование происходит в текущую позицию файла _new_. Позиция в _old_ не
+ * меняется.
+ *
+ * Данные по возможности не покидают ядро: сначала используется
+ * copy_file_range (на некоторых ФС это вообще клонирование блоков), если он не
+ * поддерживается для этой пары файлов - sendfile, и только потом обычные
+ * pread/write через буфер, размер которого подбирается по объему копирования
+ * (от COPY_BUFFER_MIN до COPY_BUFFER_MAX)
+ *
+ * \param old Дескриптор файла, откуда копируем. Должен быть открыт на чтение
+ * \param new Дескриптор файла, куда копируем. Должен быть открыт на запись
+ * \param bytes Количество байт с начала файла _old_, которые нужно скопировать
+ * \param pos Позиция в _old_, откуда начинается копирование
+ * \return Количество скопированных байт. Меньше _bytes_, если _old_
+ * закончился раньше или произошла ошибка
+ */
+uint64_t copy_file(int old, int new, uint64_t bytes, off_t pos);
+
+/**
+ * Копирует как copy_file, но через буфер, попутно считая CRC32C
+ * скопированных данных
+ * \param crc Куда записать сумму
+ */
+uint64_t copy_file_crc(
+    int old, int new, uint64_t bytes, off_t pos, uint32_t* crc);
+
+/**
+ * Копирует как copy_file, но out может быть не обычным файлом: в канал
+ * данные идут через splice, в терминал или сокет - через sendfile, и только
+ * если они не работают - через буфер. В обычный файл копирует copy_file
+ * \param out Куда копировать, с текущей позиции (у канала ее нет)
+ */
+uint64_t send_file(int old, int out, uint64_t bytes, off_t pos);
+
+/**
+ * Запускает worker(arg) в jobs потоках и дожидается их завершения. При
+ * jobs <= 1 (или если потоки создать не удалось) worker выполняется в текущем
+ * потоке
+ */
+void run_parallel(void* (*worker)(void*), void* arg, int jobs);
+
+/**
+ * Сжимает блок src длины n встроенным LZ-кодеком
+ *
+ * Формат - последовательность "литералы + совпадение": байт-токен (старшие 4
+ * бита - число литералов, младшие - длина совпадения минус LZ_MIN_MATCH,
+ * значение 15 продолжается байтами по 255), литералы, 2 байта смещения
+ * совпадения (little endian). Последняя последовательность состоит только из
+ * литералов
+ * \param cap Размер dst
+ * \return Размер сжатых данных или 0, если они не поместились в cap
+ */
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap);
+
+/**
+ * Распаковывает блок, сжатый lz_compress
+ * \return Размер распакованных данных или -1, если данные повреждены или не
+ * помещаются в cap
+ */
+ssize_t lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap);
+
+/**
+ * Сжимает size байт файла in_fd поблочно и пишет результат (таблицу блоков и
+ * блоки) в out_fd с позиции off. Блоки сжимаются в jobs потоков
+ * \param stored Куда записать размер записанных данных
+ * \param crc Куда записать CRC32C исходных данных
+ * \return 0 или код ошибки
+ */
+int lz_store_member(int in_fd, uint64_t size, int out_fd, uint64_t off,
+    int jobs, uint64_t* stored, uint32_t* crc);
+
+/**
+ * Распаковывает сжатый файл fi архива в out_fd (с начала файла). Блоки
+ * распаковываются в jobs потоков
+ * \param out_fd Куда писать или -1, если данные нужны только для crc
+ * \param crc Куда записать CRC32C распакованных данных или NULL
+ * \return 0 или -1, если данные повреждены или не удалось записать
+ */
+int lz_load_member(const file_info_t* fi, int arch_fd, int out_fd, int jobs,
+    uint32_t* crc);
+
+/**
+ * Сжимает (decode = 0) или распаковывает (decode = 1) n независимых блоков
+ * tasks в jobs потоков
+ */
+void lz_run_batch(struct lz_task* tasks, size_t n, char decode, int jobs);
+
+/**
+ * Строит карту кусков сжатого файла fi по его таблице блоков
+ * \return Карта (освобождается free) или NULL, если таблица повреждена или
+ * не хватило памяти
+ */
+struct piece_map* lz_build_map(const file_info_t* fi, int arch_fd);
+
+/**
+ * Строит карту кусков дедуплицированного файла fi по его рецепту
+ * \return Карта (освобождается free) или NULL, если рецепт поврежден или не
+ * хватило памяти
+ */
+struct piece_map* dedup_build_map(
+    const fi_table_t* header, const file_info_t* fi, int arch_fd);
+
+/**
+ * Создает кольцо io_uring на entries операций. Не выходит, если ядро не
+ * поддерживает io_uring (или нужные операции), его запрещает seccomp или
+ * в окружении URING_ENV=0 - тогда вызывающий идет обычным путем
+ * \return 0 или -1
+ */
+int uring_init(struct uring* r, unsigned entries);
+
+/**
+ * Освобождает кольцо (если оно было создано)
+ */
+void uring_free(struct uring* r);
+
+/**
+ * Читает n мелких файлов целиком: открывает, читает size байт в buf и
+ * закрывает их пачкой. Файлы с ошибкой отмечаются в err
+ * \return 0 или -1, если сломалось само кольцо (тогда все дескрипторы
+ * закрыты, и пачку нужно повторить обычным путем)
+ */
+int uring_load_files(struct uring* r, struct small_file* f, size_t n);
+
+/**
+ * Извлекает n мелких несжатых файлов: читает их данные из архива, создает
+ * файлы, выставляет права, записывает и закрывает, все пачкой. Файлы с
+ * ошибкой отмечаются в err и failed_op
+ * \return 0 или -1, если сломалось само кольцо
+ */
+int uring_store_files(
+    struct uring* r, struct small_file* f, size_t n, int arch_fd);
+
+/**
+ * Начинает обход дерева root в фоновых потоках (не меньше WALK_MIN_JOBS).
+ * Имена файлов в архиве начинаются с последнего компонента root (для "a/src"
+ * - "src/..."), а если это ".", ".." или "/" - с путей внутри root.
+ * Символические ссылки не разыменовываются. Файлы, которые нельзя добавить,
+ * сообщаются через opts->report прямо из потоков обхода
+ * \param out Куда записать обход; освобождается walk_free
+ * \return 0, ARCHIVE_EIO, если root не открывается как директория, или
+ * ARCHIVE_ENOMEM
+ */
+int walk_start(
+    struct walker** out, const char* root, const struct archive_opts* opts);
+
+/**
+ * Ждет следующую пачку найденных файлов
+ * \return Пачка (освобождается walk_release) или NULL, если обход закончен
+ */
+struct walk_batch* walk_next(struct walker* w);
+
+/**
+ * Освобождает пачку
+ */
+void walk_release(struct walk_batch* b);
+
+/**
+ * Останавливает обход, дожидается потоков и освобождает память
+ */
+void walk_free(struct walker* w);
+
+/**
+ * Запускает конвейер вставки с readers потоками-читателями
+ * \param out Куда записать конвейер; освобождается pipeline_free
+ * \return 0 или ARCHIVE_ENOMEM (в том числе если не создался ни один поток)
+ */
+int pipeline_start(struct pipeline** out, int readers);
+
+/**
+ * Дописывает в архив с позиции *off данные файлов header (записи [from,
+ * from + n), пути в header->src) без сжатия: читатели читают их
+ * одновременно, а вызывающий поток пишет в архив по порядку. Заполняет
+ * _offset, размеры, сумму и флаги записей; разреженные файлы хранятся
+ * картой участков
+ * \param off Позиция записи; сюда же записывается конец записанных данных
+ * \param failed Массив на n флагов: файл не открылся или не прочитался (и
+ * сообщен через opts->report), его запись нужно выкинуть
+ * \return 0 или код ошибки записи в архив
+ */
+int pipeline_insert(struct pipeline* p, fi_table_t* header, size_t from,
+    size_t n, int arch_fd, uint64_t* off, const struct archive_opts* opts,
+    char* failed);
+
+/**
+ * Останавливает конвейер, дожидается читателей и освобождает память
+ */
+void pipeline_free(struct pipeline* p);
+
+/**
+ * Проверяет, что имя файла из архива можно безопасно использовать как путь
+ * при извлечении: непустое, не абсолютное и без компонентов ".."
+ */
+char member_name_safe(const char* name);
+
+/**
+ * Создает файл name для извлечения с правами mask, при необходимости создавая
+ * промежуточные директории
+ * \return Дескриптор, открытый на запись, или -1
+ */
+int create_member_file(const char* name, mode_t mask);
+
+struct stat;
+
+/**
+ * Время изменения файла st в наносекундах (для file_info::mtime)
+ */
+uint64_t stat_mtime(const struct stat* st);
+
+/**
+ * Создает недостающие директории на пути к файлу name
+ * \return 0 или -1
+ */
+int create_member_dirs(const char* name);
+
+/**
+ * Ищет в файле fd размера size участки с данными (SEEK_DATA/SEEK_HOLE)
+ * \param out Куда записать массив участков (освобождается free)
+ * \return Количество участков или -1, если дыр нет, ФС их не показывает или
+ * не хватило памяти - тогда файл хранится целиком
+ */
+ssize_t sparse_scan(int fd, uint64_t size, struct sparse_extent** out);
+
+/**
+ * Пишет разреженный файл in_fd в архив с позиции off: карту участков ext и
+ * их данные. Если файл уменьшился по ходу чтения, участки в ext обрезаются
+ * \param size Размер файла
+ * \param stored Куда записать размер записанного
+ * \param crc Куда записать CRC32C всего содержимого файла (с нулями дыр)
+ * \return 0 или код ошибки
+ */
+int sparse_store_member(int in_fd, struct sparse_extent* ext, size_t n,
+    uint64_t size, int arch_fd, uint64_t off, uint64_t* stored, uint32_t* crc);
+
+/**
+ * Извлекает разреженный файл fi в out_fd, оставляя дыры дырами
+ * \param out_fd Куда писать или -1, если нужна только сумма
+ * \param crc Куда записать CRC32C содержимого или NULL
+ * \return 0 или -1, если данные повреждены или не удалось записать
+ */
+int sparse_load_member(
+    const file_info_t* fi, int arch_fd, int out_fd, uint32_t* crc);
+
+/**
+ * Строит карту кусков разреженного файла fi: участки с данными и дыры
+ * \return Карта (освобождается free) или NULL, если карта участков
+ * повреждена или не хватило памяти
+ */
+struct piece_map* sparse_build_map(const file_info_t* fi, int arch_fd);
+
+/**
+ * Начало отрезка времени для stats_phase и stats_member
+ * \return Монотонное время в нс или 0, если сбор статистики выключен
+ */
+uint64_t stats_now(void);
+
+/**
+ * Добавляет к фазе phase время с start (результата stats_now)
+ */
+void stats_phase(enum stats_phase phase, uint64_t start);
+
+/**
+ * Добавляет n к счетчику
+ */
+void stats_count(enum stats_counter counter, uint64_t n);
+
+/**
+ * Учитывает файл name из bytes байт, перенос которого начался в start
+ */
+void stats_member(const char* name, uint64_t bytes, uint64_t start);
+
+#pragma GCC visibility pop
+
+#endif
@@ -0,0 +1,562 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * \file bench.c
+ * Замеры производительности archiver (make bench)
+ *
+ * Программа строит в рабочей директории синтетические наборы файлов (много
+ * мелких, несколько огромных и смесь), затем для каждого набора запускает
+ * archiver во всех основных режимах и на каждый запуск печатает в stdout
+ * одну строку JSON:
+ *
+ *     {"corpus":"small","mode":"insert","files":4000,"bytes":...,
+ *      "wall_s":...,"user_s":...,"sys_s":...,"mb_s":...,"files_s":...,
+ *      "max_rss_kb":...,"syscalls":...,"io":"uring","status":0}
+ *
+ * Время - лучшее из -n повторов (по wall_s), кеш страниц при этом теплый:
+ * файлы только что записаны. Системные вызовы считаются отдельным запуском
+ * под ptrace (со всеми потоками), чтобы трассировка не портила время; -x
+ * отключает подсчет, тогда syscalls = -1. -S запускает archiver с
+ * ARCHIVER_IO_URING=0 (только обычный ввод-вывод, "io":"sync"), чтобы
+ * сравнить с пакетным io_uring на мелких файлах. Ход работы пишется в stderr.
+ *
+ * Использование: archiver_bench [-a archiver] [-d директория] [-s масштаб]
+ * [-n повторы] [-j потоки] [-x] [-S]
+ */
+
+#define BENCH_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * Набор файлов для замеров
+ */
+struct corpus
+{
+    const char* name;
+    size_t small_files; //!< Мелких файлов (1-16 КБ)
+    size_t medium_files; //!< Средних файлов (256 КБ - 2 МБ)
+    size_t huge_files; //!< Огромных файлов
+    uint64_t huge_size; //!< Размер огромного файла
+};
+
+/**
+ * Режим archiver, который замеряется
+ */
+enum bench_mode
+{
+    BENCH_INSERT, //!< -i в пустой архив
+    BENCH_INSERT_LZ, //!< -i -c -j N в пустой архив
+    BENCH_STAT, //!< -s
+    BENCH_VERIFY, //!< -v -j N
+    BENCH_EXTRACT, //!< -e -j N в пустую директорию
+    BENCH_EXTRACT_LZ, //!< -e -j N из сжатого архива
+    BENCH_REMOVE, //!< -r половины файлов
+    BENCH_MODES
+};
+
+static const char* mode_names[BENCH_MODES] = { "insert", "insert_lz", "stat",
+    "verify", "extract", "extract_lz", "remove" };
+
+/**
+ * Итоги одного запуска
+ */
+struct run_result
+{
+    double wall; //!< Секунды по часам
+    double user;
+    double sys;
+    long max_rss; //!< КБ
+    long syscalls; //!< -1, если не считались
+    int status; //!< Код выхода archiver (или 128 + сигнал)
+};
+
+/**
+ * Параметры, заданные в командной строке
+ */
+struct bench_opts
+{
+    char archiver[PATH_MAX];
+    const char* dir;
+    double scale;
+    int repeat;
+    int jobs;
+    int count_syscalls;
+    int sync_io; //!< Запускать archiver без io_uring
+};
+
+/**
+ * Имена файлов набора (относительно директории набора)
+ */
+struct file_list
+{
+    char** names;
+    size_t count;
+    uint64_t bytes;
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+/**
+ * xorshift64*: быстрый и воспроизводимый от запуска к запуску
+ */
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ull;
+}
+
+static void fail(const char* what)
+{
+    fprintf(stderr, "[archiver_bench]: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Заполняет буфер данными файла: половина файлов - текст из небольшого
+ * словаря (хорошо сжимается), половина - случайные байты (не сжимается)
+ */
+static void fill_data(uint8_t* buf, size_t n, char text)
+{
+    static const char* words[] = { "archive ", "member ", "directory ",
+        "chunk ", "block ", "offset ", "superblock ", "checksum ", "stream ",
+        "\n" };
+    if (!text)
+    {
+        for (size_t i = 0; i + 8 <= n; i += 8)
+        {
+            uint64_t r = rng();
+            memcpy(buf + i, &r, 8);
+        }
+        for (size_t i = n / 8 * 8; i < n; ++i)
+            buf[i] = rng();
+        return;
+    }
+    size_t i = 0;
+    while (i < n)
+    {
+        const char* w = words[rng() % (sizeof(words) / sizeof(*words))];
+        size_t len = strlen(w);
+        len = len < n - i ? len : n - i;
+        memcpy(buf + i, w, len);
+        i += len;
+    }
+}
+
+static void list_push(struct file_list* l, const char* name, uint64_t size)
+{
+    char** names = realloc(l->names, (l->count + 1) * sizeof(char*));
+    if (!names || !(names[l->count] = strdup(name)))
+        fail("Не хватает памяти");
+    l->names = names;
+    l->count++;
+    l->bytes += size;
+}
+
+static void write_file(const char* name, uint64_t size, uint8_t* buf)
+{
+    int fd = open(name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd == -1)
+        fail(name);
+    char text = rng() & 1;
+    while (size)
+    {
+        size_t n = size < BENCH_BUFFER_SIZE ? size : BENCH_BUFFER_SIZE;
+        fill_data(buf, n, text);
+        if (write(fd, buf, n) != (ssize_t)n)
+            fail(name);
+        size -= n;
+    }
+    close(fd);
+}
+
+/**
+ * Создает файлы набора в текущей директории
+ */
+static void make_corpus(
+    const struct corpus* c, double scale, struct file_list* l)
+{
+    uint8_t* buf = malloc(BENCH_BUFFER_SIZE);
+    if (!buf)
+        fail("Не хватает памяти");
+
+    char name[64];
+    size_t small = c->small_files * scale, medium = c->medium_files * scale;
+    for (size_t i = 0; i < small; ++i)
+    {
+        uint64_t size = 1024 + rng() % (15 * 1024);
+        snprintf(name, sizeof(name), "s%06zu", i);
+        write_file(name, size, buf);
+        list_push(l, name, size);
+    }
+    for (size_t i = 0; i < medium; ++i)
+    {
+        uint64_t size = 256 * 1024 + rng() % (1792 * 1024);
+        snprintf(name, sizeof(name), "m%04zu", i);
+        write_file(name, size, buf);
+        list_push(l, name, size);
+    }
+    for (size_t i = 0; i < c->huge_files; ++i)
+    {
+        uint64_t size = c->huge_size * scale;
+        snprintf(name, sizeof(name), "h%02zu", i);
+        write_file(name, size, buf);
+        list_push(l, name, size);
+    }
+    free(buf);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double tv_sec(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Запускает команду в директории cwd, stdout - в /dev/null
+ * \param trace Считать системные вызовы (ptrace)
+ */
+static struct run_result run(char** argv, const char* cwd, char trace)
+{
+    struct run_result r = { .syscalls = -1 };
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1)
+        fail("fork");
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (null == -1 || dup2(null, STDOUT_FILENO) == -1 || chdir(cwd) == -1)
+            _exit(127);
+        if (trace && ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+            _exit(127);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (!trace)
+    {
+        if (wait4(pid, &status, 0, &ru) == -1)
+            fail("wait4");
+    }
+    else
+    {
+        // Первая остановка - на execv. Дальше каждая остановка с
+        // SIGTRAP | 0x80 - вход в системный вызов или выход из него, в
+        // любом потоке программы
+        if (waitpid(pid, &status, 0) == -1)
+            fail("waitpid");
+        if (!WIFSTOPPED(status))
+        {
+            r.status = 127; // execv не удался
+            return r;
+        }
+        ptrace(PTRACE_SETOPTIONS, pid, NULL,
+            PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+        long stops = 0;
+        for (;;)
+        {
+            int st;
+            pid_t tid = wait4(-1, &st, __WALL, &ru);
+            if (tid == -1)
+                fail("wait4");
+            if (WIFEXITED(st) || WIFSIGNALED(st))
+            {
+                if (tid != pid)
+                    continue;
+                status = st;
+                break;
+            }
+
+            int sig = WSTOPSIG(st);
+            if (sig == (SIGTRAP | 0x80))
+            {
+                stops++;
+                sig = 0;
+            }
+            else if (sig == SIGTRAP || (sig == SIGSTOP && st >> 16 == 0))
+            {
+                // Событие clone или первая остановка нового потока
+                sig = 0;
+            }
+            ptrace(PTRACE_SYSCALL, tid, NULL, sig);
+        }
+        // У exit_group нет остановки на выходе
+        r.syscalls = (stops + 1) / 2;
+    }
+
+    r.wall = now() - start;
+    r.user = tv_sec(ru.ru_utime);
+    r.sys = tv_sec(ru.ru_stime);
+    r.max_rss = ru.ru_maxrss;
+    r.status = WIFEXITED(status) ? WEXITSTATUS(status)
+                                 : 128 + WTERMSIG(status);
+    return r;
+}
+
+/**
+ * Запускает archiver с аргументами args, затем files[from..to)
+ */
+static struct run_result run_archiver(const struct bench_opts* o,
+    const char* cwd, const char** args, const struct file_list* l,
+    size_t from, size_t to, char trace)
+{
+    size_t nargs = 0;
+    while (args[nargs])
+        nargs++;
+    char** argv = malloc((nargs + to - from + 2) * sizeof(char*));
+    if (!argv)
+        fail("Не хватает памяти");
+    argv[0] = (char*)o->archiver;
+    memcpy(argv + 1, args, nargs * sizeof(char*));
+    for (size_t i = from; i < to; ++i)
+        argv[1 + nargs + i - from] = l->names[i];
+    argv[1 + nargs + to - from] = NULL;
+    struct run_result r = run(argv, cwd, trace);
+    free(argv);
+    return r;
+}
+
+/**
+ * Удаляет директорию со всем содержимым (без поддиректорий)
+ */
+static void remove_dir(const char* dir, const struct file_list* l)
+{
+    char path[PATH_MAX];
+    for (size_t i = 0; i < l->count; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, l->names[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/**
+ * Готовит состояние для режима и запускает его один раз
+ */
+static struct run_result run_mode(const struct bench_opts* o,
+    enum bench_mode m, const struct file_list* l, char trace)
+{
+    char jobs[16];
+    snprintf(jobs, sizeof(jobs), "%d", o->jobs);
+
+    // Все запуски идут из поддиректории рабочей (corpus или out)
+    const char* arch = m == BENCH_EXTRACT_LZ || m == BENCH_INSERT_LZ
+        ? "../bench_lz.egl"
+        : "../bench.egl";
+    const char* insert[] = { arch, "-i", NULL };
+    const char* insert_lz[] = { arch, "-i", "-c", "-j", jobs, NULL };
+
+    // Каждый режим, кроме вставки, работает с архивом, который только что
+    // создан заново, поэтому повторы не зависят друг от друга
+    unlink(arch + 3);
+    if (m != BENCH_INSERT && m != BENCH_INSERT_LZ)
+    {
+        struct run_result s = run_archiver(o, "corpus",
+            m == BENCH_EXTRACT_LZ ? insert_lz : insert, l, 0, l->count, 0);
+        if (s.status != 0)
+            return s;
+    }
+
+    switch (m)
+    {
+    case BENCH_INSERT:
+        return run_archiver(o, "corpus", insert, l, 0, l->count, trace);
+
+    case BENCH_INSERT_LZ:
+        return run_archiver(o, "corpus", insert_lz, l, 0, l->count, trace);
+
+    case BENCH_STAT:
+    {
+        const char* a[] = { arch, "-s", NULL };
+        return run_archiver(o, "corpus", a, l, 0, 0, trace);
+    }
+
+    case BENCH_VERIFY:
+    {
+        const char* a[] = { arch, "-v", "-j", jobs, NULL };
+        return run_archiver(o, "corpus", a, l, 0, 0, trace);
+    }
+
+    case BENCH_EXTRACT:
+    case BENCH_EXTRACT_LZ:
+    {
+        remove_dir("out", l);
+        if (mkdir("out", 0755) == -1)
+            fail("out");
+        const char* a[] = { arch, "-e", "-j", jobs, NULL };
+        struct run_result r = run_archiver(o, "out", a, l, 0, 0, trace);
+        remove_dir("out", l);
+        return r;
+    }
+
+    case BENCH_REMOVE:
+    {
+        const char* a[] = { arch, "-r", NULL };
+        return run_archiver(o, "corpus", a, l, 0, l->count / 2, trace);
+    }
+
+    default:
+        break;
+    }
+    return (struct run_result) { 0 };
+}
+
+/**
+ * Сколько данных и файлов проходит через режим (для MB/s и files/s)
+ */
+static void mode_volume(enum bench_mode m, const struct file_list* l,
+    uint64_t* bytes, size_t* files)
+{
+    *files = m == BENCH_REMOVE ? l->count / 2 : l->count;
+    *bytes = m == BENCH_STAT || m == BENCH_REMOVE ? 0 : l->bytes;
+}
+
+static void bench_corpus(const struct bench_opts* o, const struct corpus* c)
+{
+    if (mkdir("corpus", 0755) == -1 || chdir("corpus") == -1)
+        fail("corpus");
+    struct file_list l = { 0 };
+    fprintf(stderr, "[archiver_bench]: набор %s: создание...\n", c->name);
+    make_corpus(c, o->scale, &l);
+    if (chdir("..") == -1)
+        fail("..");
+
+    for (int m = 0; m < BENCH_MODES; ++m)
+    {
+        fprintf(stderr, "[archiver_bench]: набор %s: %s\n", c->name,
+            mode_names[m]);
+        struct run_result best = { 0 };
+        for (int k = 0; k < o->repeat; ++k)
+        {
+            struct run_result r = run_mode(o, m, &l, 0);
+            if (k == 0 || r.wall < best.wall)
+                best = r;
+        }
+        if (o->count_syscalls)
+            best.syscalls = run_mode(o, m, &l, 1).syscalls;
+
+        uint64_t bytes;
+        size_t files;
+        mode_volume(m, &l, &bytes, &files);
+        double wall = best.wall > 0 ? best.wall : 1e-9;
+        printf("{\"corpus\":\"%s\",\"mode\":\"%s\",\"jobs\":%d,"
+               "\"files\":%zu,\"bytes\":%lu,\"wall_s\":%.6f,"
+               "\"user_s\":%.6f,\"sys_s\":%.6f,\"mb_s\":%.2f,"
+               "\"files_s\":%.1f,\"max_rss_kb\":%ld,\"syscalls\":%ld,"
+               "\"io\":\"%s\",\"status\":%d}\n",
+            c->name, mode_names[m], o->jobs, files, bytes, best.wall,
+            best.user, best.sys, bytes / 1e6 / wall, files / wall,
+            best.max_rss, best.syscalls, o->sync_io ? "sync" : "uring",
+            best.status);
+        fflush(stdout);
+    }
+
+    unlink("bench.egl");
+    unlink("bench_lz.egl");
+    remove_dir("corpus", &l);
+    for (size_t i = 0; i < l.count; ++i)
+        free(l.names[i]);
+    free(l.names);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Использование: archiver_bench [-a archiver] [-d директория] "
+        "[-s масштаб] [-n повторы] [-j потоки] [-x] [-S]\n"
+        " -a  Путь к archiver (./archiver)\n"
+        " -d  Где создавать наборы файлов (.)\n"
+        " -s  Множитель размера наборов (1.0 - около 900 МБ)\n"
+        " -n  Повторов на режим, берется лучший (3)\n"
+        " -j  Потоков для -c, -e и -v (1)\n"
+        " -x  Не считать системные вызовы\n"
+        " -S  Без io_uring (ARCHIVER_IO_URING=0)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    struct bench_opts o = { .dir = ".", .scale = 1.0, .repeat = 3, .jobs = 1,
+        .count_syscalls = 1 };
+    const char* archiver = "./archiver";
+    int opt;
+    while ((opt = getopt(argc, argv, "a:d:s:n:j:xS")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            archiver = optarg;
+            break;
+        case 'd':
+            o.dir = optarg;
+            break;
+        case 's':
+            o.scale = atof(optarg);
+            break;
+        case 'n':
+            o.repeat = atoi(optarg);
+            break;
+        case 'j':
+            o.jobs = atoi(optarg);
+            break;
+        case 'x':
+            o.count_syscalls = 0;
+            break;
+        case 'S':
+            o.sync_io = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (o.scale <= 0 || o.repeat < 1 || o.jobs < 1 || optind != argc)
+        usage();
+    if (!realpath(archiver, o.archiver))
+        fail(archiver);
+    // Окружение наследуют все запуски archiver
+    if (o.sync_io && setenv("ARCHIVER_IO_URING", "0", 1) == -1)
+        fail("setenv");
+
+    const struct corpus corpora[] = {
+        { "small", 20000, 0, 0, 0 },
+        { "huge", 0, 0, 2, 256 * 1024 * 1024 },
+        { "mixed", 5000, 40, 1, 128 * 1024 * 1024 },
+    };
+
+    char work[PATH_MAX];
+    snprintf(work, sizeof(work), "%s/bench.XXXXXX", o.dir);
+    if (!mkdtemp(work) || chdir(work) == -1)
+        fail(work);
+    fprintf(stderr, "[archiver_bench]: рабочая директория %s\n", work);
+
+    for (size_t i = 0; i < sizeof(corpora) / sizeof(*corpora); ++i)
+        bench_corpus(&o, &corpora[i]);
+
+    if (chdir("..") == -1 || rmdir(strrchr(work, '/') + 1) == -1)
+        fail(work);
+    return 0;
+}
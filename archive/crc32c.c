@@ -0,0 +1,118 @@
+#include "archiver_impl.h"
+#include <pthread.h>
+#include <string.h>
+
+/**
+ * Таблицы для программного CRC32C (slicing-by-8)
+ */
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t*, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t n)
+{
+    for (; n && ((uintptr_t)p & 7); --n)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint32_t lo = (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24)
+            ^ crc;
+        uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff]
+            ^ crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24]
+            ^ crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff]
+            ^ crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+
+    for (; n; --n)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(
+    uint32_t crc, const uint8_t* p, size_t n)
+{
+    uint64_t c = crc;
+    for (; n && ((uintptr_t)p & 7); --n)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    for (; n; --n)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    return c;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        crc32c_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; ++t)
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            uint32_t c = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t n)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, buf, n);
+}
+
+/**
+ * Произведение a и b по модулю многочлена CRC32C (в отраженной записи)
+ */
+static uint32_t crc32c_mulmod(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31, p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+uint32_t crc32c_zeros(uint32_t crc, uint64_t n)
+{
+    // Нулевой байт умножает регистр на x^8, так что n нулей - умножение на
+    // x^(8n). Степень собирается из x^(2^k) за O(log n) умножений
+    uint32_t x2k = 1u << 30; // x^1
+    for (int k = 0; k < 3; ++k)
+        x2k = crc32c_mulmod(x2k, x2k); // x^8
+    uint32_t reg = ~crc;
+    for (; n; n >>= 1)
+    {
+        if (n & 1)
+            reg = crc32c_mulmod(x2k, reg);
+        x2k = crc32c_mulmod(x2k, x2k);
+    }
+    return ~reg;
+}
@@ -0,0 +1,435 @@
+#include "archiver_impl.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void chunk_table_free(chunk_table_t* ct)
+{
+    if (!ct->mapped)
+        free(ct->items);
+    free(ct->index);
+    memset(ct, 0, sizeof(chunk_table_t));
+}
+
+/**
+ * Вставляет чанк i в индекс (в индексе гарантированно есть свободное место)
+ */
+static void chunk_table_link(chunk_table_t* ct, size_t i)
+{
+    uint64_t h;
+    memcpy(&h, ct->items[i].hash, sizeof(h));
+    size_t mask = ct->index_cap - 1;
+    size_t pos = h & mask;
+    while (ct->index[pos])
+        pos = (pos + 1) & mask;
+    ct->index[pos] = i + 1;
+}
+
+int chunk_table_reindex(chunk_table_t* ct)
+{
+    size_t cap = 64;
+    while (cap < ct->count * 2)
+        cap *= 2;
+
+    size_t* index = calloc(cap, sizeof(size_t));
+    if (!index)
+        return ARCHIVE_ENOMEM;
+    free(ct->index);
+    ct->index = index;
+    ct->index_cap = cap;
+    for (size_t i = 0; i < ct->count; ++i)
+        chunk_table_link(ct, i);
+    return 0;
+}
+
+ssize_t chunk_table_push(chunk_table_t* ct, const chunk_info_t* ci)
+{
+    if (ct->count == ct->cap)
+    {
+        // Таблица из отображения каталога при первом росте копируется
+        size_t cap = ct->cap ? ct->cap * 2 : 64;
+        chunk_info_t* items = ct->mapped
+            ? malloc(cap * sizeof(chunk_info_t))
+            : realloc(ct->items, cap * sizeof(chunk_info_t));
+        if (!items)
+            return ARCHIVE_ENOMEM;
+        if (ct->mapped)
+            memcpy(items, ct->items, ct->count * sizeof(chunk_info_t));
+        ct->items = items;
+        ct->cap = cap;
+        ct->mapped = 0;
+    }
+    size_t i = ct->count++;
+    ct->items[i] = *ci;
+
+    if (ct->count * 2 <= ct->index_cap)
+    {
+        chunk_table_link(ct, i);
+    }
+    else if (chunk_table_reindex(ct))
+    {
+        ct->count--;
+        return ARCHIVE_ENOMEM;
+    }
+    return i;
+}
+
+ssize_t chunk_table_find(const chunk_table_t* ct, const uint8_t* hash)
+{
+    if (ct->index_cap == 0)
+        return -1;
+
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    size_t mask = ct->index_cap - 1;
+    for (size_t pos = h & mask; ct->index[pos]; pos = (pos + 1) & mask)
+    {
+        size_t i = ct->index[pos] - 1;
+        if (memcmp(ct->items[i].hash, hash, CHUNK_HASH_SIZE) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ull;
+    k ^= k >> 33;
+    return k;
+}
+
+void chunk_hash(const uint8_t* data, size_t n, uint8_t out[CHUNK_HASH_SIZE])
+{
+    const uint64_t c1 = 0x87c37b91114253d5ull, c2 = 0x4cf5ad432745937full;
+    uint64_t h1 = 0, h2 = 0;
+    size_t nblocks = n / 16;
+
+    for (size_t i = 0; i < nblocks; ++i)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const uint8_t* tail = data + nblocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    switch (n & 15)
+    {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; // fall through
+    case 14: k2 ^= (uint64_t)tail[13] << 40; // fall through
+    case 13: k2 ^= (uint64_t)tail[12] << 32; // fall through
+    case 12: k2 ^= (uint64_t)tail[11] << 24; // fall through
+    case 11: k2 ^= (uint64_t)tail[10] << 16; // fall through
+    case 10: k2 ^= (uint64_t)tail[9] << 8; // fall through
+    case 9:
+        k2 ^= (uint64_t)tail[8];
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        // fall through
+    case 8: k1 ^= (uint64_t)tail[7] << 56; // fall through
+    case 7: k1 ^= (uint64_t)tail[6] << 48; // fall through
+    case 6: k1 ^= (uint64_t)tail[5] << 40; // fall through
+    case 5: k1 ^= (uint64_t)tail[4] << 32; // fall through
+    case 4: k1 ^= (uint64_t)tail[3] << 24; // fall through
+    case 3: k1 ^= (uint64_t)tail[2] << 16; // fall through
+    case 2: k1 ^= (uint64_t)tail[1] << 8; // fall through
+    case 1:
+        k1 ^= (uint64_t)tail[0];
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= n;
+    h2 ^= n;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    memcpy(out, &h1, 8);
+    memcpy(out + 8, &h2, 8);
+}
+
+/**
+ * Таблица gear-хеша: 256 псевдослучайных чисел (splitmix64 с фиксированным
+ * зерном, чтобы границы чанков не зависели от запуска)
+ */
+static uint64_t cdc_gear[256];
+static pthread_once_t cdc_gear_once = PTHREAD_ONCE_INIT;
+
+static void cdc_gear_init(void)
+{
+    uint64_t x = 0x2545f4914f6cdd1dull;
+    for (int i = 0; i < 256; ++i)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        cdc_gear[i] = z ^ (z >> 31);
+    }
+}
+
+size_t cdc_next_chunk(const uint8_t* data, size_t n, char last)
+{
+    pthread_once(&cdc_gear_once, cdc_gear_init);
+
+    if (n <= CDC_MIN_CHUNK)
+        return last ? n : 0;
+
+    // Старшие биты gear-хеша зависят от последних 64 байт, поэтому маска
+    // накладывается на них
+    size_t limit = n < CDC_MAX_CHUNK ? n : CDC_MAX_CHUNK;
+    uint64_t h = 0;
+    for (size_t i = CDC_MIN_CHUNK; i < limit; ++i)
+    {
+        h = (h << 1) + cdc_gear[data[i]];
+        if (!(h & CDC_MASK))
+            return i + 1;
+    }
+
+    if (limit == CDC_MAX_CHUNK || last)
+        return limit;
+    return 0;
+}
+
+int dedup_store_member(fi_table_t* header, int in_fd, uint64_t* size,
+    int arch_fd, uint64_t* off, char compress, uint64_t* recipe_off,
+    uint64_t* recipe_size, uint32_t* crc)
+{
+    *crc = 0;
+    uint8_t* buf = malloc(CDC_BUFFER_SIZE);
+    uint8_t* packed = malloc(CDC_MAX_CHUNK);
+    uint32_t* recipe = NULL;
+    size_t nrecipe = 0, recipe_cap = 0;
+    int ret = buf && packed ? 0 : ARCHIVE_ENOMEM;
+
+    uint64_t file_pos = 0;
+    size_t have = 0, pos = 0;
+    char eof = 0;
+    while (ret == 0)
+    {
+        size_t len = cdc_next_chunk(buf + pos, have - pos, eof);
+        if (len == 0 && !eof)
+        {
+            // Нужно больше данных: сдвигаем хвост в начало и дочитываем
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            size_t want = *size - file_pos < CDC_BUFFER_SIZE - have
+                ? *size - file_pos
+                : CDC_BUFFER_SIZE - have;
+            ssize_t r = pread_full(in_fd, buf + have, want, file_pos);
+            if (r < 0)
+                r = 0;
+            have += r;
+            file_pos += r;
+            eof = file_pos == *size || (size_t)r < want;
+            continue;
+        }
+        if (len == 0)
+            break;
+
+        chunk_info_t ci;
+        *crc = crc32c(*crc, buf + pos, len);
+        chunk_hash(buf + pos, len, ci.hash);
+        ssize_t idx = chunk_table_find(&header->chunks, ci.hash);
+        if (idx == -1)
+        {
+            const uint8_t* data = buf + pos;
+            ci.size = ci.stored_size = len;
+            if (compress)
+            {
+                size_t c = lz_compress(buf + pos, len, packed, len - 1);
+                if (c)
+                {
+                    data = packed;
+                    ci.stored_size = c;
+                }
+            }
+            ci._offset = *off;
+            if (pwrite_full(arch_fd, data, ci.stored_size, *off) == -1)
+            {
+                ret = ARCHIVE_EIO;
+                break;
+            }
+            *off += ci.stored_size;
+            idx = chunk_table_push(&header->chunks, &ci);
+            if (idx < 0)
+            {
+                ret = idx;
+                break;
+            }
+        }
+
+        if (nrecipe == recipe_cap)
+        {
+            size_t cap = recipe_cap ? recipe_cap * 2 : 256;
+            uint32_t* grown = realloc(recipe, cap * sizeof(uint32_t));
+            if (!grown)
+            {
+                ret = ARCHIVE_ENOMEM;
+                break;
+            }
+            recipe = grown;
+            recipe_cap = cap;
+        }
+        recipe[nrecipe++] = idx;
+        pos += len;
+    }
+
+    // Если файл успел уменьшиться, в архиве окажется то, что действительно
+    // было прочитано
+    *size = file_pos;
+    *recipe_off = *off;
+    *recipe_size = nrecipe * sizeof(uint32_t);
+    le32_array(recipe, nrecipe);
+    if (ret == 0 && pwrite_full(arch_fd, recipe, *recipe_size, *off) == -1)
+        ret = ARCHIVE_EIO;
+    *off += *recipe_size;
+
+    free(recipe);
+    free(packed);
+    free(buf);
+    return ret;
+}
+
+int dedup_load_member(const fi_table_t* header, const file_info_t* fi,
+    int arch_fd, int out_fd, uint32_t* crc)
+{
+    const chunk_table_t* ct = &header->chunks;
+    size_t n = fi->stored_size / sizeof(uint32_t);
+    uint32_t* recipe = malloc(fi->stored_size + 1);
+    uint8_t* packed = malloc(CDC_MAX_CHUNK);
+    uint8_t* plain = malloc(CDC_MAX_CHUNK);
+    int ret = recipe && packed && plain ? 0 : -1;
+    if (crc)
+        *crc = 0;
+
+    if (ret == 0
+        && pread_full(arch_fd, recipe, fi->stored_size, fi->_offset)
+            != (ssize_t)fi->stored_size)
+    {
+        ret = -1;
+    }
+    if (ret == 0)
+        le32_array(recipe, n);
+
+    for (size_t k = 0; ret == 0 && k < n; ++k)
+    {
+        if (recipe[k] >= ct->count)
+        {
+            ret = -1;
+            break;
+        }
+
+        const chunk_info_t* ci = &ct->items[recipe[k]];
+        if (ci->stored_size == ci->size && !crc)
+        {
+            if (copy_file(arch_fd, out_fd, ci->size, ci->_offset) != ci->size)
+                ret = -1;
+            continue;
+        }
+
+        if (ci->size > CDC_MAX_CHUNK || ci->stored_size > ci->size)
+        {
+            ret = -1;
+            break;
+        }
+
+        uint8_t* dst = ci->stored_size == ci->size ? plain : packed;
+        if (pread_full(arch_fd, dst, ci->stored_size, ci->_offset)
+                != (ssize_t)ci->stored_size
+            || (dst == packed
+                && lz_decompress(packed, ci->stored_size, plain, ci->size)
+                    != (ssize_t)ci->size))
+        {
+            ret = -1;
+            break;
+        }
+
+        if (crc)
+            *crc = crc32c(*crc, plain, ci->size);
+        if (out_fd != -1 && write(out_fd, plain, ci->size) != (ssize_t)ci->size)
+            ret = -1;
+    }
+
+    free(plain);
+    free(packed);
+    free(recipe);
+    return ret;
+}
+
+struct piece_map* dedup_build_map(
+    const fi_table_t* header, const file_info_t* fi, int arch_fd)
+{
+    const chunk_table_t* ct = &header->chunks;
+    size_t n = fi->stored_size / sizeof(uint32_t);
+    uint32_t* recipe = malloc(fi->stored_size + 1);
+    struct piece_map* map
+        = malloc(sizeof(struct piece_map) + n * sizeof(struct piece));
+    if (!recipe || !map
+        || pread_full(arch_fd, recipe, fi->stored_size, fi->_offset)
+            != (ssize_t)fi->stored_size)
+    {
+        free(recipe);
+        free(map);
+        return NULL;
+    }
+    le32_array(recipe, n);
+
+    uint64_t orig = 0;
+    map->count = n;
+    for (size_t k = 0; k < n; ++k)
+    {
+        if (recipe[k] >= ct->count || ct->items[recipe[k]].size > CDC_MAX_CHUNK
+            || ct->items[recipe[k]].stored_size > ct->items[recipe[k]].size)
+        {
+            free(map);
+            map = NULL;
+            break;
+        }
+
+        const chunk_info_t* ci = &ct->items[recipe[k]];
+        struct piece* p = &map->items[k];
+        p->orig_off = orig;
+        p->orig_len = ci->size;
+        p->stored_off = ci->_offset;
+        p->stored_len = ci->stored_size;
+        p->raw = ci->stored_size == ci->size;
+        p->hole = 0;
+        orig += ci->size;
+    }
+    free(recipe);
+    return map;
+}
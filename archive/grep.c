@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \file grep.c
+ * Поиск строк в файлах архива без извлечения
+ *
+ * Раньше, чтобы найти строку в архиве, его извлекали целиком и натравливали
+ * на результат grep: каждый байт записывался на диск и тут же читался
+ * обратно. Здесь файлы раздаются потокам, как при проверке, и просматриваются
+ * на месте. Несжатый файл лежит в архиве подряд, поэтому он отображается в
+ * память (mmap) и ищется прямо в страницах архива. Сжатые,
+ * дедуплицированные и разреженные файлы читаются через archive_pread кусками
+ * по GREP_BUFFER_SIZE; строка, не поместившаяся в кусок, переносится в начало
+ * буфера.
+ *
+ * Сам regexec медленный (сотни МБ/с), поэтому, если у выражения есть
+ * подстрока, без которой совпадения не бывает (grep_literal), участки без
+ * нее пропускаются через memmem, и regexec их не видит.
+ *
+ * regexec из glibc берет блокировку внутри regex_t, поэтому каждый поток
+ * компилирует выражение заново. Найденные строки копятся в буфере потока и
+ * передаются вызывающему под общей блокировкой, так что строки разных файлов
+ * не перемешиваются внутри одного вызова.
+ */
+
+/**
+ * Общее состояние потоков поиска
+ */
+struct grep_pool
+{
+    archive_t* a;
+    const regex_t* re; //!< Для потока, не скомпилировавшего свое выражение
+    const char* pattern;
+    char* literal; //!< Обязательная подстрока выражения (см. grep_literal)
+    size_t literal_len; //!< 0 - подстроки нет, кандидатов ищет regexec
+    const size_t* sel; //!< Номера выбранных записей каталога
+    size_t count;
+    uint64_t arch_size; //!< Размер архива: дальше него mmap дал бы SIGBUS
+    const struct archive_opts* opts;
+    archive_grep_fn hit;
+    void* ctx;
+    pthread_mutex_t lock; //!< Сериализует вызовы hit
+    atomic_size_t next; //!< Следующая не взятая запись
+    atomic_int matched; //!< Файлов с совпадениями
+};
+
+/**
+ * Состояние одного потока поиска
+ */
+struct grep_job
+{
+    struct grep_pool* pool;
+    const regex_t* re;
+    const char* name; //!< Имя текущего файла
+    char* buf; //!< Буфер для чтения через archive_pread
+    size_t cap;
+    char* out; //!< Найденные строки: [номер][длина][строка]...
+    size_t out_size, out_cap;
+    char matched; //!< В текущем файле нашлось совпадение
+};
+
+/**
+ * Передает накопленные строки вызывающему
+ */
+static void grep_flush(struct grep_job* job)
+{
+    struct grep_pool* pool = job->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (size_t pos = 0; pos < job->out_size;)
+    {
+        uint64_t lineno;
+        size_t len;
+        memcpy(&lineno, job->out + pos, sizeof(lineno));
+        memcpy(&len, job->out + pos + sizeof(lineno), sizeof(len));
+        pos += sizeof(lineno) + sizeof(len);
+        pool->hit(job->name, lineno, job->out + pos, len, pool->ctx);
+        pos += len;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    job->out_size = 0;
+}
+
+/**
+ * Запоминает найденную строку. Если места не хватает, строка передается
+ * сразу, без накопления
+ */
+static void grep_emit(
+    struct grep_job* job, uint64_t lineno, const char* line, size_t len)
+{
+    job->matched = 1;
+    size_t need = sizeof(lineno) + sizeof(len) + len;
+    if (job->out_size + need > job->out_cap)
+    {
+        grep_flush(job);
+        if (need > job->out_cap)
+        {
+            pthread_mutex_lock(&job->pool->lock);
+            job->pool->hit(job->name, lineno, line, len, job->pool->ctx);
+            pthread_mutex_unlock(&job->pool->lock);
+            return;
+        }
+    }
+    char* p = job->out + job->out_size;
+    memcpy(p, &lineno, sizeof(lineno));
+    memcpy(p + sizeof(lineno), &len, sizeof(len));
+    memcpy(p + sizeof(lineno) + sizeof(len), line, len);
+    job->out_size += need;
+}
+
+/**
+ * Количество '\n' в text[0, len)
+ */
+static uint64_t count_lines(const char* text, size_t len)
+{
+    uint64_t n = 0;
+    for (const char* end = text + len;
+         (text = memchr(text, '\n', end - text)); ++text)
+        n++;
+    return n;
+}
+
+/**
+ * Ищет в расширенном регулярном выражении самую длинную подстроку, которая
+ * входит в любое его совпадение: цепочку обычных символов вне скобок, за
+ * которыми не идет квантификатор. С '|' такой подстроки нет
+ * \param out Куда записать подстроку, не короче pattern
+ * \return Длина подстроки, 0 - ее нет
+ */
+static size_t grep_literal(const char* pattern, char* out)
+{
+    if (strchr(pattern, '|'))
+        return 0;
+
+    size_t best = 0, run = 0;
+    int depth = 0;
+    char* cur = out + strlen(pattern) + 1;
+    for (const char* p = pattern; *p; ++p)
+    {
+        char c = *p;
+        char literal = 0;
+        if (c == '\\' && p[1])
+        {
+            // \w, \< и обратные ссылки - не символы
+            c = *++p;
+            literal = !isalnum((unsigned char)c) && !strchr("<>`'", c)
+                && c != '\n';
+        }
+        else if (c == '{')
+        {
+            // Границы повторения {m,n}
+            while (p[1] && p[1] != '}')
+                p++;
+            p += p[1] == '}';
+        }
+        else if (c == '[')
+        {
+            // Скобочное выражение пропускается: ']' сразу после '[' или '[^' -
+            // обычный символ, а [:класс:], [=x=] и [.x.] кончаются своим ':]'
+            const char* q = p + 1;
+            q += *q == '^';
+            q += *q == ']';
+            while (*q && *q != ']')
+            {
+                if (*q == '[' && q[1] && strchr(":=.", q[1]))
+                {
+                    char delim = q[1];
+                    for (q += 2; *q && !(q[0] == delim && q[1] == ']'); ++q)
+                        ;
+                    q += *q ? 2 : 0;
+                }
+                else
+                    q++;
+            }
+            p = *q ? q : q - 1;
+        }
+        else if (c == '(' || c == ')')
+            depth += c == '(' ? 1 : -1;
+        else
+            literal = !strchr("\\.^$*+?{}", c) && c != '\n';
+
+        char quantified = p[1] && strchr("*+?{", p[1]);
+        if (!literal || depth > 0 || quantified)
+        {
+            run = 0;
+            continue;
+        }
+        cur[run++] = c;
+        if (run > best)
+        {
+            best = run;
+            memcpy(out, cur, run);
+        }
+    }
+    return best;
+}
+
+/**
+ * Ищет совпадения в строках text[0, len), text начинается с начала строки.
+ * Выражение запускается сразу на весь остаток текста (REG_STARTEND, без
+ * копирования и '\0'), а строка находится уже вокруг совпадения, так что
+ * строки без совпадений не стоят отдельного вызова regexec. Если есть
+ * обязательная подстрока, regexec начинает со строки, где она нашлась
+ * \param last Текст кончается концом файла. Иначе последняя строка без '\n'
+ * не просматривается - она еще не дочитана
+ * \param lineno Номер первой строки text, на выходе - первой непросмотренной
+ * \return Сколько байт просмотрено
+ */
+static size_t grep_scan(struct grep_job* job, const char* text, size_t len,
+    char last, uint64_t* lineno)
+{
+    size_t end = len;
+    if (!last)
+    {
+        const char* nl = memrchr(text, '\n', len);
+        end = nl ? (size_t)(nl - text) + 1 : 0;
+    }
+
+    const struct grep_pool* pool = job->pool;
+    size_t pos = 0;
+    while (pos < end)
+    {
+        // До первой строки с обязательной подстрокой совпадений нет
+        if (pool->literal_len)
+        {
+            const char* p = memmem(
+                text + pos, end - pos, pool->literal, pool->literal_len);
+            if (!p)
+                break;
+            const char* nl = memrchr(text + pos, '\n', p - (text + pos));
+            size_t from = nl ? (size_t)(nl - text) + 1 : pos;
+            *lineno += count_lines(text + pos, from - pos);
+            pos = from;
+        }
+
+        regmatch_t m = { .rm_so = pos, .rm_eo = end };
+        if (regexec(job->re, text, 1, &m, REG_STARTEND) != 0)
+            break;
+        // Пустое совпадение за последним '\n' - это не строка
+        if ((size_t)m.rm_so == end && text[end - 1] == '\n')
+            break;
+
+        const char* nl = memrchr(text + pos, '\n', m.rm_so - pos);
+        size_t from = nl ? (size_t)(nl - text) + 1 : pos;
+        *lineno += count_lines(text + pos, from - pos);
+        nl = memchr(text + m.rm_so, '\n', end - m.rm_so);
+        size_t to = nl ? (size_t)(nl - text) : end;
+
+        // [[:space:]] и явный '\n' совпадают и с концом строки. Совпадение,
+        // перешедшее на следующую строку, проверяется на одной этой строке
+        regmatch_t line = { .rm_so = from, .rm_eo = to };
+        if ((size_t)m.rm_eo <= to
+            || regexec(job->re, text, 1, &line, REG_STARTEND) == 0)
+            grep_emit(job, *lineno, text + from, to - from);
+        (*lineno)++;
+        pos = nl ? to + 1 : end;
+    }
+    if (pos < end)
+        *lineno += count_lines(text + pos, end - pos);
+    return end;
+}
+
+/**
+ * Ищет в файле, читая его через archive_pread
+ * \return 0 или код ошибки
+ */
+static int grep_read(struct grep_job* job, size_t index, uint64_t size)
+{
+    archive_member_t m = { .index = index };
+    uint64_t off = 0, lineno = 1;
+    size_t have = 0;
+    for (;;)
+    {
+        // Строка длиннее буфера: буфер растет, пока она не поместится
+        if (have == job->cap)
+        {
+            size_t cap = job->cap ? job->cap * 2 : GREP_BUFFER_SIZE;
+            char* buf = realloc(job->buf, cap);
+            if (!buf)
+                return ARCHIVE_ENOMEM;
+            job->buf = buf;
+            job->cap = cap;
+        }
+        ssize_t r = archive_pread(
+            job->pool->a, &m, job->buf + have, job->cap - have, off);
+        if (r < 0)
+            return r;
+        off += r;
+        have += r;
+        char last = r == 0 || off >= size;
+        size_t used = grep_scan(job, job->buf, have, last, &lineno);
+        if (last)
+            return 0;
+        memmove(job->buf, job->buf + used, have - used);
+        have -= used;
+    }
+}
+
+/**
+ * Ищет в несжатом файле прямо в отображении архива
+ * \return 0, код ошибки или 1, если отобразить не удалось
+ */
+static int grep_map(struct grep_job* job, const file_info_t* fi)
+{
+    struct grep_pool* pool = job->pool;
+    if (fi->_offset > pool->arch_size
+        || fi->filesize > pool->arch_size - fi->_offset)
+        return ARCHIVE_ECORRUPT;
+
+    // mmap принимает только смещения, кратные странице
+    uint64_t start = fi->_offset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t len = fi->filesize + (fi->_offset - start);
+    char* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, pool->a->fd, start);
+    if (map == MAP_FAILED)
+        return 1;
+    madvise(map, len, MADV_SEQUENTIAL);
+    uint64_t lineno = 1;
+    grep_scan(job, map + (fi->_offset - start), fi->filesize, 1, &lineno);
+    munmap(map, len);
+    return 0;
+}
+
+static void* grep_worker(void* arg)
+{
+    struct grep_pool* pool = arg;
+    struct grep_job job = { .pool = pool, .re = pool->re };
+    regex_t re;
+    char own = regcomp(&re, pool->pattern, REG_EXTENDED | REG_NEWLINE) == 0;
+    if (own)
+        job.re = &re;
+    job.out = malloc(GREP_OUT_SIZE);
+    job.out_cap = job.out ? GREP_OUT_SIZE : 0;
+
+    const fi_table_t* header = &pool->a->header;
+    for (;;)
+    {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->count)
+            break;
+
+        const file_info_t* fi = &header->items[pool->sel[i]];
+        job.name = fi_table_name(header, fi);
+        job.matched = 0;
+        uint64_t started = stats_now();
+        int ret = 1;
+        if (fi->filesize == 0)
+            ret = 0;
+        else if (!(fi->flags & (FI_COMPRESSED | FI_DEDUP | FI_SPARSE)))
+            ret = grep_map(&job, fi);
+        if (ret == 1)
+            ret = grep_read(&job, pool->sel[i], fi->filesize);
+        grep_flush(&job);
+        stats_member(job.name, fi->filesize, started);
+
+        if (ret < 0 && pool->opts->report)
+            pool->opts->report(job.name, ret, pool->opts->report_ctx);
+        if (job.matched)
+            atomic_fetch_add(&pool->matched, 1);
+    }
+
+    free(job.out);
+    free(job.buf);
+    if (own)
+        regfree(&re);
+    return NULL;
+}
+
+int archive_grep(archive_t* a, const char* pattern, int fnums, char** fnames,
+    const struct archive_opts* opts, archive_grep_fn hit, void* ctx)
+{
+    regex_t re;
+    if (regcomp(&re, pattern, REG_EXTENDED | REG_NEWLINE) != 0)
+        return ARCHIVE_EINVAL;
+    struct stat st;
+    if (fstat(a->fd, &st) == -1)
+    {
+        regfree(&re);
+        return ARCHIVE_EIO;
+    }
+
+    size_t* sel;
+    ssize_t count = select_members(&a->header, fnums, fnames, 0, &sel);
+    if (count < 0)
+    {
+        regfree(&re);
+        return count;
+    }
+
+    char* literal = malloc(2 * strlen(pattern) + 2);
+    if (!literal)
+    {
+        regfree(&re);
+        free(sel);
+        return ARCHIVE_ENOMEM;
+    }
+    struct grep_pool pool = {
+        .a = a,
+        .re = &re,
+        .pattern = pattern,
+        .literal = literal,
+        .literal_len = grep_literal(pattern, literal),
+        .sel = sel,
+        .count = count,
+        .arch_size = st.st_size,
+        .opts = opts,
+        .hit = hit,
+        .ctx = ctx,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+    atomic_init(&pool.next, 0);
+    atomic_init(&pool.matched, 0);
+    int jobs = opts->jobs;
+    if ((size_t)jobs > (size_t)count)
+        jobs = count;
+    uint64_t t = stats_now();
+    run_parallel(grep_worker, &pool, jobs);
+    stats_phase(STATS_COPY, t);
+
+    pthread_mutex_destroy(&pool.lock);
+    regfree(&re);
+    free(literal);
+    free(sel);
+    return atomic_load(&pool.matched);
+}
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ssize_t pread_full(int fd, void* buf, size_t n, off_t off)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t r = pread(fd, (char*)buf + done, n - done, off + done);
+        stats_count(STATS_READ_CALLS, 1);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    stats_count(STATS_READ_BYTES, done);
+    return done;
+}
+
+int pwrite_full(int fd, const void* buf, size_t n, off_t off)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t w = pwrite(fd, (const char*)buf + done, n - done, off + done);
+        stats_count(STATS_WRITE_CALLS, 1);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    stats_count(STATS_WRITE_BYTES, done);
+    return 0;
+}
+
+ssize_t read_full(int fd, void* buf, size_t n)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t r = read(fd, (char*)buf + done, n - done);
+        stats_count(STATS_READ_CALLS, 1);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+            return -1;
+        if (r == 0)
+            break;
+        done += r;
+    }
+    stats_count(STATS_READ_BYTES, done);
+    return done;
+}
+
+int write_full(int fd, const void* buf, size_t n)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t w = write(fd, (const char*)buf + done, n - done);
+        stats_count(STATS_WRITE_CALLS, 1);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        done += w;
+    }
+    stats_count(STATS_WRITE_BYTES, done);
+    return 0;
+}
+
+void le32_array(uint32_t* v, size_t n)
+{
+    for (size_t i = 0; !ARCH_HOST_LE && i < n; ++i)
+        v[i] = __builtin_bswap32(v[i]);
+}
+
+void le64_array(uint64_t* v, size_t n)
+{
+    for (size_t i = 0; !ARCH_HOST_LE && i < n; ++i)
+        v[i] = __builtin_bswap64(v[i]);
+}
+
+void file_info_le(file_info_t* fi, size_t n)
+{
+    for (size_t i = 0; !ARCH_HOST_LE && i < n; ++i)
+    {
+        // Все 64-битные поля идут подряд до name_length
+        le64_array(&fi[i].name_offset,
+            offsetof(file_info_t, name_length) / sizeof(uint64_t));
+        le32_array(&fi[i].name_length, 2);
+    }
+}
+
+void chunk_info_le(chunk_info_t* ci, size_t n)
+{
+    for (size_t i = 0; !ARCH_HOST_LE && i < n; ++i)
+    {
+        le64_array(&ci[i]._offset, 1);
+        le32_array(&ci[i].size, 2);
+    }
+}
+
+void run_parallel(void* (*worker)(void*), void* arg, int jobs)
+{
+    if (jobs <= 1)
+    {
+        worker(arg);
+        return;
+    }
+
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    for (; started < jobs && started < MAX_JOBS; ++started)
+    {
+        if (pthread_create(&threads[started], NULL, worker, arg))
+            break;
+    }
+    if (started == 0)
+        worker(arg);
+    for (int t = 0; t < started; ++t)
+        pthread_join(threads[t], NULL);
+}
+
+/**
+ * Можно ли использовать copy_file_range/sendfile. Сбрасывается, только если
+ * вызова нет в ядре или файловая система его не умеет (copy_never_works):
+ * остальные ошибки зависят от пары файлов, и после них следующий способ
+ * берется только для этого копирования
+ */
+static atomic_char use_copy_range = 1, use_sendfile = 1;
+
+/**
+ * Копирование через буфер: копирует bytes - done оставшихся байт
+ * \param crc Если не NULL, сюда досчитывается CRC32C скопированного
+ */
+static uint64_t copy_buffered(
+    int old, int new, uint64_t bytes, off_t pos, uint64_t done, uint32_t* crc);
+
+/**
+ * Ошибки, после которых имеет смысл перейти к следующему способу копирования
+ */
+static int copy_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP
+        || err == ENOTSUP || err == EBADF;
+}
+
+/**
+ * Ошибки, после которых способ копирования не заработает ни для каких файлов
+ */
+static int copy_never_works(int err)
+{
+    return err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP;
+}
+
+/**
+ * Копирование через sendfile: копирует bytes - done оставшихся байт
+ * \param fallback Сюда пишется 1, если sendfile для этих файлов не
+ * работает и копировать надо дальше другим способом
+ * \return Сколько всего скопировано, с учетом done
+ */
+static uint64_t copy_sendfile(
+    int old, int new, uint64_t bytes, off_t pos, uint64_t done, char* fallback)
+{
+    *fallback = !use_sendfile;
+    while (!*fallback && done < bytes)
+    {
+        size_t n = bytes - done > COPY_CHUNK ? COPY_CHUNK : bytes - done;
+        off_t in = pos + done;
+        ssize_t r = sendfile(new, old, &in, n);
+        stats_count(STATS_SENDFILE_CALLS, 1);
+        if (r > 0)
+        {
+            stats_count(STATS_KERNEL_COPY_BYTES, r);
+            done += r;
+            continue;
+        }
+        if (r == 0)
+            return done;
+        if (errno == EINTR)
+            continue;
+        if (!copy_unsupported(errno) || done > 0)
+            return done;
+        if (copy_never_works(errno))
+            use_sendfile = 0;
+        *fallback = 1;
+    }
+    return done;
+}
+
+uint64_t copy_file(int old, int new, uint64_t bytes, off_t pos)
+{
+    uint64_t done = 0;
+
+    char fallback = !use_copy_range;
+    while (!fallback && done < bytes)
+    {
+        size_t n = bytes - done > COPY_CHUNK ? COPY_CHUNK : bytes - done;
+        loff_t in = pos + done;
+        ssize_t r = copy_file_range(old, &in, new, NULL, n, 0);
+        stats_count(STATS_COPY_RANGE_CALLS, 1);
+        if (r > 0)
+        {
+            stats_count(STATS_KERNEL_COPY_BYTES, r);
+            done += r;
+            continue;
+        }
+        if (r == 0)
+            return done; // old закончился
+        if (errno == EINTR)
+            continue;
+        if (!copy_unsupported(errno) || done > 0)
+            return done;
+        if (copy_never_works(errno))
+            use_copy_range = 0;
+        fallback = 1;
+    }
+
+    uint64_t sent = copy_sendfile(old, new, bytes, pos, done, &fallback);
+    if (sent == bytes || !fallback)
+        return sent;
+    return copy_buffered(old, new, bytes, pos, sent, NULL);
+}
+
+uint64_t send_file(int old, int out, uint64_t bytes, off_t pos)
+{
+    // copy_file_range не работает с каналами и терминалами
+    struct stat st;
+    if (fstat(out, &st) == 0 && S_ISREG(st.st_mode))
+        return copy_file(old, out, bytes, pos);
+
+    uint64_t done = 0;
+    char pipe_out = S_ISFIFO(st.st_mode);
+    while (pipe_out && done < bytes)
+    {
+        size_t n = bytes - done > COPY_CHUNK ? COPY_CHUNK : bytes - done;
+        loff_t in = pos + done;
+        ssize_t r = splice(old, &in, out, NULL, n, SPLICE_F_MORE);
+        stats_count(STATS_SPLICE_CALLS, 1);
+        if (r > 0)
+        {
+            stats_count(STATS_KERNEL_COPY_BYTES, r);
+            done += r;
+            continue;
+        }
+        if (r == 0)
+            return done;
+        if (errno == EINTR)
+            continue;
+        if (!copy_unsupported(errno) || done > 0)
+            return done;
+        break;
+    }
+
+    char fallback;
+    uint64_t sent = copy_sendfile(old, out, bytes, pos, done, &fallback);
+    if (sent == bytes || !fallback)
+        return sent;
+    return copy_buffered(old, out, bytes, pos, sent, NULL);
+}
+
+uint64_t copy_file_crc(
+    int old, int new, uint64_t bytes, off_t pos, uint32_t* crc)
+{
+    *crc = 0;
+    return copy_buffered(old, new, bytes, pos, 0, crc);
+}
+
+static uint64_t copy_buffered(
+    int old, int new, uint64_t bytes, off_t pos, uint64_t done, uint32_t* crc)
+{
+    // Обычное копирование. Буфер растет вместе с объемом, чтобы мелкие файлы
+    // не требовали большой аллокации, а крупные копировались малым числом
+    // вызовов
+    size_t bufsize = COPY_BUFFER_MIN;
+    while (bufsize < COPY_BUFFER_MAX && bufsize < bytes - done)
+        bufsize *= 2;
+    char* buf = malloc(bufsize);
+    if (!buf)
+        return done;
+
+    while (done < bytes)
+    {
+        size_t n = bytes - done > bufsize ? bufsize : bytes - done;
+        ssize_t r = pread_full(old, buf, n, pos + done);
+        if (r <= 0)
+            break;
+        if (crc)
+            *crc = crc32c(*crc, buf, r);
+
+        ssize_t w = 0;
+        while (w < r)
+        {
+            ssize_t k = write(new, buf + w, r - w);
+            stats_count(STATS_WRITE_CALLS, 1);
+            if (k == -1 && errno == EINTR)
+                continue;
+            if (k <= 0)
+                break;
+            w += k;
+        }
+        done += w;
+        stats_count(STATS_WRITE_BYTES, w);
+        if (w < r || (size_t)r < n)
+            break;
+    }
+
+    free(buf);
+    return done;
+}
+
+char member_name_safe(const char* name)
+{
+    if (*name == '\0' || *name == '/')
+        return 0;
+    for (const char* p = name; p; p = strchr(p, '/'))
+    {
+        p += *p == '/';
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+    }
+    return 1;
+}
+
+int create_member_dirs(const char* name)
+{
+    // Несколько потоков извлечения могут создавать одну и ту же директорию,
+    // поэтому EEXIST - не ошибка
+    char* path = strdup(name);
+    if (!path)
+        return -1;
+    for (char* p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        if (mkdir(path, 0755) == -1 && errno != EEXIST)
+        {
+            free(path);
+            return -1;
+        }
+        *p = '/';
+    }
+    free(path);
+    return 0;
+}
+
+int create_member_file(const char* name, mode_t mask)
+{
+    stats_count(STATS_OPEN_CALLS, 1);
+    int fd = open(name, O_CREAT | O_WRONLY | O_TRUNC, mask);
+    if (fd != -1 || errno != ENOENT || !strchr(name, '/'))
+        return fd;
+
+    // Файл из поддиректории: создаем недостающие директории по пути
+    if (create_member_dirs(name) == -1)
+        return -1;
+    stats_count(STATS_OPEN_CALLS, 1);
+    return open(name, O_CREAT | O_WRONLY | O_TRUNC, mask);
+}
+
+uint64_t stat_mtime(const struct stat* st)
+{
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
@@ -0,0 +1,2820 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \mainpage archiver - простой архиватор
+ *
+ * ## Библиотека
+ * Вся работа с архивом вынесена в библиотеку libarchiver (archiver.h,
+ * статическая libarchiver.a и разделяемая libarchiver.so). Утилита archiver -
+ * только разбор аргументов и вывод сообщений поверх нее. Библиотека умеет
+ * читать отдельные файлы архива с произвольного места (archive_pread): для
+ * сжатых и дедуплицированных файлов при первом обращении строится карта
+ * кусков (struct piece_map), и дальше распаковываются только куски, в которые
+ * попал запрошенный диапазон.
+ *
+ * ## Описание формата архива
+ * Архив начинается с суперблока arch_super, который хранит сигнатуру
+ * ARCH_MAGIC и положение актуального каталога - массива структур file_info.
+ * Данные файлов и каталог идут после суперблока:
+ *
+ *     [arch_super][данные...][каталог][новые данные...][новый каталог]
+ *
+ * При добавлении (insert) данные новых файлов дописываются в конец архива
+ * (после актуального каталога), за ними пишется обновленный каталог, и только
+ * затем перезаписывается суперблок. Поэтому вставка стоит O(новые данные +
+ * каталог), а если программа упадет посреди вставки, суперблок продолжит
+ * указывать на старый, нетронутый каталог. Хвост, оставшийся от неудачной
+ * вставки, затирается при следующей вставке.
+ *
+ * Каталог состоит из записей file_info фиксированного размера, таблицы строк
+ * с именами файлов и таблицы чанков (см. "Дедупликация"):
+ *
+ *     [file_info...][имя\0имя\0...][chunk_info...]
+ *
+ * Запись хранит не само имя, а его положение и длину в таблице строк, так что
+ * короткие имена не раздувают каталог (раньше каждое имя занимало 256 байт),
+ * а длина имени ничем не ограничена.
+ *
+ * Все числа на диске - little-endian, независимо от процессора. Каталог
+ * начинается с границы ARCH_DIR_ALIGN, записи file_info (64 байта) и
+ * chunk_info выровнены естественным образом, таблица строк дополнена нулями
+ * до 8 байт, а суперблок хранит CRC32C всего каталога (dir_crc). Поэтому на
+ * little-endian машине read_header не копирует каталог, а отображает его в
+ * память (mmap, MAP_PRIVATE): массивы fi_table и таблица чанков указывают
+ * прямо в отображение, а копия делается, только когда массив приходится
+ * расширять. На big-endian машине каталог читается pread с преобразованием
+ * записей.
+ *
+ * ## Удаление и уплотнение
+ * Удаление (-r) не трогает данные: записи файлов помечаются флагом
+ * FI_DELETED (надгробие), пропадают из хеш-индекса, и дописывается новый
+ * каталог, как при вставке. Поэтому удаление стоит O(каталог), а не
+ * O(архив).
+ *
+ * Данные удаленных файлов и старые каталоги остаются в архиве мертвым
+ * грузом, пока их не уберет уплотнение (--compact, archive_compact). Живыми
+ * считаются суперблок, актуальный каталог с таблицей чанков, данные
+ * неудаленных файлов и все чанки; все остальное - мертвое. Уплотнение
+ * запускается, если мертвое занимает не меньше заданной доли места на диске,
+ * и по возможности пробивает на месте мертвых участков дыры
+ * (FALLOC_FL_PUNCH_HOLE) - архив при этом не копируется. С --rewrite (или
+ * если ФС не умеет дыры) архив переписывается в новый файл через
+ * copy_file_range, и заодно выбрасываются чанки, на которые больше не
+ * ссылается ни один файл.
+ *
+ * Для эффективной работы с заголовком архива существует таблица fi_table:
+ * непрерывный массив записей file_info и таблица строк с хеш-индексом по
+ * имени файла.
+ *
+ * ## Сжатие
+ * При вставке с флагом -c данные файла режутся на независимые блоки по
+ * LZ_BLOCK_SIZE байт, и каждый блок сжимается встроенным LZ-кодеком
+ * (lz_compress). Сжатый файл хранится так:
+ *
+ *     [таблица блоков: uint32_t на блок][блок 0][блок 1]...
+ *
+ * Элемент таблицы - размер блока в архиве; старший бит (LZ_RAW_BLOCK)
+ * означает, что блок не ужался и лежит как есть. Блоки независимы, поэтому
+ * сжимаются и распаковываются параллельно, а любой блок можно распаковать
+ * отдельно от остальных.
+ *
+ * ## Дедупликация
+ * При вставке с флагом -d данные файла режутся на чанки переменной длины по
+ * содержимому (content-defined chunking): граница ставится там, где
+ * скользящий gear-хеш последних байт попадает под маску CDC_MASK (в среднем
+ * раз в 8 КБ, но не чаще CDC_MIN_CHUNK и не реже CDC_MAX_CHUNK). Поэтому
+ * вставка или удаление байт в середине файла сдвигает только соседние
+ * границы, а остальные чанки остаются прежними.
+ *
+ * Каждый чанк хранится в архиве один раз и описывается записью chunk_info в
+ * таблице чанков, которая лежит сразу за каталогом. Данные файла с флагом
+ * FI_DEDUP - это "рецепт": массив uint32_t номеров чанков в таблице.
+ * Чанки ищутся по 128-битному хешу содержимого, поэтому повторная вставка
+ * слегка измененного файла дописывает в архив только новые чанки. С флагом -c
+ * каждый новый чанк еще и сжимается.
+ *
+ * ## Контрольные суммы
+ * Для каждого вставленного файла хранится CRC32C исходного содержимого
+ * (флаг FI_CHECKSUM; у файлов, пришедших из архивов старого формата, его
+ * нет). Сумма считается в том же проходе, в котором данные копируются в
+ * архив, на SSE4.2 - аппаратной инструкцией crc32, иначе - таблично
+ * (slicing-by-8). Режим -v проверяет все файлы архива параллельно; при
+ * извлечении сжатых и дедуплицированных файлов сумма тоже сверяется, так как
+ * данные все равно проходят через память программы.
+ *
+ * ## Директории
+ * Директория в списке вставки обходится рекурсивно (walk.c): несколько
+ * потоков разбирают общий стек директорий, читают записи и делают fstatat
+ * относительно дескриптора директории, а поддиректории открывают через
+ * openat, так что ядру не приходится заново разбирать длинные пути. Найденные
+ * файлы пачками по WALK_BATCH_SIZE передаются вставке, и пока данные одной
+ * пачки копируются в архив, обход ищет следующие. Имена в архиве - пути от
+ * самой директории ("src/lib/a.c"); при извлечении недостающие директории
+ * создаются, а имена с ".." и абсолютные пути отвергаются.
+ *
+ * ## Разреженные файлы
+ * При вставке без сжатия участки с данными ищутся через
+ * lseek(SEEK_DATA/SEEK_HOLE), и если в файле есть дыры, в архив пишутся
+ * только участки (флаг FI_SPARSE, формат описан в sparse.c). Образы дисков и
+ * файлы баз данных с большими дырами так не раздувают архив и не читаются
+ * целиком, а при извлечении дыры восстанавливаются через ftruncate.
+ *
+ * ## Обновление
+ * Вставка с флагом -u (opts->update) добавляет только новые и изменившиеся
+ * файлы, как `rsync` или `tar -u`. Для каждого файла ищется последняя запись
+ * с тем же именем; если совпали размер, права и время изменения (поле mtime
+ * записи), файл пропускается, даже не
+ * открываясь. С --hash файл с другим временем, но тем же размером еще
+ * читается и сверяется по CRC32C: если содержимое то же, у записи только
+ * обновляется время. Изменившиеся файлы дописываются как при обычной
+ * вставке, а их старые записи помечаются FI_DELETED в том же новом каталоге,
+ * так что обновление по-прежнему фиксируется одной записью суперблока.
+ * Повторное обновление неизменного дерева стоит только обхода и stat.
+ *
+ * ## Мелкие файлы и io_uring
+ * Для тысяч мелких файлов время уходит не на данные, а на системные вызовы
+ * open/read/write/close по одному на файл. Поэтому несжатые файлы до
+ * URING_SMALL_FILE байт вставляются и извлекаются пачками по URING_BATCH
+ * через io_uring (uring.c): каждая операция ставится сразу для всей пачки и
+ * отправляется одним io_uring_enter, а при вставке данные пачки еще и
+ * пишутся в архив одним pwrite. Если ядро не дает io_uring (старое ядро,
+ * seccomp) или в окружении ARCHIVER_IO_URING=0, используется обычный путь.
+ *
+ * Остальные несжатые файлы вставляются конвейером (pipeline.c): несколько
+ * потоков-читателей (не меньше PIPE_MIN_READERS) читают файлы одновременно,
+ * каждый в свою пару буферов, а вставляющий поток пишет заполненные буферы в
+ * архив. Чтение и запись так перекрываются, а задержки медленных (сетевых)
+ * источников не складываются.
+ *
+ * ## Потоковый архив
+ * Если вместо имени архива указать "-", -i пишет архив в stdout, а -e и -v
+ * читают его из stdin, например `archiver - -i -c * | ssh host archiver - -e`.
+ * Это отдельный формат (сигнатура STREAM_MAGIC, описан в stream.c), который
+ * пишется и читается за один последовательный проход, без seek: каждый файл
+ * идет записью file_info и кадрами данных, а размер и сумма - после данных.
+ * Обычный архив из такого потока не открывается (ARCHIVE_ESTREAM), но поток
+ * можно сохранить в файл и позже извлечь через stdin.
+ *
+ * ## Поиск
+ * `archiver АРХИВ --grep ШАБЛОН [ФАЙЛ,...]` (archive_grep) ищет строки по
+ * регулярному выражению прямо в архиве, без извлечения на диск (grep.c).
+ * Файлы раздаются потокам; несжатые просматриваются в отображении архива
+ * (mmap), остальные распаковываются кусками через archive_pread. Участки без
+ * обязательной подстроки выражения пропускаются через memmem.
+ *
+ * ## Одновременный доступ
+ * archive_open блокирует файл архива через flock: читатели - общей
+ * блокировкой, писатели - исключительной, так что задания над одним архивом
+ * не портят друг друга. Переписывание (старый формат, --compact --rewrite)
+ * пишет во временный файл в директории архива - безымянный (O_TMPFILE) или
+ * с уникальным именем - и подменяет архив через rename. Процесс, который
+ * ждал блокировки старого файла, замечает подмену и открывает архив заново.
+ *
+ * ## Вывод файла
+ * `archiver АРХИВ --cat ФАЙЛ [--range НАЧАЛО:ДЛИНА]` (archive_cat) выводит
+ * файл или диапазон его байт в stdout. Для несжатого файла ядру заранее
+ * сообщается читаемый диапазон (posix_fadvise), а в канал данные идут через
+ * splice (send_file), так что просмотр конца большого лога стоит только
+ * прочитанного.
+ *
+ * ## Статистика
+ * С флагом `--stats` (или с переменной окружения ARCHIVER_STATS для любой
+ * программы с библиотекой) при выходе выводится строка JSON: время фаз
+ * (чтение каталога, stat, копирование, запись каталога, fdatasync, rename),
+ * число системных вызовов и байт, скорость и самые медленные файлы (stats.c,
+ * archive_stats_write).
+ *
+ * ## Старый формат
+ * Архивы предыдущих версий не имеют суперблока: вначале последовательно идут
+ * структуры file_info, после этого - содержимое файлов, идущее подряд. Конец
+ * заголовка - 4 нулевых байта (0000 0000). Такие архивы читаются как есть, а
+ * при первой вставке один раз переписываются в новый формат
+ *
+ * __Ограничения__:
+ * * Файл должен быть регулярным
+ * * Имена файлов не должны повторяться (ничего не сломается, просто не надо);
+ *   при -u старые копии заменяются новыми
+ *
+ * ## Тонкости
+ * При указании файла по какому-то сложному пути во время добавления файла в
+ * архив программа обрезает путь, занося в архив только название. Файлы из
+ * директорий сохраняют путь от самой директории
+ */
+
+_Static_assert(LZ_BLOCK_SIZE >= CDC_MAX_CHUNK,
+    "буфер archive_pread должен вмещать и блок, и чанк");
+
+/**
+ * Обновляет заголовок, вставляя информацию о файлах fnames в конец заголовка.
+ * Новые записи начинаются с номера header->count до вызова. Директории не
+ * вставляются, а собираются в dirs для обхода
+ * \param header Заголовок архива
+ * \param opts Куда сообщать о пропущенных файлах
+ * \param dirs Массив на fnums элементов для найденных директорий
+ * \param ndirs Куда записать количество директорий
+ * \param touched Счетчик записей, у которых в режиме обновления поменялось
+ * только время
+ * \return количество вставленных файлов или ARCHIVE_ENOMEM
+ */
+static int update_header_for_input(fi_table_t* header, int fnums,
+    char** fnames, const struct archive_opts* opts, const char** dirs,
+    size_t* ndirs, size_t* touched);
+
+/**
+ * Вставляет все регулярные файлы дерева dir. Пока файлы одной пачки
+ * копируются в архив, потоки обхода уже ищут следующие
+ * \param off Позиция, с которой пишутся данные; сюда же записывается конец
+ * записанных данных
+ * \return Количество вставленных файлов или код ошибки
+ */
+static ssize_t insert_tree(fi_table_t* header, const char* dir, int arch_fd,
+    uint64_t* off, const struct archive_opts* opts, size_t old,
+    size_t* touched);
+
+/**
+ * Решает в режиме обновления, нужно ли вставлять файл path с именем name:
+ * сравнивает его с последней копией среди записей [0, old). Если по
+ * ARCHIVE_UPDATE_HASH оказалось, что поменялось только время, оно
+ * обновляется в записи и увеличивается *touched
+ * \param fi Запись, которая будет вставлена (размер, права, время)
+ * \return 1 - вставлять, 0 - пропустить
+ */
+static int member_changed(fi_table_t* header, size_t old, const char* name,
+    const char* path, const file_info_t* fi, const struct archive_opts* opts,
+    size_t* touched);
+
+/**
+ * Помечает удаленными записи [0, old), у которых среди новых записей
+ * (начиная с old) есть запись с тем же именем
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+static int supersede_members(fi_table_t* header, size_t old);
+
+/**
+ * Непосредственно вставляет файлы в архив
+ *
+ * Данные новых файлов (записи, начиная с from) дописываются в архив подряд с
+ * позиции *off, по ходу дела заполняются _offset и stored_size. Старое
+ * содержимое архива не трогается. Файлы, которые не удалось открыть,
+ * выкидываются из заголовка
+ * \param header Заголовок архива
+ * \param from Первая из новых записей заголовка
+ * \param arch_fd Файловый дескриптор архива, открытого на запись
+ * \param off Позиция, с которой пишутся данные; сюда же записывается конец
+ * записанных данных
+ * \param opts Флаги вставки
+ * \return 0 или код ошибки
+ */
+static int insert_files_routine(fi_table_t* header, size_t from, int arch_fd,
+    uint64_t* off, const struct archive_opts* opts);
+
+/**
+ * Вставляет пачку мелких файлов (записи [from, from + n)) через io_uring:
+ * файлы открываются и читаются пачкой, а в архив пишутся подряд одним pwrite
+ * \param f Массив на URING_BATCH файлов
+ * \param buf Буфер на URING_BATCH * URING_SMALL_FILE байт
+ * \return 0, ARCHIVE_EIO или 1, если кольцо сломалось и пачку нужно вставить
+ * обычным путем. Не открывшиеся файлы отмечены в f[].err
+ */
+static int insert_small_files(fi_table_t* header, size_t from, size_t n,
+    struct uring* ring, struct small_file* f, uint8_t* buf, int arch_fd,
+    uint64_t* off, const struct archive_opts* opts);
+
+struct member_pool;
+
+/**
+ * Извлекает одну пачку выбранных записей [from, to): мелкие несжатые файлы -
+ * через io_uring, остальные - обычным путем
+ * \param f Массив на URING_BATCH файлов
+ * \param buf Буфер на URING_BATCH * URING_SMALL_FILE байт
+ */
+static void extract_small_files(struct member_pool* pool, struct uring* ring,
+    struct small_file* f, uint8_t* buf, size_t from, size_t to);
+
+/**
+ * Извлекает один файл архива в текущую директорию
+ * \param header Заголовок архива (нужен для таблицы чанков)
+ * \param fi Запись каталога
+ * \param arch_fd Файловый дескриптор архива
+ * \param jobs Количество потоков для распаковки сжатого файла
+ * \param opts Куда сообщать о проблемах
+ * \return 0 или код ошибки
+ */
+static int extract_member(const fi_table_t* header, const file_info_t* fi,
+    int arch_fd, int jobs, const struct archive_opts* opts);
+
+/**
+ * Проверяет контрольную сумму одного файла архива
+ * \param buf Буфер на VERIFY_BUFFER_SIZE байт
+ * \return 0 - сумма совпала, 1 - у файла нет суммы, -1 - не совпала или
+ * данные повреждены
+ */
+static int verify_member(const fi_table_t* header, const file_info_t* fi,
+    int arch_fd, uint8_t* buf);
+
+/**
+ * Готовит в таблице строк место еще под extra байт
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+static int fi_table_reserve_names(fi_table_t* t, size_t extra);
+
+/**
+ * Переводит числа суперблока между порядком хоста и little-endian
+ */
+static void super_le(arch_super_t* sb);
+
+/**
+ * Записывает суперблок sb (в порядке байт хоста) в начало архива
+ * \return 0 или -1
+ */
+static int write_super(int arch_fd, const arch_super_t* sb);
+
+/**
+ * Лежит ли p в отображении каталога таблицы t (и не может быть освобожден)
+ */
+static char fi_table_mapped(const fi_table_t* t, const void* p);
+
+/**
+ * realloc для массивов таблицы: массив из отображения каталога не
+ * освобождается, а копируется (used байт) в новую память
+ */
+static void* fi_table_realloc(
+    fi_table_t* t, void* p, size_t used, size_t size);
+
+/**
+ * Переносит записи, строки и чанки таблицы t из отображения каталога в
+ * обычную память и снимает отображение. Нужно перед тем, как пробить дыры
+ * или писать поверх прежнего каталога: страницы отображения, которые еще не
+ * копировались, читались бы уже новым содержимым файла
+ * \return 0 или ARCHIVE_ENOMEM (тогда часть массивов остается в отображении)
+ */
+static int fi_table_unmap(fi_table_t* t);
+
+/**
+ * Отображает каталог sb в память и направляет на него записи, строки и
+ * чанки пустой таблицы header. Записи остаются непроверенными, count и
+ * names_size - прежними
+ * \return 1; 0, если отобразить нельзя (старая версия, big-endian хост,
+ * таблица не пуста, mmap не вышел) - тогда каталог читается копией;
+ * ARCHIVE_EFORMAT, если не сошлась сумма, или ARCHIVE_ENOMEM
+ */
+static int map_directory(
+    fi_table_t* header, int arch_fd, const arch_super_t* sb);
+
+/**
+ * Читает каталог sb копией после записей header и переводит числа в
+ * порядок байт хоста. Как и
+ * map_directory, не проверяет записи и не меняет count и names_size
+ * \return 0 или код ошибки
+ */
+static int copy_directory(
+    fi_table_t* header, int arch_fd, const arch_super_t* sb);
+
+/**
+ * Сообщает о проблеме с файлом name, если есть куда
+ */
+static void report(const struct archive_opts* opts, const char* name, int err)
+{
+    if (opts && opts->report)
+        opts->report(name, err, opts->report_ctx);
+}
+
+int read_super(int arch_fd, arch_super_t* sb)
+{
+    if (pread(arch_fd, sb, sizeof(arch_super_t), 0) != sizeof(arch_super_t))
+        return 0;
+    super_le(sb);
+    if (memcmp(sb->magic, STREAM_MAGIC, ARCH_MAGIC_SIZE) == 0)
+        return ARCHIVE_ESTREAM;
+    if (memcmp(sb->magic, ARCH_MAGIC, ARCH_MAGIC_SIZE) != 0)
+        return 0;
+    if (sb->version != ARCH_VERSION)
+        return ARCHIVE_EVERSION;
+    return 1;
+}
+
+void fill_super(arch_super_t* sb, uint64_t dir_offset, uint64_t dir_count,
+    uint64_t names_size, uint64_t chunk_count)
+{
+    memset(sb, 0, sizeof(arch_super_t));
+    memcpy(sb->magic, ARCH_MAGIC, ARCH_MAGIC_SIZE);
+    sb->version = ARCH_VERSION;
+    sb->dir_offset = dir_offset;
+    sb->dir_count = dir_count;
+    sb->names_size = names_size;
+    sb->chunk_count = chunk_count;
+}
+
+uint64_t super_data_end(const arch_super_t* sb)
+{
+    return sb->dir_offset + sb->dir_count * sizeof(file_info_t)
+        + sb->names_size + sb->chunk_count * sizeof(chunk_info_t);
+}
+
+static void super_le(arch_super_t* sb)
+{
+    le32_array(&sb->version, 2);
+    le64_array(&sb->dir_offset, 4);
+}
+
+static int write_super(int arch_fd, const arch_super_t* sb)
+{
+    arch_super_t le = *sb;
+    super_le(&le);
+    return pwrite_full(arch_fd, &le, sizeof(arch_super_t), 0);
+}
+
+static char fi_table_mapped(const fi_table_t* t, const void* p)
+{
+    const char* map = t->dir_map;
+    return map && (const char*)p >= map
+        && (const char*)p < map + t->dir_map_size;
+}
+
+static void* fi_table_realloc(
+    fi_table_t* t, void* p, size_t used, size_t size)
+{
+    if (!fi_table_mapped(t, p))
+        return realloc(p, size);
+    void* copy = malloc(size);
+    if (copy)
+        memcpy(copy, p, used);
+    return copy;
+}
+
+static int fi_table_unmap(fi_table_t* t)
+{
+    if (!t->dir_map)
+        return 0;
+    if (fi_table_mapped(t, t->items))
+    {
+        file_info_t* items = fi_table_realloc(t, t->items,
+            t->count * sizeof(file_info_t), t->cap * sizeof(file_info_t) + 1);
+        if (!items)
+            return ARCHIVE_ENOMEM;
+        t->items = items;
+    }
+    if (fi_table_mapped(t, t->names))
+    {
+        char* names
+            = fi_table_realloc(t, t->names, t->names_size, t->names_cap + 1);
+        if (!names)
+            return ARCHIVE_ENOMEM;
+        t->names = names;
+    }
+    chunk_table_t* ct = &t->chunks;
+    if (ct->mapped)
+    {
+        chunk_info_t* items = malloc(ct->cap * sizeof(chunk_info_t) + 1);
+        if (!items)
+            return ARCHIVE_ENOMEM;
+        memcpy(items, ct->items, ct->count * sizeof(chunk_info_t));
+        ct->items = items;
+        ct->mapped = 0;
+    }
+    munmap(t->dir_map, t->dir_map_size);
+    t->dir_map = NULL;
+    t->dir_map_size = 0;
+    return 0;
+}
+
+static int map_directory(
+    fi_table_t* header, int arch_fd, const arch_super_t* sb)
+{
+    uint64_t isize = sb->dir_count * sizeof(file_info_t);
+    uint64_t size = super_data_end(sb) - sb->dir_offset;
+    if (!ARCH_HOST_LE || size == 0
+        || header->count || header->names_size || header->chunks.count
+        || sb->dir_offset % ARCH_DIR_ALIGN || sb->names_size % 8)
+        return 0;
+
+    // mmap принимает только смещения, кратные странице
+    uint64_t start = sb->dir_offset & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t len = size + (sb->dir_offset - start);
+    char* map = mmap(
+        NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, arch_fd, start);
+    if (map == MAP_FAILED)
+        return 0;
+    char* dir = map + (sb->dir_offset - start);
+    if (crc32c(0, dir, size) != sb->dir_crc)
+    {
+        munmap(map, len);
+        return ARCHIVE_EFORMAT;
+    }
+
+    // Указатели ставятся только на непустые части: пустой массив остается
+    // NULL и растет как обычно
+    fi_table_free(header);
+    header->dir_map = map;
+    header->dir_map_size = len;
+    header->src = malloc(sb->dir_count * sizeof(const char*) + 1);
+    header->chain = malloc(sb->dir_count * sizeof(size_t) + 1);
+    if (!header->src || !header->chain)
+        return ARCHIVE_ENOMEM;
+    header->cap = sb->dir_count;
+    if (sb->dir_count)
+        header->items = (file_info_t*)dir;
+    if (sb->names_size)
+        header->names = dir + isize;
+    header->names_cap = sb->names_size;
+    chunk_table_t* ct = &header->chunks;
+    if (sb->chunk_count)
+    {
+        ct->items = (chunk_info_t*)(dir + isize + sb->names_size);
+        ct->mapped = 1;
+    }
+    ct->cap = ct->count = sb->chunk_count;
+    return 1;
+}
+
+static int copy_directory(
+    fi_table_t* header, int arch_fd, const arch_super_t* sb)
+{
+    // Каждая часть каталога читается одним вызовом прямо в свой массив
+    size_t size = sb->dir_count * sizeof(file_info_t);
+    size_t base = header->names_size;
+    // Пустой каталог пишет неудачная первая вставка: массивы при этом так и
+    // остаются NULL, читать нечего
+    if (sb->dir_count == 0 && sb->names_size == 0 && sb->chunk_count == 0)
+        return 0;
+    if (fi_table_reserve(header, header->count + sb->dir_count)
+        || fi_table_reserve_names(header, sb->names_size))
+        return ARCHIVE_ENOMEM;
+    file_info_t* items = header->items + header->count;
+    chunk_table_t* ct = &header->chunks;
+    size_t csize = sb->chunk_count * sizeof(chunk_info_t);
+    chunk_info_t* chunks = malloc(csize + 1);
+    int ret = chunks ? 0 : ARCHIVE_ENOMEM;
+    if (ret == 0
+        && (pread_full(arch_fd, items, size, sb->dir_offset) != (ssize_t)size
+            || pread_full(arch_fd, header->names + base, sb->names_size,
+                   sb->dir_offset + size)
+                != (ssize_t)sb->names_size
+            || pread_full(arch_fd, chunks, csize,
+                   sb->dir_offset + size + sb->names_size)
+                != (ssize_t)csize))
+        ret = ARCHIVE_EFORMAT;
+    if (ret == 0)
+    {
+        uint32_t crc = crc32c(0, items, size);
+        crc = crc32c(crc, header->names + base, sb->names_size);
+        if (crc32c(crc, chunks, csize) != sb->dir_crc)
+            ret = ARCHIVE_EFORMAT;
+    }
+    if (ret != 0)
+    {
+        free(chunks);
+        return ret;
+    }
+    file_info_le(items, sb->dir_count);
+    chunk_info_le(chunks, sb->chunk_count);
+    chunk_table_free(ct);
+    ct->items = chunks;
+    ct->cap = ct->count = sb->chunk_count;
+    return 0;
+}
+
+int read_header(fi_table_t* header, int arch_fd)
+{
+    struct stat st;
+    if (fstat(arch_fd, &st) == -1)
+        return ARCHIVE_EIO;
+
+    arch_super_t sb;
+    int sup = read_super(arch_fd, &sb);
+    if (sup < 0)
+        return sup;
+    if (sup)
+    {
+        size_t rec = sizeof(file_info_t);
+        uint64_t avail = sb.dir_offset <= (uint64_t)st.st_size
+            ? st.st_size - sb.dir_offset
+            : 0;
+        if (sb.dir_offset > (uint64_t)st.st_size
+            || sb.dir_count > avail / rec
+            || sb.names_size > avail - sb.dir_count * rec
+            || sb.chunk_count > (avail - sb.dir_count * rec - sb.names_size)
+                / sizeof(chunk_info_t))
+        {
+            return ARCHIVE_EFORMAT;
+        }
+
+        size_t base = header->names_size;
+        int ret = map_directory(header, arch_fd, &sb);
+        if (ret == 0)
+            ret = copy_directory(header, arch_fd, &sb);
+        if (ret < 0)
+            return ret;
+
+        // Имя должно целиком лежать в таблице и кончаться '\0'
+        file_info_t* items = header->items + header->count;
+        const char* names = header->names + base;
+        for (size_t i = 0; i < sb.dir_count; ++i)
+        {
+            if (items[i].name_offset >= sb.names_size
+                || items[i].name_length
+                    >= sb.names_size - items[i].name_offset
+                || names[items[i].name_offset + items[i].name_length] != '\0')
+            {
+                return ARCHIVE_EFORMAT;
+            }
+            if (base)
+                items[i].name_offset += base;
+        }
+
+        memset(header->src + header->count, 0,
+            sb.dir_count * sizeof(const char*));
+        header->count += sb.dir_count;
+        header->names_size += sb.names_size;
+        if (fi_table_reindex(header) || chunk_table_reindex(&header->chunks))
+            return ARCHIVE_ENOMEM;
+        lseek(arch_fd, 0, SEEK_SET);
+        return 0;
+    }
+
+    // Старый формат: длина заголовка заранее не известна, поэтому он читается
+    // кусками по HEADER_CHUNK записей, пока не встретятся HEADER_ENDING_SIZE
+    // нулевых байт
+    const uint32_t header_ending = 0;
+    char* buf = malloc(HEADER_CHUNK * sizeof(legacy_file_info_t));
+    if (!buf)
+        return ARCHIVE_ENOMEM;
+    size_t have = 0, pos = 0;
+    off_t file_pos = 0;
+    char eof = 0;
+    int ret = 0;
+    for (;;)
+    {
+        if (have - pos < sizeof(legacy_file_info_t) && !eof)
+        {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+
+            size_t want = HEADER_CHUNK * sizeof(legacy_file_info_t) - have;
+            ssize_t r = pread_full(arch_fd, buf + have, want, file_pos);
+            if (r == -1)
+            {
+                ret = ARCHIVE_EIO;
+                break;
+            }
+            eof = (size_t)r < want;
+            have += r;
+            file_pos += r;
+            continue;
+        }
+
+        // Здесь, нас не заботит byte order, поскольку значение 0x0 симметрично
+        // Если условие выполняется, заголовок кончился (или файл пустой)
+        if (have - pos < sizeof(legacy_file_info_t)
+            || memcmp(buf + pos, &header_ending, HEADER_ENDING_SIZE) == 0)
+            break;
+
+        legacy_file_info_t old;
+        memcpy(&old, buf + pos, sizeof(legacy_file_info_t));
+        pos += sizeof(legacy_file_info_t);
+
+        file_info_t fi;
+        memset(&fi, 0, sizeof(file_info_t));
+        old.filename[FILENAME_LENGTH - 1] = '\0';
+        fi.filesize = fi.stored_size = old.filesize;
+        fi.mask = old.mask;
+        fi._offset = old._offset;
+        if (fi_table_push(header, &fi, (const char*)old.filename, NULL) < 0)
+        {
+            ret = ARCHIVE_ENOMEM;
+            break;
+        }
+    }
+    free(buf);
+    lseek(arch_fd, 0, SEEK_SET);
+    return ret;
+}
+
+int write_directory(
+    const fi_table_t* header, int arch_fd, uint64_t off, arch_super_t* sb)
+{
+    // Каталог выравнивается, чтобы его записи можно было читать прямо из
+    // отображения, а таблица строк дополняется нулями до 8 байт, чтобы
+    // выровненной оказалась и таблица чанков
+    static const char zeros[8];
+    off = (off + ARCH_DIR_ALIGN - 1) & ~(uint64_t)(ARCH_DIR_ALIGN - 1);
+    uint64_t dsize = header->count * sizeof(file_info_t);
+    uint64_t nsize = header->names_size, pad = -nsize & 7;
+    uint64_t csize = header->chunks.count * sizeof(chunk_info_t);
+
+    // Записи и строки уже лежат подряд, так что каждая часть каталога
+    // пишется одним вызовом. На big-endian хосте записи сначала переводятся
+    // в little-endian во временных копиях
+    const file_info_t* items = header->items;
+    const chunk_info_t* chunks = header->chunks.items;
+    file_info_t* items_le = NULL;
+    chunk_info_t* chunks_le = NULL;
+    if (!ARCH_HOST_LE)
+    {
+        items_le = malloc(dsize + 1);
+        chunks_le = malloc(csize + 1);
+        if (!items_le || !chunks_le)
+        {
+            free(items_le);
+            free(chunks_le);
+            return ARCHIVE_ENOMEM;
+        }
+        if (dsize)
+            memcpy(items_le, items, dsize);
+        if (csize)
+            memcpy(chunks_le, chunks, csize);
+        file_info_le(items_le, header->count);
+        chunk_info_le(chunks_le, header->chunks.count);
+        items = items_le;
+        chunks = chunks_le;
+    }
+
+    uint32_t crc = crc32c(0, items, dsize);
+    crc = crc32c(crc, header->names, nsize);
+    crc = crc32c(crc, zeros, pad);
+    crc = crc32c(crc, chunks, csize);
+    int ret = 0;
+    if (pwrite_full(arch_fd, items, dsize, off) == -1
+        || pwrite_full(arch_fd, header->names, nsize, off + dsize) == -1
+        || pwrite_full(arch_fd, zeros, pad, off + dsize + nsize) == -1
+        || pwrite_full(arch_fd, chunks, csize, off + dsize + nsize + pad)
+            == -1)
+    {
+        ret = ARCHIVE_EIO;
+    }
+    free(items_le);
+    free(chunks_le);
+    fill_super(
+        sb, off, header->count, nsize + pad, header->chunks.count);
+    sb->dir_crc = crc;
+    return ret;
+}
+
+int commit_super(int arch_fd, const arch_super_t* sb)
+{
+    // Сначала на диске должны оказаться данные и каталог, и только потом
+    // суперблок, который на них ссылается
+    stats_count(STATS_SYNC_CALLS, 2);
+    if (fdatasync(arch_fd) == -1 || write_super(arch_fd, sb) == -1
+        || fdatasync(arch_fd) == -1)
+    {
+        return ARCHIVE_EIO;
+    }
+    return 0;
+}
+
+/**
+ * Директория, в которой лежит archive (с '/' на конце или ".")
+ * \return Строка, которую освобождает вызывающий, или NULL
+ */
+static char* archive_dir(const char* archive)
+{
+    const char* slash = strrchr(archive, '/');
+    return slash ? strndup(archive, slash - archive + 1) : strdup(".");
+}
+
+/**
+ * Создает временный файл для переписывания архива. Он лежит в директории
+ * архива, иначе rename не сработает, и по возможности безымянный
+ * (O_TMPFILE): если процесс упадет, от файла ничего не останется. Иначе
+ * файл получает уникальное имя "архив.XXXXXX"
+ * \param name Сюда записывается имя файла (освобождает вызывающий) или NULL,
+ * если файл безымянный
+ * \return Дескриптор или -1
+ */
+static int temp_open(const char* archive, char** name)
+{
+    *name = NULL;
+    char* dir = archive_dir(archive);
+    if (!dir)
+        return -1;
+    // Безымянному файлу имя потом дает linkat через /proc
+    int fd = -1;
+    stats_count(STATS_OPEN_CALLS, 1);
+    if (access("/proc/self/fd", X_OK) == 0)
+        fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+    free(dir);
+    if (fd != -1)
+        return fd;
+
+    *name = malloc(strlen(archive) + sizeof(TEMP_SUFFIX));
+    if (!*name)
+        return -1;
+    sprintf(*name, "%s" TEMP_SUFFIX, archive);
+    fd = mkostemp(*name, O_CLOEXEC);
+    if (fd == -1)
+    {
+        free(*name);
+        *name = NULL;
+    }
+    return fd;
+}
+
+/**
+ * Атомарно ставит временный файл fd (см. temp_open) на место архива.
+ * Безымянный файл сначала получает уникальное имя через linkat: заменить
+ * существующий файл linkat не может. После rename синхронизируется
+ * директория, иначе после падения в ней может оказаться старый архив
+ * \return 0 или -1; при ошибке архив прежний, а временного имени нет
+ */
+static int temp_commit(int fd, const char* name, const char* archive)
+{
+    char* linked = NULL;
+    if (!name)
+    {
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        size_t size = strlen(archive) + 32;
+        linked = malloc(size);
+        for (int i = 0; linked && i < TEMP_ATTEMPTS; ++i)
+        {
+            snprintf(linked, size, "%s.%d.%d", archive, (int)getpid(), i);
+            if (linkat(AT_FDCWD, proc, AT_FDCWD, linked, AT_SYMLINK_FOLLOW)
+                == 0)
+            {
+                name = linked;
+                break;
+            }
+            if (errno != EEXIST)
+                break;
+        }
+        if (!name)
+        {
+            free(linked);
+            return -1;
+        }
+    }
+
+    int ret = rename(name, archive);
+    if (ret == -1)
+    {
+        int saved = errno;
+        unlink(name);
+        errno = saved;
+    }
+    free(linked);
+
+    char* dir = ret == 0 ? archive_dir(archive) : NULL;
+    int dir_fd = dir ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (dir_fd != -1)
+    {
+        stats_count(STATS_SYNC_CALLS, 1);
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    free(dir);
+    return ret;
+}
+
+int rewrite_archive(const char* archive, int arch_fd, fi_table_t* header)
+{
+    char* temp_name;
+    uint64_t t = stats_now();
+    int new_fd = temp_open(archive, &temp_name);
+    if (new_fd == -1)
+        return ARCHIVE_EIO;
+    struct stat st;
+    if (fstat(arch_fd, &st) == 0)
+        fchmod(new_fd, st.st_mode & 07777);
+
+    // Место под суперблок; он будет записан последним
+    lseek(new_fd, sizeof(arch_super_t), SEEK_SET);
+
+    // Удаленные файлы в новый архив не попадают
+    if (fi_table_purge(header))
+    {
+        close(new_fd);
+        if (temp_name)
+            unlink(temp_name);
+        free(temp_name);
+        return ARCHIVE_ENOMEM;
+    }
+
+    // Чанки переносятся только те, на которые ссылаются оставшиеся файлы.
+    // remap[i] - новый номер старого чанка i (+1, 0 - еще не перенесен)
+    chunk_table_t old_chunks = header->chunks;
+    memset(&header->chunks, 0, sizeof(chunk_table_t));
+    size_t* remap = calloc(old_chunks.count + 1, sizeof(size_t));
+    int ret = remap ? 0 : ARCHIVE_ENOMEM;
+
+    uint64_t off = sizeof(arch_super_t);
+    for (size_t i = 0; ret == 0 && i < header->count; ++i)
+    {
+        file_info_t* fi = &header->items[i];
+        if (!(fi->flags & FI_DEDUP))
+        {
+            if (copy_file(arch_fd, new_fd, fi->stored_size, fi->_offset)
+                != fi->stored_size)
+            {
+                ret = ARCHIVE_EIO;
+            }
+            fi->_offset = off;
+            off += fi->stored_size;
+            continue;
+        }
+
+        uint32_t* recipe = malloc(fi->stored_size + 1);
+        if (!recipe)
+        {
+            ret = ARCHIVE_ENOMEM;
+            break;
+        }
+        size_t n = fi->stored_size / sizeof(uint32_t);
+        ssize_t r = pread_full(arch_fd, recipe, fi->stored_size, fi->_offset);
+        if (r == -1)
+            ret = ARCHIVE_EIO;
+        else if (r != (ssize_t)fi->stored_size)
+            ret = ARCHIVE_ECORRUPT;
+        le32_array(recipe, n);
+        for (size_t k = 0; ret == 0 && k < n; ++k)
+        {
+            // Как и при извлечении, чанк вне таблицы - повреждение: иначе
+            // номер попал бы в новую таблицу как есть и указал на чужой чанк
+            if (recipe[k] >= old_chunks.count)
+            {
+                ret = ARCHIVE_ECORRUPT;
+                break;
+            }
+            if (!remap[recipe[k]])
+            {
+                chunk_info_t ci = old_chunks.items[recipe[k]];
+                if (copy_file(arch_fd, new_fd, ci.stored_size, ci._offset)
+                    != ci.stored_size)
+                {
+                    ret = ARCHIVE_EIO;
+                    break;
+                }
+                ci._offset = off;
+                off += ci.stored_size;
+                ssize_t idx = chunk_table_push(&header->chunks, &ci);
+                if (idx < 0)
+                {
+                    ret = idx;
+                    break;
+                }
+                remap[recipe[k]] = idx + 1;
+            }
+            recipe[k] = remap[recipe[k]] - 1;
+        }
+        le32_array(recipe, n);
+        if (ret == 0 && pwrite_full(new_fd, recipe, fi->stored_size, off) == -1)
+            ret = ARCHIVE_EIO;
+        lseek(new_fd, off + fi->stored_size, SEEK_SET);
+        fi->_offset = off;
+        off += fi->stored_size;
+        free(recipe);
+    }
+    free(remap);
+    chunk_table_free(&old_chunks);
+    stats_phase(STATS_COPY, t);
+
+    arch_super_t sb;
+    t = stats_now();
+    if (ret == 0)
+        ret = write_directory(header, new_fd, off, &sb);
+    stats_phase(STATS_DIRECTORY, t);
+    t = stats_now();
+    if (ret == 0)
+        ret = commit_super(new_fd, &sb);
+    stats_phase(STATS_SYNC, t);
+
+    // rename атомарно подменяет архив: при падении останется старый архив
+    t = stats_now();
+    if (ret == 0 && temp_commit(new_fd, temp_name, archive) == -1)
+        ret = ARCHIVE_EIO;
+    else if (ret != 0 && temp_name)
+    {
+        int saved = errno;
+        unlink(temp_name);
+        errno = saved;
+    }
+    stats_phase(STATS_RENAME, t);
+    close(new_fd);
+    free(temp_name);
+    return ret;
+}
+
+void fi_table_init(fi_table_t* t)
+{
+    memset(t, 0, sizeof(fi_table_t));
+}
+
+void fi_table_free(fi_table_t* t)
+{
+    if (!fi_table_mapped(t, t->items))
+        free(t->items);
+    if (!fi_table_mapped(t, t->names))
+        free(t->names);
+    free(t->src);
+    free(t->buckets);
+    free(t->chain);
+    chunk_table_free(&t->chunks);
+    if (t->dir_map)
+        munmap(t->dir_map, t->dir_map_size);
+    fi_table_init(t);
+}
+
+int fi_table_reserve(fi_table_t* t, size_t cap)
+{
+    if (cap <= t->cap)
+        return 0;
+
+    size_t new_cap = t->cap ? t->cap : 16;
+    while (new_cap < cap)
+        new_cap *= 2;
+
+    // Массивы растут по отдельности, поэтому при нехватке памяти таблица
+    // остается целой, просто часть массивов оказывается больше cap
+    file_info_t* items = fi_table_realloc(t, t->items,
+        t->count * sizeof(file_info_t), new_cap * sizeof(file_info_t));
+    if (!items)
+        return ARCHIVE_ENOMEM;
+    t->items = items;
+    const char** src = realloc(t->src, new_cap * sizeof(const char*));
+    if (!src)
+        return ARCHIVE_ENOMEM;
+    t->src = src;
+    size_t* chain = realloc(t->chain, new_cap * sizeof(size_t));
+    if (!chain)
+        return ARCHIVE_ENOMEM;
+    t->chain = chain;
+    t->cap = new_cap;
+    return 0;
+}
+
+static int fi_table_reserve_names(fi_table_t* t, size_t extra)
+{
+    if (t->names_size + extra <= t->names_cap)
+        return 0;
+
+    size_t new_cap = t->names_cap ? t->names_cap : 1024;
+    while (new_cap < t->names_size + extra)
+        new_cap *= 2;
+    char* names = fi_table_realloc(t, t->names, t->names_size, new_cap);
+    if (!names)
+        return ARCHIVE_ENOMEM;
+    t->names = names;
+    t->names_cap = new_cap;
+    return 0;
+}
+
+const char* fi_table_name(const fi_table_t* t, const file_info_t* fi)
+{
+    return t->names + fi->name_offset;
+}
+
+uint64_t fi_hash(const char* name)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (; *name; ++name)
+    {
+        h ^= (uint8_t)*name;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/**
+ * Вставляет запись i в цепочку соответствующей корзины
+ */
+static void fi_table_link(fi_table_t* t, size_t i)
+{
+    // Удаленные записи не находятся по имени
+    if (t->items[i].flags & FI_DELETED)
+        return;
+    size_t b = fi_hash(fi_table_name(t, &t->items[i])) & (t->nbuckets - 1);
+    t->chain[i] = t->buckets[b];
+    t->buckets[b] = i + 1;
+}
+
+int fi_table_reindex(fi_table_t* t)
+{
+    // Коэффициент заполнения не больше 1/2
+    size_t nbuckets = 16;
+    while (nbuckets < t->count * 2)
+        nbuckets *= 2;
+
+    size_t* buckets = calloc(nbuckets, sizeof(size_t));
+    if (!buckets)
+        return ARCHIVE_ENOMEM;
+    free(t->buckets);
+    t->buckets = buckets;
+    t->nbuckets = nbuckets;
+
+    // Идем с конца, чтобы в цепочке записи шли в порядке каталога
+    for (size_t i = t->count; i-- > 0;)
+        fi_table_link(t, i);
+    return 0;
+}
+
+ssize_t fi_table_push(
+    fi_table_t* t, const file_info_t* fi, const char* name, const char* src)
+{
+    size_t len = strlen(name);
+    if (fi_table_reserve(t, t->count + 1) || fi_table_reserve_names(t, len + 1))
+        return ARCHIVE_ENOMEM;
+    size_t i = t->count++;
+    memcpy(&t->items[i], fi, sizeof(file_info_t));
+    t->items[i].name_offset = t->names_size;
+    t->items[i].name_length = len;
+    memcpy(t->names + t->names_size, name, len + 1);
+    t->names_size += len + 1;
+    t->src[i] = src;
+
+    if (t->count * 2 <= t->nbuckets)
+    {
+        fi_table_link(t, i);
+    }
+    else if (fi_table_reindex(t))
+    {
+        t->count--;
+        t->names_size -= len + 1;
+        return ARCHIVE_ENOMEM;
+    }
+    return i;
+}
+
+/**
+ * Ищет в цепочке, начиная с записи link (+1), запись с именем name
+ */
+static ssize_t fi_table_scan(const fi_table_t* t, size_t link, const char* name)
+{
+    for (; link; link = t->chain[link - 1])
+    {
+        if (strcmp(fi_table_name(t, &t->items[link - 1]), name) == 0)
+            return link - 1;
+    }
+    return -1;
+}
+
+ssize_t fi_table_find(const fi_table_t* t, const char* name)
+{
+    if (t->nbuckets == 0)
+        return -1;
+    return fi_table_scan(
+        t, t->buckets[fi_hash(name) & (t->nbuckets - 1)], name);
+}
+
+ssize_t fi_table_find_next(const fi_table_t* t, size_t from)
+{
+    return fi_table_scan(
+        t, t->chain[from], fi_table_name(t, &t->items[from]));
+}
+
+ssize_t fi_table_find_last(const fi_table_t* t, const char* name)
+{
+    // Записи, добавленные после reindex, стоят в начале цепочки, так что
+    // порядок цепочки не годится - берется наибольший номер
+    ssize_t last = -1;
+    for (ssize_t i = fi_table_find(t, name); i != -1;
+         i = fi_table_find_next(t, i))
+    {
+        if (i > last)
+            last = i;
+    }
+    return last;
+}
+
+ssize_t remove_files_from_header(
+    fi_table_t* header, int fnums, char** fnames, char flag)
+{
+    char* listed = calloc(header->count + 1, 1);
+    if (!listed)
+        return ARCHIVE_ENOMEM;
+    for (int j = 0; j < fnums; ++j)
+    {
+        for (ssize_t i = fi_table_find(header, fnames[j]); i != -1;
+             i = fi_table_find_next(header, i))
+        {
+            listed[i] = 1;
+        }
+    }
+
+    size_t marked = 0;
+    for (size_t i = 0; i < header->count; ++i)
+    {
+        file_info_t* fi = &header->items[i];
+        if ((fi->flags & FI_DELETED) || (flag ? !listed[i] : listed[i]))
+            continue;
+
+        fi->flags |= FI_DELETED;
+        marked++;
+    }
+    free(listed);
+    if (marked && fi_table_reindex(header))
+        return ARCHIVE_ENOMEM;
+    return marked;
+}
+
+int fi_table_purge(fi_table_t* t)
+{
+    size_t deleted = 0;
+    for (size_t i = 0; i < t->count; ++i)
+        deleted += (t->items[i].flags & FI_DELETED) != 0;
+    if (deleted == 0)
+        return 0;
+
+    // Имена выживших записей переезжают в новую таблицу строк
+    char* names = malloc(t->names_size + 1);
+    if (!names)
+        return ARCHIVE_ENOMEM;
+    size_t kept = 0, names_size = 0;
+    for (size_t i = 0; i < t->count; ++i)
+    {
+        file_info_t fi = t->items[i];
+        if (fi.flags & FI_DELETED)
+            continue;
+
+        memcpy(names + names_size, t->names + fi.name_offset,
+            fi.name_length + 1);
+        fi.name_offset = names_size;
+        names_size += fi.name_length + 1;
+        t->items[kept] = fi;
+        t->src[kept++] = t->src[i];
+    }
+    if (!fi_table_mapped(t, t->names))
+        free(t->names);
+    t->names = names;
+    t->names_cap = t->names_size + 1;
+    t->names_size = names_size;
+    t->count = kept;
+    return fi_table_reindex(t);
+}
+
+/**
+ * Есть ли после записи i живая запись с тем же именем
+ */
+static char fi_table_superseded(const fi_table_t* t, size_t i)
+{
+    return fi_table_find_last(t, fi_table_name(t, &t->items[i])) > (ssize_t)i;
+}
+
+ssize_t select_members(const fi_table_t* header, int fnums, char** fnames,
+    char last, size_t** out)
+{
+    size_t* sel = malloc((header->count + 1) * sizeof(size_t));
+    char* listed = calloc(header->count + 1, 1);
+    if (!sel || !listed)
+    {
+        free(sel);
+        free(listed);
+        return ARCHIVE_ENOMEM;
+    }
+
+    for (int j = 0; j < fnums; ++j)
+    {
+        for (ssize_t i = fi_table_find(header, fnames[j]); i != -1;
+             i = fi_table_find_next(header, i))
+        {
+            listed[i] = 1;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < header->count; ++i)
+    {
+        if (!((fnums == 0 && !(header->items[i].flags & FI_DELETED))
+                || listed[i]))
+            continue;
+        if (!last || !fi_table_superseded(header, i))
+            sel[n++] = i;
+    }
+    free(listed);
+    *out = sel;
+    return n;
+}
+
+static int update_header_for_input(fi_table_t* header, int fnums,
+    char** fnames, const struct archive_opts* opts, const char** dirs,
+    size_t* ndirs, size_t* touched)
+{
+    int inserted_files = 0;
+    size_t old = header->count;
+    *ndirs = 0;
+    struct stat stat_file;
+    for (int i = 0; i < fnums; ++i)
+    {
+        stats_count(STATS_STAT_CALLS, 1);
+        if (stat(fnames[i], &stat_file) == -1)
+        {
+            report(opts, fnames[i], ARCHIVE_EIO);
+            continue;
+        }
+
+        if (S_ISDIR(stat_file.st_mode))
+        {
+            dirs[(*ndirs)++] = fnames[i];
+            continue;
+        }
+
+        if (!S_ISREG(stat_file.st_mode))
+        {
+            report(opts, fnames[i], ARCHIVE_ENOTREG);
+            continue;
+        }
+
+        file_info_t fi;
+        memset(&fi, 0, sizeof(file_info_t));
+        char* start_plain_name = strrchr(fnames[i], '/');
+        const char* plain_name
+            = start_plain_name == NULL ? fnames[i] : start_plain_name + 1;
+
+        fi.filesize = stat_file.st_size;
+        fi.mask = stat_file.st_mode & 0777;
+        fi.mtime = stat_mtime(&stat_file);
+        fi._offset = 0; // Будет добавлено позднее в коде
+        fi.stored_size = fi.filesize;
+        fi.flags = 0;
+
+        if (opts->update
+            && !member_changed(
+                header, old, plain_name, fnames[i], &fi, opts, touched))
+            continue;
+        if (fi_table_push(header, &fi, plain_name, fnames[i]) < 0)
+            return ARCHIVE_ENOMEM;
+        inserted_files++;
+    }
+
+    return inserted_files;
+}
+
+static int insert_small_files(fi_table_t* header, size_t from, size_t n,
+    struct uring* ring, struct small_file* f, uint8_t* buf, int arch_fd,
+    uint64_t* off, const struct archive_opts* opts)
+{
+    for (size_t k = 0; k < n; ++k)
+    {
+        f[k].path = header->src[from + k];
+        f[k].buf = buf + k * URING_SMALL_FILE;
+        f[k].size = header->items[from + k].filesize;
+    }
+    if (uring_load_files(ring, f, n) == -1)
+        return 1;
+
+    // Прочитанные данные сдвигаются вплотную друг к другу
+    uint64_t pos = 0;
+    for (size_t k = 0; k < n; ++k)
+    {
+        file_info_t* fi = &header->items[from + k];
+        if (f[k].err)
+        {
+            errno = f[k].err;
+            report(opts, f[k].path, ARCHIVE_EIO);
+            continue;
+        }
+        memmove(buf + pos, f[k].buf, f[k].size);
+        fi->_offset = *off + pos;
+        fi->filesize = fi->stored_size = f[k].size;
+        fi->flags |= FI_CHECKSUM;
+        fi->checksum = crc32c(0, buf + pos, f[k].size);
+        pos += f[k].size;
+    }
+    if (pwrite_full(arch_fd, buf, pos, *off) == -1)
+        return ARCHIVE_EIO;
+    *off += pos;
+    return 0;
+}
+
+static int insert_files_routine(fi_table_t* header, size_t from, int arch_fd,
+    uint64_t* off, const struct archive_opts* opts)
+{
+    // Мелкие файлы без сжатия и дедупликации идут пачками через io_uring,
+    // если он есть
+    struct uring ring = { .fd = -1 };
+    struct small_file* small = NULL;
+    uint8_t* small_buf = NULL;
+    if (!opts->dedup && !opts->compress
+        && uring_init(&ring, URING_ENTRIES) == 0)
+    {
+        small = malloc(URING_BATCH * sizeof(struct small_file));
+        small_buf = malloc(URING_BATCH * URING_SMALL_FILE);
+    }
+    // Остальные несжатые файлы идут через конвейер; он запускается при
+    // первом таком файле
+    struct pipeline* pipe = NULL;
+    char use_pipe = !opts->dedup && !opts->compress;
+
+    // Имена новых записей лежат подряд в конце таблицы строк
+    size_t names_from = from < header->count ? header->items[from].name_offset
+                                             : header->names_size;
+    size_t kept = from;
+    int ret = 0;
+    for (size_t i = from; ret == 0 && i < header->count; ++i)
+    {
+        size_t n = 0;
+        while (small && small_buf && n < URING_BATCH && i + n < header->count
+            && header->items[i + n].filesize <= URING_SMALL_FILE)
+            n++;
+        if (n > 0)
+        {
+            ret = insert_small_files(header, i, n, &ring, small, small_buf,
+                arch_fd, off, opts);
+            if (ret <= 0)
+            {
+                for (size_t k = 0; k < n; ++k)
+                {
+                    if (small[k].err)
+                        continue;
+                    header->items[kept] = header->items[i + k];
+                    header->src[kept++] = header->src[i + k];
+                }
+                i += n - 1;
+                continue;
+            }
+            // Кольцо сломалось: дальше обычным путем
+            ret = 0;
+            free(small);
+            small = NULL;
+        }
+
+        n = 0;
+        while (use_pipe && i + n < header->count
+            && !(small && small_buf
+                && header->items[i + n].filesize <= URING_SMALL_FILE))
+            n++;
+        if (n > 0 && !pipe)
+        {
+            size_t left = header->count - i;
+            size_t readers = opts->jobs > PIPE_MIN_READERS ? opts->jobs
+                                                           : PIPE_MIN_READERS;
+            if (pipeline_start(&pipe, left < (size_t)readers ? left : readers))
+                use_pipe = 0; // без потоков - обычным путем
+        }
+        char* failed = n > 0 && pipe ? calloc(n, 1) : NULL;
+        if (failed)
+        {
+            ret = pipeline_insert(
+                pipe, header, i, n, arch_fd, off, opts, failed);
+            for (size_t k = 0; k < n; ++k)
+            {
+                if (failed[k])
+                    continue;
+                header->items[kept] = header->items[i + k];
+                header->src[kept++] = header->src[i + k];
+            }
+            free(failed);
+            i += n - 1;
+            continue;
+        }
+
+        file_info_t* fi = &header->items[i];
+        uint64_t started = stats_now();
+        stats_count(STATS_OPEN_CALLS, 1);
+        int app_fd = open(header->src[i], O_RDONLY);
+        if (app_fd == -1)
+        {
+            report(opts, header->src[i], ARCHIVE_EIO);
+            continue;
+        }
+
+        fi->_offset = *off;
+        fi->flags |= FI_CHECKSUM;
+        uint32_t crc = 0;
+        if (opts->dedup)
+        {
+            uint64_t size = fi->filesize, recipe_off, recipe_size;
+            ret = dedup_store_member(header, app_fd, &size, arch_fd, off,
+                opts->compress, &recipe_off, &recipe_size, &crc);
+            fi->filesize = size;
+            fi->_offset = recipe_off;
+            fi->stored_size = recipe_size;
+            fi->flags |= FI_DEDUP;
+            fi->checksum = crc;
+            close(app_fd);
+            stats_member(fi_table_name(header, fi), fi->filesize, started);
+
+            header->items[kept] = *fi;
+            header->src[kept++] = header->src[i];
+            continue;
+        }
+
+        // Дыры разреженного файла не хранятся. При сжатии нули и так
+        // ужмутся, так что разреженность ищется только для несжатых файлов
+        struct sparse_extent* ext;
+        ssize_t next = opts->compress || fi->filesize == 0
+            ? -1
+            : sparse_scan(app_fd, fi->filesize, &ext);
+        if (next >= 0)
+        {
+            uint64_t stored;
+            ret = sparse_store_member(app_fd, ext, next, fi->filesize, arch_fd,
+                *off, &stored, &crc);
+            free(ext);
+            fi->stored_size = stored;
+            fi->flags |= FI_SPARSE;
+        }
+
+        if (opts->compress && fi->filesize > 0)
+        {
+            uint64_t stored;
+            ret = lz_store_member(app_fd, fi->filesize, arch_fd, *off,
+                opts->jobs, &stored, &crc);
+            fi->stored_size = stored;
+            fi->flags |= FI_COMPRESSED;
+        }
+
+        // Если сжатие не дало выигрыша (мелкие или уже сжатые файлы), файл
+        // хранится как есть
+        if (ret == 0 && !(fi->flags & FI_SPARSE)
+            && (!(fi->flags & FI_COMPRESSED) || fi->stored_size >= fi->filesize))
+        {
+            fi->flags &= ~FI_COMPRESSED;
+            lseek(arch_fd, *off, SEEK_SET);
+            // Если файл успел уменьшиться, в архиве окажется то, что
+            // действительно было прочитано. Сумма считается в том же
+            // проходе, поэтому данные идут через буфер, а не через ядро
+            fi->stored_size = fi->filesize
+                = copy_file_crc(app_fd, arch_fd, fi->filesize, 0, &crc);
+        }
+        fi->checksum = crc;
+        close(app_fd);
+        *off += fi->stored_size;
+        stats_member(fi_table_name(header, fi), fi->filesize, started);
+
+        header->items[kept] = *fi;
+        header->src[kept++] = header->src[i];
+    }
+    pipeline_free(pipe);
+    free(small_buf);
+    free(small);
+    uring_free(&ring);
+
+    if (ret == 0 && kept != header->count)
+    {
+        // Имена выброшенных записей иначе попали бы в каталог. Записи идут в
+        // порядке своих имен, поэтому имена сдвигаются только назад
+        size_t names_size = names_from;
+        for (size_t i = from; i < kept; ++i)
+        {
+            file_info_t* fi = &header->items[i];
+            memmove(header->names + names_size,
+                header->names + fi->name_offset, fi->name_length + 1);
+            fi->name_offset = names_size;
+            names_size += fi->name_length + 1;
+        }
+        header->names_size = names_size;
+        header->count = kept;
+        ret = fi_table_reindex(header);
+    }
+    return ret;
+}
+
+static ssize_t insert_tree(fi_table_t* header, const char* dir, int arch_fd,
+    uint64_t* off, const struct archive_opts* opts, size_t old,
+    size_t* touched)
+{
+    struct walker* w;
+    int ret = walk_start(&w, dir, opts);
+    if (ret != 0)
+    {
+        report(opts, dir, ret);
+        return ret == ARCHIVE_ENOMEM ? ret : 0;
+    }
+
+    // Ожидание обходчика и разбор пачки - фаза stat, вставка - copy
+    ssize_t inserted = 0;
+    struct walk_batch* b;
+    uint64_t t = stats_now();
+    while (ret == 0 && (b = walk_next(w)))
+    {
+        size_t from = header->count;
+        ret = fi_table_reserve(header, from + b->count);
+        for (size_t i = 0; ret == 0 && i < b->count; ++i)
+        {
+            const struct walk_entry* e = &b->items[i];
+            file_info_t fi;
+            memset(&fi, 0, sizeof(file_info_t));
+            fi.filesize = e->size;
+            fi.mask = e->mask;
+            fi.mtime = e->mtime;
+            fi.stored_size = fi.filesize;
+            if (opts->update
+                && !member_changed(header, old, b->arena + e->name,
+                    b->arena + e->path, &fi, opts, touched))
+                continue;
+            if (fi_table_push(header, &fi, b->arena + e->name,
+                    b->arena + e->path) < 0)
+                ret = ARCHIVE_ENOMEM;
+        }
+        stats_phase(STATS_STAT, t);
+        t = stats_now();
+        if (ret == 0)
+            ret = insert_files_routine(header, from, arch_fd, off, opts);
+        stats_phase(STATS_COPY, t);
+        t = stats_now();
+
+        // Пути лежат в пачке и освобождаются вместе с ней
+        for (size_t i = from; i < header->count; ++i)
+            header->src[i] = NULL;
+        inserted += header->count - from;
+        walk_release(b);
+    }
+    stats_phase(STATS_STAT, t);
+    walk_free(w);
+    return ret ? ret : inserted;
+}
+
+/**
+ * Освобождает карты кусков. Вызывается, когда положение данных в архиве
+ * могло измениться
+ */
+static void archive_drop_maps(archive_t* a)
+{
+    if (!a->maps)
+        return;
+    for (size_t i = 0; i < a->header.count; ++i)
+        free(a->maps[i]);
+    free(a->maps);
+    a->maps = NULL;
+}
+
+/**
+ * Открывает файл архива, блокирует его и читает каталог. Читатели берут
+ * общую блокировку flock, писатели - исключительную, и держат ее до
+ * archive_close
+ */
+static int archive_load(archive_t* a)
+{
+    int oflags = a->flags & ARCHIVE_RDWR ? O_RDWR : O_RDONLY;
+    if (a->flags & ARCHIVE_CREATE)
+        oflags |= O_CREAT;
+    int lock = a->flags & ARCHIVE_RDWR ? LOCK_EX : LOCK_SH;
+
+    uint64_t t = stats_now();
+    for (;;)
+    {
+        stats_count(STATS_OPEN_CALLS, 1);
+        a->fd = open(a->path, oflags | O_CLOEXEC, 0666);
+        if (a->fd == -1)
+            return ARCHIVE_EIO;
+        int r;
+        while ((r = flock(a->fd, lock)) == -1 && errno == EINTR)
+            ;
+        // Без поддержки блокировок (ENOLCK) архив открывается как раньше
+        if (r == -1 && errno != ENOLCK)
+        {
+            int saved = errno;
+            close(a->fd);
+            a->fd = -1;
+            errno = saved;
+            return ARCHIVE_EIO;
+        }
+
+        // Пока мы ждали, писатель мог переписать архив и подменить файл:
+        // тогда блокировка взята на старом файле
+        struct stat fd_st, path_st;
+        if (fstat(a->fd, &fd_st) == -1 || stat(a->path, &path_st) == -1
+            || (fd_st.st_ino == path_st.st_ino
+                && fd_st.st_dev == path_st.st_dev))
+            break;
+        close(a->fd);
+    }
+    int ret = read_header(&a->header, a->fd);
+    stats_phase(STATS_HEADER, t);
+    return ret;
+}
+
+/**
+ * Закрывает файл архива и забывает каталог
+ */
+static void archive_unload(archive_t* a)
+{
+    archive_drop_maps(a);
+    fi_table_free(&a->header);
+    if (a->fd != -1)
+        close(a->fd);
+    a->fd = -1;
+}
+
+/**
+ * Перечитывает архив с диска: после переписывания архива или после неудачной
+ * операции, которая могла испортить каталог в памяти
+ */
+static int archive_reload(archive_t* a)
+{
+    int saved = errno;
+    archive_unload(a);
+    int ret = archive_load(a);
+    if (ret == 0)
+        errno = saved;
+    return ret;
+}
+
+void archive_opts_init(struct archive_opts* opts)
+{
+    memset(opts, 0, sizeof(struct archive_opts));
+    opts->jobs = 1;
+}
+
+int archive_open(const char* path, int flags, archive_t** out)
+{
+    *out = NULL;
+    archive_t* a = calloc(1, sizeof(archive_t));
+    if (!a)
+        return ARCHIVE_ENOMEM;
+
+    a->fd = -1;
+    a->flags = flags;
+    fi_table_init(&a->header);
+    pthread_mutex_init(&a->maps_lock, NULL);
+    a->path = strdup(path);
+
+    int ret = a->path ? archive_load(a) : ARCHIVE_ENOMEM;
+    if (ret != 0)
+    {
+        int saved = errno;
+        archive_close(a);
+        errno = saved;
+        return ret;
+    }
+    *out = a;
+    return 0;
+}
+
+void archive_close(archive_t* a)
+{
+    if (!a)
+        return;
+    archive_unload(a);
+    pthread_mutex_destroy(&a->maps_lock);
+    free(a->path);
+    free(a);
+}
+
+const char* archive_strerror(int err)
+{
+    switch (err)
+    {
+    case ARCHIVE_OK:
+        return "Успех";
+    case ARCHIVE_EIO:
+        return "Ошибка ввода-вывода";
+    case ARCHIVE_ENOMEM:
+        return "Не хватает памяти";
+    case ARCHIVE_EFORMAT:
+        return "Каталог архива поврежден";
+    case ARCHIVE_EVERSION:
+        return "Архив записан неподдерживаемой версией формата";
+    case ARCHIVE_ENOENT:
+        return "Такого файла в архиве нет";
+    case ARCHIVE_ECORRUPT:
+        return "Данные файла в архиве повреждены";
+    case ARCHIVE_EINVAL:
+        return "Неверные аргументы";
+    case ARCHIVE_ENOFILES:
+        return "Не добавлен ни один указанный файл";
+    case ARCHIVE_ENOTREG:
+        return "Файл не регулярный";
+    case ARCHIVE_ESTREAM:
+        return "Это потоковый архив: читайте его через stdin "
+               "(archiver - -e < архив)";
+    }
+    return "Неизвестная ошибка";
+}
+
+/**
+ * Участок архива [off, off + len)
+ */
+struct extent
+{
+    uint64_t off;
+    uint64_t len;
+};
+
+static int extent_cmp(const void* a, const void* b)
+{
+    const struct extent* x = a;
+    const struct extent* y = b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/**
+ * Отмечает чанки, на которые ссылаются рецепты неудаленных файлов
+ * \param out Куда записать массив отметок по номерам чанков (free)
+ * \return 0 или код ошибки
+ */
+static int referenced_chunks(const fi_table_t* header, int arch_fd, char** out)
+{
+    const chunk_table_t* ct = &header->chunks;
+    char* used = calloc(ct->count + 1, 1);
+    if (!used)
+        return ARCHIVE_ENOMEM;
+
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < header->count; ++i)
+    {
+        const file_info_t* fi = &header->items[i];
+        if ((fi->flags & FI_DELETED) || !(fi->flags & FI_DEDUP))
+            continue;
+
+        uint32_t* recipe = malloc(fi->stored_size + 1);
+        if (!recipe)
+        {
+            ret = ARCHIVE_ENOMEM;
+            break;
+        }
+        if (pread_full(arch_fd, recipe, fi->stored_size, fi->_offset)
+            != (ssize_t)fi->stored_size)
+        {
+            ret = ARCHIVE_EIO;
+        }
+        le32_array(recipe, fi->stored_size / sizeof(uint32_t));
+        for (size_t k = 0; ret == 0 && k < fi->stored_size / sizeof(uint32_t);
+             ++k)
+        {
+            if (recipe[k] < ct->count)
+                used[recipe[k]] = 1;
+        }
+        free(recipe);
+    }
+    if (ret != 0)
+    {
+        free(used);
+        return ret;
+    }
+    *out = used;
+    return 0;
+}
+
+/**
+ * Собирает живые участки архива: суперблок, данные неудаленных файлов, чанки
+ * и актуальный каталог. Участки сортируются и сливаются, так что на выходе
+ * они не пересекаются
+ * \param used Отметки чанков (referenced_chunks) или NULL - тогда живыми
+ * считаются все чанки таблицы, и работа идет за O(каталог)
+ * \param out Куда записать массив участков (освобождается free)
+ * \return Количество участков или ARCHIVE_ENOMEM
+ */
+static ssize_t live_extents(const fi_table_t* header, const arch_super_t* sb,
+    const char* used, struct extent** out)
+{
+    const chunk_table_t* ct = &header->chunks;
+    struct extent* e = malloc((header->count + ct->count + 2) * sizeof(*e));
+    if (!e)
+        return ARCHIVE_ENOMEM;
+
+    size_t n = 0;
+    e[n++] = (struct extent) { 0, sizeof(arch_super_t) };
+    e[n++] = (struct extent) { sb->dir_offset,
+        super_data_end(sb) - sb->dir_offset };
+    for (size_t i = 0; i < header->count; ++i)
+    {
+        const file_info_t* fi = &header->items[i];
+        if (!(fi->flags & FI_DELETED) && fi->stored_size)
+            e[n++] = (struct extent) { fi->_offset, fi->stored_size };
+    }
+    for (size_t i = 0; i < ct->count; ++i)
+    {
+        if (ct->items[i].stored_size && (!used || used[i]))
+        {
+            e[n++] = (struct extent) { ct->items[i]._offset,
+                ct->items[i].stored_size };
+        }
+    }
+    qsort(e, n, sizeof(*e), extent_cmp);
+
+    size_t m = 0;
+    for (size_t i = 1; i < n; ++i)
+    {
+        uint64_t end = e[m].off + e[m].len;
+        if (e[i].off <= end)
+        {
+            if (e[i].off + e[i].len > end)
+                e[m].len = e[i].off + e[i].len - e[m].off;
+        }
+        else
+        {
+            e[++m] = e[i];
+        }
+    }
+    *out = e;
+    return m + 1;
+}
+
+/**
+ * Считает байты с данными (не дыры) в участке [from, to) файла
+ */
+static uint64_t data_bytes(int fd, uint64_t from, uint64_t to)
+{
+    uint64_t n = 0;
+    while (from < to)
+    {
+        off_t data = lseek(fd, from, SEEK_DATA);
+        if (data == -1 || (uint64_t)data >= to)
+            break;
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        uint64_t end = hole == -1 || (uint64_t)hole > to ? to : (uint64_t)hole;
+        n += end - data;
+        from = end;
+    }
+    return n;
+}
+
+/**
+ * Считает, сколько места на диске занимает архив и сколько из него мертвое.
+ * Место на диске - это st_blocks, а не st_size: участки, в которых уже
+ * пробиты дыры, ничего не занимают. Мертвые данные считаются в байтах: это
+ * то, что лежит между живыми участками и еще не стало дырой, так что и
+ * удаленный файл меньше блока виден. Выравнивание перед каталогом мертвым не
+ * считается. Чанки без ссылок считаются мертвыми, для этого читаются рецепты
+ * \return 0 или код ошибки
+ */
+static int space_usage(const archive_t* a, uint64_t* used, uint64_t* dead)
+{
+    struct stat st;
+    if (fstat(a->fd, &st) == -1)
+        return ARCHIVE_EIO;
+    *used = (uint64_t)st.st_blocks * 512;
+    if (*used > (uint64_t)st.st_size)
+        *used = st.st_size;
+    *dead = 0;
+
+    arch_super_t sb;
+    int sup = read_super(a->fd, &sb);
+    if (sup <= 0)
+        return sup; // старый формат мертвых данных не содержит
+
+    char* refs;
+    int ret = referenced_chunks(&a->header, a->fd, &refs);
+    if (ret != 0)
+        return ret;
+    struct extent* e;
+    ssize_t n = live_extents(&a->header, &sb, refs, &e);
+    free(refs);
+    if (n < 0)
+        return n;
+
+    // SEEK_DATA двигает позицию файла, а дозапись может от нее зависеть
+    off_t pos = lseek(a->fd, 0, SEEK_CUR);
+    for (ssize_t i = 0; i < n; ++i)
+    {
+        uint64_t from = e[i].off + e[i].len;
+        uint64_t to = i + 1 < n ? e[i + 1].off : (uint64_t)st.st_size;
+        if (to == sb.dir_offset && to - from < ARCH_DIR_ALIGN)
+            continue;
+        if (to > from)
+            *dead += data_bytes(a->fd, from, to);
+    }
+    lseek(a->fd, pos, SEEK_SET);
+    free(e);
+    return 0;
+}
+
+void archive_info(archive_t* a, struct archive_info* info)
+{
+    memset(info, 0, sizeof(struct archive_info));
+    for (size_t i = 0; i < a->header.count; ++i)
+    {
+        if (a->header.items[i].flags & FI_DELETED)
+            info->deleted++;
+        else
+            info->members++;
+    }
+    info->chunks = a->header.chunks.count;
+    for (size_t i = 0; i < a->header.chunks.count; ++i)
+        info->chunk_bytes += a->header.chunks.items[i].stored_size;
+    if (space_usage(a, &info->used_bytes, &info->dead_bytes))
+        info->used_bytes = info->dead_bytes = 0;
+}
+
+/**
+ * Заполняет описание файла по записи каталога i
+ */
+static void fill_member(const archive_t* a, size_t i, archive_member_t* m)
+{
+    const file_info_t* fi = &a->header.items[i];
+    m->name = fi_table_name(&a->header, fi);
+    m->size = fi->filesize;
+    m->stored_size = fi->stored_size;
+    m->mode = fi->mask;
+    m->flags = fi->flags;
+    m->checksum = fi->checksum;
+    m->index = i;
+}
+
+int archive_lookup(archive_t* a, const char* name, archive_member_t* member)
+{
+    // Как и при извлечении, после повторной вставки важна новая копия
+    ssize_t i = fi_table_find_last(&a->header, name);
+    if (i == -1)
+        return ARCHIVE_ENOENT;
+    fill_member(a, i, member);
+    return 0;
+}
+
+void archive_iter_init(archive_t* a, archive_iter_t* it)
+{
+    it->archive = a;
+    it->next = 0;
+}
+
+int archive_iter_next(archive_iter_t* it, archive_member_t* member)
+{
+    const fi_table_t* h = &it->archive->header;
+    while (it->next < h->count && (h->items[it->next].flags & FI_DELETED))
+        it->next++;
+    if (it->next >= h->count)
+        return 0;
+    fill_member(it->archive, it->next++, member);
+    return 1;
+}
+
+/**
+ * Карта кусков сжатого или дедуплицированного файла i. Строится при первом
+ * обращении и живет до изменения архива
+ * \return Карта или NULL, если данные файла повреждены
+ */
+static const struct piece_map* member_map(archive_t* a, size_t i)
+{
+    struct piece_map* map = NULL;
+    pthread_mutex_lock(&a->maps_lock);
+    if (!a->maps)
+        a->maps = calloc(a->header.count + 1, sizeof(struct piece_map*));
+    if (a->maps)
+    {
+        const file_info_t* fi = &a->header.items[i];
+        if (!a->maps[i])
+        {
+            if (fi->flags & FI_DEDUP)
+                a->maps[i] = dedup_build_map(&a->header, fi, a->fd);
+            else if (fi->flags & FI_SPARSE)
+                a->maps[i] = sparse_build_map(fi, a->fd);
+            else
+                a->maps[i] = lz_build_map(fi, a->fd);
+        }
+        map = a->maps[i];
+    }
+    pthread_mutex_unlock(&a->maps_lock);
+    return map;
+}
+
+ssize_t archive_pread(archive_t* a, const archive_member_t* member, void* buf,
+    size_t len, uint64_t offset)
+{
+    if (member->index >= a->header.count)
+        return ARCHIVE_EINVAL;
+
+    const file_info_t* fi = &a->header.items[member->index];
+    if (offset >= fi->filesize)
+        return 0;
+    if (len > fi->filesize - offset)
+        len = fi->filesize - offset;
+    if (len > SSIZE_MAX)
+        len = SSIZE_MAX;
+
+    if (!(fi->flags & (FI_COMPRESSED | FI_DEDUP | FI_SPARSE)))
+    {
+        ssize_t r = pread_full(a->fd, buf, len, fi->_offset + offset);
+        if (r == -1)
+            return ARCHIVE_EIO;
+        return (size_t)r == len ? r : ARCHIVE_ECORRUPT;
+    }
+
+    const struct piece_map* map = member_map(a, member->index);
+    if (!map)
+        return ARCHIVE_ECORRUPT;
+
+    // Первый кусок, в который попадает offset
+    size_t lo = 0, hi = map->count;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->items[mid].orig_off <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    uint8_t *packed = NULL, *plain = NULL;
+    size_t done = 0;
+    ssize_t ret = 0;
+    for (size_t k = lo; ret == 0 && done < len && k < map->count; ++k)
+    {
+        const struct piece* p = &map->items[k];
+        uint64_t within = offset + done - p->orig_off;
+        size_t n = p->orig_len - within < len - done ? p->orig_len - within
+                                                      : len - done;
+        if (p->hole)
+        {
+            memset((uint8_t*)buf + done, 0, n);
+            done += n;
+            continue;
+        }
+        if (p->raw)
+        {
+            ssize_t r = pread_full(
+                a->fd, (uint8_t*)buf + done, n, p->stored_off + within);
+            if (r != (ssize_t)n)
+                ret = r == -1 ? ARCHIVE_EIO : ARCHIVE_ECORRUPT;
+            done += n;
+            continue;
+        }
+
+        if (!packed)
+        {
+            packed = malloc(LZ_BLOCK_SIZE);
+            plain = malloc(LZ_BLOCK_SIZE);
+            if (!packed || !plain)
+            {
+                ret = ARCHIVE_ENOMEM;
+                break;
+            }
+        }
+
+        // Кусок распаковывается целиком, но копируется только нужная часть
+        ssize_t r = pread_full(a->fd, packed, p->stored_len, p->stored_off);
+        if (r == -1)
+            ret = ARCHIVE_EIO;
+        else if (r != (ssize_t)p->stored_len
+            || lz_decompress(packed, p->stored_len, plain, p->orig_len)
+                != (ssize_t)p->orig_len)
+            ret = ARCHIVE_ECORRUPT;
+        else
+            memcpy((uint8_t*)buf + done, plain + within, n);
+        done += n;
+    }
+
+    free(plain);
+    free(packed);
+    if (ret == 0 && done < len)
+        ret = ARCHIVE_ECORRUPT; // карта короче filesize
+    return ret ? ret : (ssize_t)done;
+}
+
+int64_t archive_cat(archive_t* a, const archive_member_t* member,
+    uint64_t offset, uint64_t len, int out_fd)
+{
+    if (member->index >= a->header.count)
+        return ARCHIVE_EINVAL;
+
+    const file_info_t* fi = &a->header.items[member->index];
+    if (offset >= fi->filesize)
+        return 0;
+    if (len > fi->filesize - offset)
+        len = fi->filesize - offset;
+
+    uint64_t started = stats_now();
+    int64_t ret = 0;
+    if (!(fi->flags & (FI_COMPRESSED | FI_DEDUP | FI_SPARSE)))
+    {
+        // Ядро читает вперед только нужный диапазон, а не весь архив
+        off_t from = fi->_offset + offset;
+        posix_fadvise(a->fd, from, len, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(a->fd, from,
+            len < CAT_READAHEAD ? len : CAT_READAHEAD, POSIX_FADV_WILLNEED);
+        uint64_t done = send_file(a->fd, out_fd, len, from);
+        ret = done == len ? (int64_t)done : ARCHIVE_EIO;
+    }
+    else
+    {
+        uint8_t* buf = malloc(CAT_BUFFER_SIZE);
+        if (!buf)
+            return ARCHIVE_ENOMEM;
+        while (ret >= 0 && (uint64_t)ret < len)
+        {
+            uint64_t left = len - ret;
+            ssize_t n = archive_pread(a, member, buf,
+                left < CAT_BUFFER_SIZE ? left : CAT_BUFFER_SIZE,
+                offset + ret);
+            if (n <= 0)
+                ret = n < 0 ? n : ARCHIVE_ECORRUPT;
+            else if (write_full(out_fd, buf, n) == -1)
+                ret = ARCHIVE_EIO;
+            else
+                ret += n;
+        }
+        free(buf);
+    }
+    stats_phase(STATS_COPY, started);
+    if (ret >= 0)
+        stats_member(fi_table_name(&a->header, fi), ret, started);
+    return ret;
+}
+
+/**
+ * Готовит архив к изменению: читает суперблок, а пустой архив или архив
+ * старого формата приводит к новому формату
+ * \param sb Куда записать суперблок
+ * \return 0 или код ошибки
+ */
+static int archive_prepare_write(archive_t* a, arch_super_t* sb)
+{
+    int sup = read_super(a->fd, sb);
+    if (sup < 0)
+        return sup;
+    if (sup)
+        return 0;
+
+    if (lseek(a->fd, 0, SEEK_END) != 0)
+    {
+        // Архив старого формата: один раз переписываем его целиком
+        int ret = rewrite_archive(a->path, a->fd, &a->header);
+        int reload = archive_reload(a);
+        if (ret == 0)
+            ret = reload;
+        if (ret == 0 && read_super(a->fd, sb) != 1)
+            ret = ARCHIVE_EFORMAT;
+        return ret;
+    }
+
+    // Пустой архив
+    fill_super(sb, sizeof(arch_super_t), 0, 0, 0);
+    if (write_super(a->fd, sb) == -1)
+        return ARCHIVE_EIO;
+    return 0;
+}
+
+/**
+ * Дописывает каталог после данных архива и переключает на него суперблок.
+ * При ошибке каталог перечитывается с диска
+ * \param end Где кончаются данные
+ * \return 0 или код ошибки
+ */
+static int archive_commit_directory(archive_t* a, uint64_t end)
+{
+    arch_super_t sb;
+    uint64_t t = stats_now();
+    int ret = write_directory(&a->header, a->fd, end, &sb);
+    if (ret == 0 && ftruncate(a->fd, super_data_end(&sb)) == -1)
+        ret = ARCHIVE_EIO;
+    stats_phase(STATS_DIRECTORY, t);
+    t = stats_now();
+    if (ret == 0)
+        ret = commit_super(a->fd, &sb);
+    stats_phase(STATS_SYNC, t);
+
+    // Суперблок не тронут, архив на диске прежний
+    if (ret != 0)
+        archive_reload(a);
+    return ret;
+}
+
+int archive_insert(
+    archive_t* a, int fnums, char** fnames, const struct archive_opts* opts)
+{
+    if (!(a->flags & ARCHIVE_RDWR) || fnums <= 0)
+        return ARCHIVE_EINVAL;
+
+    arch_super_t sb;
+    int ret = archive_prepare_write(a, &sb);
+    if (ret != 0)
+        return ret;
+
+    const char** dirs = malloc(fnums * sizeof(char*));
+    if (!dirs)
+        return ARCHIVE_ENOMEM;
+    archive_drop_maps(a);
+    size_t start = a->header.count, ndirs, touched = 0;
+    uint64_t t = stats_now();
+    ret = update_header_for_input(
+        &a->header, fnums, fnames, opts, dirs, &ndirs, &touched);
+    stats_phase(STATS_STAT, t);
+
+    uint64_t end = super_data_end(&sb);
+    t = stats_now();
+    if (ret > 0)
+        ret = insert_files_routine(&a->header, start, a->fd, &end, opts);
+    stats_phase(STATS_COPY, t);
+    for (size_t i = 0; ret >= 0 && i < ndirs; ++i)
+    {
+        ssize_t tree = insert_tree(
+            &a->header, dirs[i], a->fd, &end, opts, start, &touched);
+        ret = tree < 0 ? tree : 0;
+    }
+    free(dirs);
+
+    // При обновлении ничего не изменилось - архив трогать не нужно
+    char changed = a->header.count != start || touched;
+    if (ret == 0 && !changed)
+        return opts->update ? 0 : ARCHIVE_ENOFILES;
+    if (ret == 0 && opts->update)
+        ret = supersede_members(&a->header, start);
+    if (ret == 0)
+        ret = archive_commit_directory(a, end);
+    else
+        archive_reload(a);
+    if (ret != 0)
+        return ret;
+
+    // Пути принадлежат вызывающему, дальше они не нужны
+    for (size_t i = start; i < a->header.count; ++i)
+        a->header.src[i] = NULL;
+    return a->header.count - start;
+}
+
+static int member_changed(fi_table_t* header, size_t old, const char* name,
+    const char* path, const file_info_t* fi, const struct archive_opts* opts,
+    size_t* touched)
+{
+    // Сравнивается последняя копия: она и извлечется последней
+    ssize_t last = -1;
+    for (ssize_t i = fi_table_find(header, name); i != -1;
+         i = fi_table_find_next(header, i))
+    {
+        if ((size_t)i < old && i > last)
+            last = i;
+    }
+    if (last == -1)
+        return 1;
+
+    file_info_t* prev = &header->items[last];
+    if (prev->filesize != fi->filesize || prev->mask != fi->mask)
+        return 1;
+    if (prev->mtime == fi->mtime && fi->mtime != 0)
+        return 0;
+    if (opts->update != ARCHIVE_UPDATE_HASH || !(prev->flags & FI_CHECKSUM))
+        return 1;
+
+    // Время другое, но содержимое могло не поменяться (файл пересоздан
+    // или только тронут): сверяем сумму
+    int fd = open(path, O_RDONLY);
+    uint8_t* buf = fd == -1 ? NULL : malloc(VERIFY_BUFFER_SIZE);
+    uint32_t crc = 0;
+    uint64_t done = 0;
+    while (buf && done < fi->filesize)
+    {
+        uint64_t left = fi->filesize - done;
+        size_t n = left < VERIFY_BUFFER_SIZE ? left : VERIFY_BUFFER_SIZE;
+        ssize_t r = pread_full(fd, buf, n, done);
+        if (r <= 0)
+            break;
+        crc = crc32c(crc, buf, r);
+        done += r;
+    }
+    free(buf);
+    if (fd != -1)
+        close(fd);
+    if (done != fi->filesize || crc != prev->checksum)
+        return 1;
+
+    prev->mtime = fi->mtime;
+    (*touched)++;
+    return 0;
+}
+
+static int supersede_members(fi_table_t* header, size_t old)
+{
+    size_t marked = 0;
+    for (size_t i = old; i < header->count; ++i)
+    {
+        const char* name = fi_table_name(header, &header->items[i]);
+        for (ssize_t j = fi_table_find(header, name); j != -1;
+             j = fi_table_find_next(header, j))
+        {
+            if ((size_t)j >= old || (header->items[j].flags & FI_DELETED))
+                continue;
+            header->items[j].flags |= FI_DELETED;
+            marked++;
+        }
+    }
+    return marked ? fi_table_reindex(header) : 0;
+}
+
+int archive_remove(archive_t* a, int fnums, char** fnames)
+{
+    if (!(a->flags & ARCHIVE_RDWR) || fnums <= 0)
+        return ARCHIVE_EINVAL;
+
+    arch_super_t sb;
+    int ret = archive_prepare_write(a, &sb);
+    if (ret != 0)
+        return ret;
+
+    // Номера записей не меняются, так что карты кусков остаются верными
+    ssize_t marked = remove_files_from_header(&a->header, fnums, fnames, 1);
+    if (marked <= 0)
+    {
+        if (marked < 0)
+            archive_reload(a);
+        return marked;
+    }
+    ret = archive_commit_directory(a, super_data_end(&sb));
+    return ret ? ret : marked;
+}
+
+/**
+ * Пробивает дыры на месте мертвых участков архива. Чанки без ссылок не
+ * трогаются: они остаются в таблице, и новая вставка может на них сослаться
+ * \return 0, ARCHIVE_EINVAL, если ФС не умеет пробивать дыры, или другой код
+ * ошибки
+ */
+static int punch_dead(archive_t* a, const arch_super_t* sb)
+{
+    struct extent* e;
+    ssize_t n = live_extents(&a->header, sb, NULL, &e);
+    if (n < 0)
+        return n;
+
+    // Все, что за каталогом, уже отрезано ftruncate
+    int ret = 0;
+    for (ssize_t i = 0; ret == 0 && i + 1 < n; ++i)
+    {
+        uint64_t from = e[i].off + e[i].len;
+        if (fallocate(a->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from,
+                e[i + 1].off - from)
+            == -1)
+        {
+            ret = errno == EOPNOTSUPP || errno == ENOSYS ? ARCHIVE_EINVAL
+                                                         : ARCHIVE_EIO;
+        }
+    }
+    free(e);
+    return ret;
+}
+
+int archive_compact(archive_t* a, int threshold, int flags)
+{
+    if (!(a->flags & ARCHIVE_RDWR) || threshold < 0 || threshold > 100)
+        return ARCHIVE_EINVAL;
+
+    arch_super_t sb;
+    int ret = archive_prepare_write(a, &sb);
+    uint64_t used, dead;
+    if (ret == 0)
+        ret = space_usage(a, &used, &dead);
+    if (ret != 0)
+        return ret;
+    if (dead == 0 || dead * 100 < (uint64_t)threshold * used)
+        return 0;
+
+    archive_drop_maps(a);
+    if (!(flags & ARCHIVE_COMPACT_REWRITE))
+    {
+        // Надгробия больше не нужны: каталог без них дописывается как при
+        // удалении, и только после этого пробиваются дыры - в том числе на
+        // месте прежнего каталога. Поэтому каталог сначала уходит из
+        // отображения: иначе дыры обнулили бы его нескопированные страницы
+        size_t count = a->header.count;
+        ret = fi_table_unmap(&a->header);
+        if (ret == 0)
+            ret = fi_table_purge(&a->header);
+        if (ret != 0)
+            archive_reload(a);
+        else if (a->header.count != count)
+        {
+            uint64_t end = super_data_end(&sb);
+            ret = archive_commit_directory(a, end);
+            if (ret == 0 && read_super(a->fd, &sb) != 1)
+                ret = ARCHIVE_EFORMAT;
+        }
+        if (ret == 0)
+            ret = punch_dead(a, &sb);
+
+        // Если мертвыми остались чанки без ссылок и их все еще больше
+        // порога, их убирает только переписывание
+        if (ret == 0)
+            ret = space_usage(a, &used, &dead);
+        if (ret == 0 && (dead == 0 || dead * 100 < (uint64_t)threshold * used))
+            return 1;
+        if (ret != 0 && ret != ARCHIVE_EINVAL)
+            return ret;
+    }
+
+    ret = rewrite_archive(a->path, a->fd, &a->header);
+    int reload = archive_reload(a);
+    return ret ? ret : reload ? reload : 1;
+}
+
+/**
+ * Общее состояние потоков извлечения и проверки
+ */
+struct member_pool
+{
+    const fi_table_t* header;
+    const struct archive_opts* opts;
+    const size_t* sel; //!< Номера выбранных записей каталога
+    size_t count; //!< Количество выбранных записей
+    int arch_fd;
+    int inner_jobs; //!< Потоков на распаковку одного сжатого файла
+    atomic_size_t next; //!< Следующая не взятая запись
+    atomic_size_t failed; //!< Количество поврежденных (неизвлеченных) файлов
+    atomic_size_t unchecked; //!< Количество файлов без суммы
+};
+
+/**
+ * Готовит пул к раздаче count выбранных записей
+ * \return Количество потоков, которое имеет смысл запускать
+ */
+static int member_pool_init(struct member_pool* pool, archive_t* a,
+    const size_t* sel, size_t count, const struct archive_opts* opts)
+{
+    int jobs = opts->jobs;
+    if ((size_t)jobs > count)
+        jobs = count;
+
+    pool->header = &a->header;
+    pool->opts = opts;
+    pool->sel = sel;
+    pool->count = count;
+    pool->arch_fd = a->fd;
+    pool->inner_jobs = jobs > 0 ? opts->jobs / jobs : 1;
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->failed, 0);
+    atomic_init(&pool->unchecked, 0);
+    return jobs;
+}
+
+static int extract_member(const fi_table_t* header, const file_info_t* fi,
+    int arch_fd, int jobs, const struct archive_opts* opts)
+{
+    const char* name = fi_table_name(header, fi);
+    if (!member_name_safe(name))
+    {
+        report(opts, name, ARCHIVE_ECORRUPT);
+        return ARCHIVE_ECORRUPT;
+    }
+    uint64_t started = stats_now();
+    int new_fd = create_member_file(name, fi->mask);
+    if (new_fd == -1)
+    {
+        report(opts, name, ARCHIVE_EIO);
+        return ARCHIVE_EIO;
+    }
+    fchmod(new_fd, fi->mask);
+
+    uint32_t crc = 0;
+    int ret = 0;
+    if (fi->flags & FI_DEDUP)
+    {
+        ret = dedup_load_member(header, fi, arch_fd, new_fd, &crc);
+    }
+    else if (fi->flags & FI_SPARSE)
+    {
+        ret = sparse_load_member(fi, arch_fd, new_fd, &crc);
+    }
+    else if (fi->flags & FI_COMPRESSED)
+    {
+        ret = lz_load_member(fi, arch_fd, new_fd, jobs, &crc);
+    }
+    else
+    {
+        if (copy_file(arch_fd, new_fd, fi->filesize, fi->_offset)
+            != fi->filesize)
+            ret = -1;
+        crc = fi->checksum; // без проверки, данные не покидали ядро
+    }
+    close(new_fd);
+    stats_member(name, fi->filesize, started);
+
+    if (ret == -1 || ((fi->flags & FI_CHECKSUM) && crc != fi->checksum))
+    {
+        report(opts, name, ARCHIVE_ECORRUPT);
+        return ARCHIVE_ECORRUPT;
+    }
+    return 0;
+}
+
+/**
+ * Поток извлечения: берет записи по одной, пока они не кончатся. Мелкие и
+ * крупные файлы так сами распределяются между потоками
+ */
+static void* extract_worker(void* arg)
+{
+    struct member_pool* pool = arg;
+    struct uring ring;
+    struct small_file* small = NULL;
+    uint8_t* small_buf = NULL;
+    if (uring_init(&ring, URING_ENTRIES) == 0)
+    {
+        small = malloc(URING_BATCH * sizeof(struct small_file));
+        small_buf = malloc(URING_BATCH * URING_SMALL_FILE);
+    }
+
+    // С io_uring записи берутся пачками
+    size_t step = small && small_buf ? URING_BATCH : 1;
+    for (;;)
+    {
+        size_t i = atomic_fetch_add(&pool->next, step);
+        if (i >= pool->count)
+            break;
+        if (step > 1)
+        {
+            size_t to = pool->count - i < step ? pool->count : i + step;
+            extract_small_files(pool, &ring, small, small_buf, i, to);
+            continue;
+        }
+        if (extract_member(pool->header, &pool->header->items[pool->sel[i]],
+                pool->arch_fd, pool->inner_jobs, pool->opts))
+        {
+            atomic_fetch_add(&pool->failed, 1);
+        }
+    }
+    free(small_buf);
+    free(small);
+    uring_free(&ring);
+    return NULL;
+}
+
+/**
+ * Доводит до конца извлечение мелкого файла fi после io_uring
+ * \return 0 или код ошибки
+ */
+static int finish_small_file(struct member_pool* pool, const file_info_t* fi,
+    const struct small_file* f)
+{
+    if (f->err && f->failed_op != URING_READ_ARCH)
+    {
+        errno = f->err;
+        report(pool->opts, f->path, ARCHIVE_EIO);
+        return ARCHIVE_EIO;
+    }
+    // Данные все равно прошли через память, так что сумма сверяется
+    if (f->err
+        || ((fi->flags & FI_CHECKSUM)
+            && crc32c(0, f->buf, f->size) != fi->checksum))
+    {
+        report(pool->opts, f->path, ARCHIVE_ECORRUPT);
+        return ARCHIVE_ECORRUPT;
+    }
+    return 0;
+}
+
+static void extract_small_files(struct member_pool* pool, struct uring* ring,
+    struct small_file* f, uint8_t* buf, size_t from, size_t to)
+{
+    const fi_table_t* header = pool->header;
+    const file_info_t* fis[URING_BATCH];
+    size_t n = 0;
+    for (size_t i = from; i < to; ++i)
+    {
+        const file_info_t* fi = &header->items[pool->sel[i]];
+        const char* name = fi_table_name(header, fi);
+        if ((fi->flags & (FI_COMPRESSED | FI_DEDUP | FI_SPARSE))
+            || fi->filesize > URING_SMALL_FILE || !member_name_safe(name))
+        {
+            if (extract_member(
+                    header, fi, pool->arch_fd, pool->inner_jobs, pool->opts))
+                atomic_fetch_add(&pool->failed, 1);
+            continue;
+        }
+        fis[n] = fi;
+        f[n] = (struct small_file) { .path = name,
+            .buf = buf + n * URING_SMALL_FILE,
+            .off = fi->_offset,
+            .size = fi->filesize,
+            .mask = fi->mask };
+        n++;
+    }
+    if (n == 0)
+        return;
+
+    // Файлы, которым не хватило директорий, сдвигаются в начало пачки и
+    // повторяются после создания директорий. Соседние файлы обычно лежат в
+    // одной директории, поэтому она создается один раз
+    for (int pass = 0; n > 0 && pass < 2; ++pass)
+    {
+        if (uring_store_files(ring, f, n, pool->arch_fd) == -1)
+            break;
+        size_t again = 0, made_len = 0;
+        const char* made = NULL;
+        for (size_t k = 0; k < n; ++k)
+        {
+            if (pass > 0 || f[k].err != ENOENT
+                || f[k].failed_op != URING_OPEN_CREATE)
+            {
+                if (finish_small_file(pool, fis[k], &f[k]))
+                    atomic_fetch_add(&pool->failed, 1);
+                continue;
+            }
+            const char* slash = strrchr(f[k].path, '/');
+            size_t len = slash ? (size_t)(slash - f[k].path) : 0;
+            if (len > 0
+                && (len != made_len || memcmp(made, f[k].path, len) != 0)
+                && create_member_dirs(f[k].path) == 0)
+            {
+                made = f[k].path;
+                made_len = len;
+            }
+            f[again] = f[k];
+            fis[again++] = fis[k];
+        }
+        n = again;
+    }
+
+    // Кольцо сломалось: оставшиеся файлы извлекаются обычным путем
+    for (size_t k = 0; k < n; ++k)
+    {
+        if (extract_member(
+                header, fis[k], pool->arch_fd, pool->inner_jobs, pool->opts))
+            atomic_fetch_add(&pool->failed, 1);
+    }
+}
+
+int archive_extract(
+    archive_t* a, int fnums, char** fnames, const struct archive_opts* opts)
+{
+    size_t* sel;
+    ssize_t count = select_members(&a->header, fnums, fnames, 1, &sel);
+    if (count < 0)
+        return count;
+
+    struct member_pool pool;
+    int jobs = member_pool_init(&pool, a, sel, count, opts);
+    uint64_t t = stats_now();
+    run_parallel(extract_worker, &pool, jobs);
+    stats_phase(STATS_COPY, t);
+
+    free(sel);
+    return atomic_load(&pool.failed);
+}
+
+static int verify_member(const fi_table_t* header, const file_info_t* fi,
+    int arch_fd, uint8_t* buf)
+{
+    if (!(fi->flags & FI_CHECKSUM))
+        return 1;
+
+    uint32_t crc = 0;
+    if (fi->flags & FI_DEDUP)
+    {
+        if (dedup_load_member(header, fi, arch_fd, -1, &crc) == -1)
+            return -1;
+    }
+    else if (fi->flags & FI_SPARSE)
+    {
+        if (sparse_load_member(fi, arch_fd, -1, &crc) == -1)
+            return -1;
+    }
+    else if (fi->flags & FI_COMPRESSED)
+    {
+        if (lz_load_member(fi, arch_fd, -1, 1, &crc) == -1)
+            return -1;
+    }
+    else
+    {
+        for (uint64_t done = 0; done < fi->filesize;)
+        {
+            size_t n = fi->filesize - done < VERIFY_BUFFER_SIZE
+                ? fi->filesize - done
+                : VERIFY_BUFFER_SIZE;
+            if (pread_full(arch_fd, buf, n, fi->_offset + done) != (ssize_t)n)
+                return -1;
+            crc = crc32c(crc, buf, n);
+            done += n;
+        }
+    }
+    return crc == fi->checksum ? 0 : -1;
+}
+
+static void* verify_worker(void* arg)
+{
+    struct member_pool* pool = arg;
+    uint8_t* buf = malloc(VERIFY_BUFFER_SIZE);
+    for (;;)
+    {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->count)
+            break;
+
+        const file_info_t* fi = &pool->header->items[pool->sel[i]];
+        uint64_t started = stats_now();
+        int r = buf ? verify_member(pool->header, fi, pool->arch_fd, buf) : -1;
+        stats_member(fi_table_name(pool->header, fi), fi->filesize, started);
+        if (r == 1)
+        {
+            atomic_fetch_add(&pool->unchecked, 1);
+        }
+        else if (r == -1)
+        {
+            atomic_fetch_add(&pool->failed, 1);
+            report(pool->opts, fi_table_name(pool->header, fi),
+                ARCHIVE_ECORRUPT);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int archive_verify(archive_t* a, int fnums, char** fnames,
+    const struct archive_opts* opts, struct archive_verify_stats* stats)
+{
+    size_t* sel;
+    ssize_t count = select_members(&a->header, fnums, fnames, 0, &sel);
+    if (count < 0)
+        return count;
+
+    struct member_pool pool;
+    int jobs = member_pool_init(&pool, a, sel, count, opts);
+    uint64_t t = stats_now();
+    run_parallel(verify_worker, &pool, jobs);
+    stats_phase(STATS_COPY, t);
+
+    stats->unchecked = atomic_load(&pool.unchecked);
+    stats->failed = atomic_load(&pool.failed);
+    stats->checked = count - stats->unchecked;
+    free(sel);
+    return 0;
+}
@@ -0,0 +1,389 @@
+#include "archiver_impl.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint32_t lz_read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Пишет хвост длины: байты по 255 и остаток
+ */
+static uint8_t* lz_put_len(uint8_t* op, size_t len)
+{
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+/**
+ * Пишет одну последовательность "литералы + совпадение". mlen == 0 - последняя
+ * последовательность, только литералы
+ * \return Новая позиция в выходном буфере или NULL, если не хватило места
+ */
+static uint8_t* lz_put_sequence(uint8_t* op, const uint8_t* oend,
+    const uint8_t* lit, size_t nlit, size_t offset, size_t mlen)
+{
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    size_t worst = 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1;
+    if (worst > (size_t)(oend - op))
+        return NULL;
+
+    uint8_t* token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15)
+        op = lz_put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen)
+    {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        if (ml >= 15)
+            op = lz_put_len(op, ml - 15);
+    }
+    return op;
+}
+
+size_t lz_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap)
+{
+    // Номера позиций +1, 0 - пустая ячейка
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    const uint8_t* mflimit = n > LZ_END_LITERALS + LZ_MIN_MATCH
+        ? end - LZ_END_LITERALS - LZ_MIN_MATCH
+        : src;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < mflimit)
+    {
+        uint32_t seq = lz_read32(ip);
+        uint32_t h = lz_hash(seq);
+        uint32_t cand = table[h];
+        table[h] = ip - src + 1;
+
+        const uint8_t* ref = src + cand - 1;
+        if (!cand || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq)
+        {
+            ip++;
+            continue;
+        }
+
+        const uint8_t* mend = ip + LZ_MIN_MATCH;
+        for (const uint8_t* r = ref + LZ_MIN_MATCH;
+             mend < end - LZ_END_LITERALS && *mend == *r; ++mend, ++r);
+
+        op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, mend - ip);
+        if (!op)
+            return 0;
+        ip = anchor = mend;
+    }
+
+    op = lz_put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+/**
+ * Читает хвост длины, записанный lz_put_len
+ * \return 0 или -1, если вход кончился
+ */
+static int lz_get_len(const uint8_t** ip, const uint8_t* iend, size_t* len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+ssize_t lz_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz_get_len(&ip, iend, &nlit) == -1)
+            return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        if (ip == iend)
+            break; // последняя последовательность
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz_get_len(&ip, iend, &mlen) == -1)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst)
+            || mlen > (size_t)(oend - op))
+            return -1;
+
+        // Совпадение может перекрываться с тем, что сейчас пишется
+        const uint8_t* r = op - offset;
+        while (mlen--)
+            *op++ = *r++;
+    }
+    return op - dst;
+}
+
+/**
+ * Пачка блоков, которую потоки разбирают по одному
+ */
+struct lz_batch
+{
+    struct lz_task* tasks;
+    size_t count;
+    atomic_size_t next;
+    char decode; //!< 1 - распаковка, 0 - сжатие
+};
+
+static void* lz_worker(void* arg)
+{
+    struct lz_batch* b = arg;
+    for (;;)
+    {
+        size_t i = atomic_fetch_add(&b->next, 1);
+        if (i >= b->count)
+            break;
+
+        struct lz_task* t = &b->tasks[i];
+        if (b->decode)
+        {
+            if (t->raw)
+            {
+                t->failed = t->src_len != t->dst_len;
+                if (!t->failed)
+                    memcpy(t->dst, t->src, t->src_len);
+            }
+            else
+            {
+                t->failed = lz_decompress(t->src, t->src_len, t->dst, t->dst_len)
+                    != (ssize_t)t->dst_len;
+            }
+        }
+        else
+        {
+            // Блок, который не ужался хотя бы на байт, хранится как есть
+            t->dst_len = lz_compress(t->src, t->src_len, t->dst, t->src_len - 1);
+            t->raw = t->dst_len == 0;
+        }
+    }
+    return NULL;
+}
+
+void lz_run_batch(struct lz_task* tasks, size_t n, char decode, int jobs)
+{
+    struct lz_batch b = { .tasks = tasks, .count = n, .decode = decode };
+    atomic_init(&b.next, 0);
+    run_parallel(lz_worker, &b, (size_t)jobs < n ? jobs : (int)n);
+}
+
+int lz_store_member(int in_fd, uint64_t size, int out_fd, uint64_t off,
+    int jobs, uint64_t* stored, uint32_t* crc)
+{
+    *crc = 0;
+    size_t nblocks = (size + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE;
+    size_t batch = jobs * LZ_BATCH_PER_JOB;
+    uint32_t* table = calloc(nblocks + 1, sizeof(uint32_t));
+    uint8_t* in = malloc(batch * LZ_BLOCK_SIZE);
+    uint8_t* out = malloc(batch * LZ_BLOCK_SIZE);
+    struct lz_task* tasks = calloc(batch, sizeof(struct lz_task));
+    uint64_t pos = off + nblocks * sizeof(uint32_t);
+    int ret = table && in && out && tasks ? 0 : ARCHIVE_ENOMEM;
+
+    for (size_t b0 = 0; ret == 0 && b0 < nblocks; b0 += batch)
+    {
+        size_t n = nblocks - b0 < batch ? nblocks - b0 : batch;
+        uint64_t from = (uint64_t)b0 * LZ_BLOCK_SIZE;
+        size_t bytes = size - from < n * LZ_BLOCK_SIZE ? size - from
+                                                        : n * LZ_BLOCK_SIZE;
+
+        // Если файл успел уменьшиться, недостающее заполняется нулями, чтобы
+        // размеры блоков соответствовали filesize
+        ssize_t r = pread_full(in_fd, in, bytes, from);
+        if (r < (ssize_t)bytes)
+            memset(in + (r > 0 ? r : 0), 0, bytes - (r > 0 ? r : 0));
+        *crc = crc32c(*crc, in, bytes);
+
+        for (size_t k = 0; k < n; ++k)
+        {
+            size_t len = bytes - k * LZ_BLOCK_SIZE;
+            tasks[k].src = in + k * LZ_BLOCK_SIZE;
+            tasks[k].src_len = len < LZ_BLOCK_SIZE ? len : LZ_BLOCK_SIZE;
+            tasks[k].dst = out + k * LZ_BLOCK_SIZE;
+        }
+        lz_run_batch(tasks, n, 0, jobs);
+
+        for (size_t k = 0; k < n; ++k)
+        {
+            const uint8_t* data = tasks[k].raw ? tasks[k].src : tasks[k].dst;
+            size_t len = tasks[k].raw ? tasks[k].src_len : tasks[k].dst_len;
+            table[b0 + k] = len | (tasks[k].raw ? LZ_RAW_BLOCK : 0);
+            if (pwrite_full(out_fd, data, len, pos) == -1)
+            {
+                ret = ARCHIVE_EIO;
+                break;
+            }
+            pos += len;
+        }
+    }
+    le32_array(table, nblocks);
+    if (ret == 0
+        && pwrite_full(out_fd, table, nblocks * sizeof(uint32_t), off) == -1)
+    {
+        ret = ARCHIVE_EIO;
+    }
+
+    free(tasks);
+    free(out);
+    free(in);
+    free(table);
+    *stored = pos - off;
+    return ret;
+}
+
+int lz_load_member(const file_info_t* fi, int arch_fd, int out_fd, int jobs,
+    uint32_t* crc)
+{
+    size_t nblocks = (fi->filesize + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE;
+    size_t batch = jobs * LZ_BATCH_PER_JOB;
+    uint32_t* table = malloc(nblocks * sizeof(uint32_t) + 1);
+    uint8_t* in = malloc(batch * LZ_BLOCK_SIZE);
+    uint8_t* out = malloc(batch * LZ_BLOCK_SIZE);
+    struct lz_task* tasks = calloc(batch, sizeof(struct lz_task));
+    uint64_t pos = fi->_offset + nblocks * sizeof(uint32_t);
+    int ret = table && in && out && tasks ? 0 : -1;
+    if (crc)
+        *crc = 0;
+
+    if (ret == 0
+        && pread_full(arch_fd, table, nblocks * sizeof(uint32_t), fi->_offset)
+            != (ssize_t)(nblocks * sizeof(uint32_t)))
+    {
+        ret = -1;
+    }
+    if (ret == 0)
+        le32_array(table, nblocks);
+
+    for (size_t b0 = 0; ret == 0 && b0 < nblocks; b0 += batch)
+    {
+        size_t n = nblocks - b0 < batch ? nblocks - b0 : batch;
+        size_t stored = 0, orig = 0;
+        for (size_t k = 0; k < n; ++k)
+        {
+            size_t len = table[b0 + k] & ~LZ_RAW_BLOCK;
+            uint64_t left = fi->filesize - (uint64_t)(b0 + k) * LZ_BLOCK_SIZE;
+            if (len > LZ_BLOCK_SIZE)
+            {
+                ret = -1;
+                break;
+            }
+            tasks[k].src = in + stored;
+            tasks[k].src_len = len;
+            tasks[k].raw = (table[b0 + k] & LZ_RAW_BLOCK) != 0;
+            tasks[k].dst = out + orig;
+            tasks[k].dst_len = left < LZ_BLOCK_SIZE ? left : LZ_BLOCK_SIZE;
+            stored += len;
+            orig += tasks[k].dst_len;
+        }
+        if (ret == -1
+            || pread_full(arch_fd, in, stored, pos) != (ssize_t)stored)
+        {
+            ret = -1;
+            break;
+        }
+        pos += stored;
+
+        lz_run_batch(tasks, n, 1, jobs);
+        for (size_t k = 0; k < n; ++k)
+            ret |= tasks[k].failed ? -1 : 0;
+
+        if (ret == 0 && crc)
+            *crc = crc32c(*crc, out, orig);
+        if (ret == 0 && out_fd != -1
+            && pwrite_full(out_fd, out, orig, (uint64_t)b0 * LZ_BLOCK_SIZE)
+                == -1)
+        {
+            ret = -1;
+        }
+    }
+
+    free(tasks);
+    free(out);
+    free(in);
+    free(table);
+    return ret;
+}
+
+struct piece_map* lz_build_map(const file_info_t* fi, int arch_fd)
+{
+    size_t nblocks = (fi->filesize + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE;
+    if (nblocks > fi->stored_size / sizeof(uint32_t))
+        return NULL;
+
+    uint32_t* table = malloc(nblocks * sizeof(uint32_t) + 1);
+    struct piece_map* map
+        = malloc(sizeof(struct piece_map) + nblocks * sizeof(struct piece));
+    if (!table || !map
+        || pread_full(arch_fd, table, nblocks * sizeof(uint32_t), fi->_offset)
+            != (ssize_t)(nblocks * sizeof(uint32_t)))
+    {
+        free(table);
+        free(map);
+        return NULL;
+    }
+    le32_array(table, nblocks);
+
+    uint64_t pos = fi->_offset + nblocks * sizeof(uint32_t);
+    map->count = nblocks;
+    for (size_t k = 0; k < nblocks; ++k)
+    {
+        struct piece* p = &map->items[k];
+        uint64_t left = fi->filesize - (uint64_t)k * LZ_BLOCK_SIZE;
+        p->orig_off = (uint64_t)k * LZ_BLOCK_SIZE;
+        p->orig_len = left < LZ_BLOCK_SIZE ? left : LZ_BLOCK_SIZE;
+        p->stored_off = pos;
+        p->stored_len = table[k] & ~LZ_RAW_BLOCK;
+        p->raw = (table[k] & LZ_RAW_BLOCK) != 0;
+        p->hole = 0;
+        pos += p->stored_len;
+        if (p->stored_len > LZ_BLOCK_SIZE
+            || (p->raw && p->stored_len != p->orig_len))
+        {
+            free(map);
+            map = NULL;
+            break;
+        }
+    }
+    free(table);
+    return map;
+}
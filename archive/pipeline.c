@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * \file pipeline.c
+ * Конвейерная вставка несжатых файлов
+ *
+ * Раньше файл копировался в архив кусками строго по очереди: прочитать
+ * кусок, записать кусок, и пока шло чтение, запись в архив стояла, и
+ * наоборот. Здесь файлы читают потоки-читатели, каждый в свое кольцо из
+ * PIPE_DEPTH буферов по PIPE_BUFFER_SIZE байт, а вызывающий поток (писатель)
+ * забирает заполненные буферы и пишет их в архив. CRC32C считают читатели.
+ *
+ * Данные файла лежат в архиве подряд, поэтому писатель берет файлы строго по
+ * порядку. Читатели разбирают файлы по очереди и читают несколько файлов
+ * одновременно, так что задержки медленных (сетевых) источников
+ * перекрываются. Кольцо читателя - очередь: следующий файл читателя ждет
+ * места в том же кольце, пока писатель не заберет текущий, поэтому писатель
+ * всегда дожидается нужного ему куска.
+ */
+
+/**
+ * Кусок данных файла в кольце читателя
+ */
+struct pipe_slot
+{
+    uint8_t* buf;
+    size_t len; //!< Сколько байт в buf
+    char last; //!< Последний кусок файла
+    int err; //!< errno, если файл не открылся или не прочитался
+    uint32_t crc; //!< CRC32C файла с начала по этот кусок включительно
+    int fd; //!< Разреженный файл, который пишет сам писатель, иначе -1
+    struct sparse_extent* ext; //!< Участки разреженного файла
+    size_t next; //!< Количество участков
+};
+
+/**
+ * Поток-читатель и его кольцо
+ */
+struct pipe_reader
+{
+    struct pipeline* p;
+    int id;
+    struct pipe_slot slots[PIPE_DEPTH];
+    size_t head; //!< Сколько кусков забрал писатель
+    size_t tail; //!< Сколько кусков выложил читатель
+};
+
+/**
+ * Состояние конвейера. Поля, кроме неизменных после pipeline_start,
+ * защищены lock
+ */
+struct pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t data_cond; //!< Появился кусок или файл нашел читателя
+    pthread_cond_t space_cond; //!< Освободился кусок, есть файлы или стоп
+    const fi_table_t* header;
+    size_t from; //!< Файлы текущей пачки - записи [from, from + count)
+    size_t count;
+    size_t claimed; //!< Сколько файлов пачки разобрали читатели
+    int* owner; //!< Читатель каждого файла пачки или -1
+    size_t owner_cap;
+    char stop;
+    struct pipe_reader* readers;
+    int nreaders;
+    pthread_t* threads;
+    int nthreads;
+};
+
+/**
+ * Ждет свободное место в кольце читателя r
+ * \return Кусок или NULL, если конвейер останавливается
+ */
+static struct pipe_slot* pipe_slot_get(
+    struct pipeline* p, struct pipe_reader* r)
+{
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && r->tail - r->head == PIPE_DEPTH)
+        pthread_cond_wait(&p->space_cond, &p->lock);
+    struct pipe_slot* s = p->stop ? NULL : &r->slots[r->tail % PIPE_DEPTH];
+    pthread_mutex_unlock(&p->lock);
+    return s;
+}
+
+/**
+ * Отдает писателю заполненный кусок кольца r
+ */
+static void pipe_slot_put(struct pipeline* p, struct pipe_reader* r)
+{
+    pthread_mutex_lock(&p->lock);
+    r->tail++;
+    pthread_cond_signal(&p->data_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Читает файл path размера size в кольцо r. Больше size не читается, а если
+ * файл успел уменьшиться, в архив идет то, что прочитано
+ */
+static void pipe_read_file(
+    struct pipeline* p, struct pipe_reader* r, const char* path, uint64_t size)
+{
+    stats_count(STATS_OPEN_CALLS, 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int err = fd == -1 ? errno : 0;
+    if (fd != -1)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Разреженный файл пишется sparse_store_member целиком: его дескриптор
+    // уходит писателю одним куском
+    struct sparse_extent* ext = NULL;
+    ssize_t next = fd == -1 || size == 0 ? -1 : sparse_scan(fd, size, &ext);
+
+    uint32_t crc = 0;
+    uint64_t done = 0;
+    struct pipe_slot* s;
+    while ((s = pipe_slot_get(p, r)))
+    {
+        s->len = 0;
+        s->last = 1;
+        s->err = err;
+        s->fd = -1;
+        if (err == 0 && next >= 0)
+        {
+            s->fd = fd;
+            s->ext = ext;
+            s->next = next;
+            fd = -1;
+            ext = NULL;
+        }
+        else if (err == 0)
+        {
+            uint64_t left = size - done;
+            size_t want = left < PIPE_BUFFER_SIZE ? left : PIPE_BUFFER_SIZE;
+            ssize_t n = want ? pread_full(fd, s->buf, want, done) : 0;
+            if (n == -1)
+                s->err = errno;
+            else
+            {
+                crc = crc32c(crc, s->buf, n);
+                done += n;
+                s->len = n;
+                s->last = done == size || (size_t)n < want;
+            }
+        }
+        s->crc = crc;
+        char last = s->last;
+        pipe_slot_put(p, r);
+        if (last)
+            break;
+    }
+    free(ext);
+    if (fd != -1)
+        close(fd);
+}
+
+static void* pipe_reader_main(void* arg)
+{
+    struct pipe_reader* r = arg;
+    struct pipeline* p = r->p;
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        while (!p->stop && p->claimed == p->count)
+            pthread_cond_wait(&p->space_cond, &p->lock);
+        if (p->stop)
+            break;
+        size_t j = p->claimed++;
+        p->owner[j] = r->id;
+        const char* path = p->header->src[p->from + j];
+        uint64_t size = p->header->items[p->from + j].filesize;
+        pthread_cond_signal(&p->data_cond);
+        pthread_mutex_unlock(&p->lock);
+
+        pipe_read_file(p, r, path, size);
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+int pipeline_start(struct pipeline** out, int readers)
+{
+    struct pipeline* p = calloc(1, sizeof(struct pipeline));
+    if (!p)
+        return ARCHIVE_ENOMEM;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->data_cond, NULL);
+    pthread_cond_init(&p->space_cond, NULL);
+
+    p->readers = calloc(readers, sizeof(struct pipe_reader));
+    p->threads = malloc(readers * sizeof(pthread_t));
+    int ret = p->readers && p->threads ? 0 : ARCHIVE_ENOMEM;
+    p->nreaders = p->readers ? readers : 0;
+    for (int i = 0; ret == 0 && i < readers; ++i)
+    {
+        struct pipe_reader* r = &p->readers[i];
+        r->p = p;
+        r->id = i;
+        for (int k = 0; ret == 0 && k < PIPE_DEPTH; ++k)
+        {
+            r->slots[k].buf = malloc(PIPE_BUFFER_SIZE);
+            r->slots[k].fd = -1;
+            if (!r->slots[k].buf)
+                ret = ARCHIVE_ENOMEM;
+        }
+        if (ret == 0
+            && pthread_create(&p->threads[i], NULL, pipe_reader_main, r))
+            break;
+        p->nthreads += ret == 0;
+    }
+
+    // Без потоков конвейер не имеет смысла - вызывающий копирует сам
+    if (ret == 0 && p->nthreads == 0)
+        ret = ARCHIVE_ENOMEM;
+    if (ret != 0)
+    {
+        pipeline_free(p);
+        return ret;
+    }
+    *out = p;
+    return 0;
+}
+
+int pipeline_insert(struct pipeline* p, fi_table_t* header, size_t from,
+    size_t n, int arch_fd, uint64_t* off, const struct archive_opts* opts,
+    char* failed)
+{
+    pthread_mutex_lock(&p->lock);
+    if (n > p->owner_cap)
+    {
+        int* owner = realloc(p->owner, n * sizeof(int));
+        if (!owner)
+        {
+            pthread_mutex_unlock(&p->lock);
+            return ARCHIVE_ENOMEM;
+        }
+        p->owner = owner;
+        p->owner_cap = n;
+    }
+    for (size_t j = 0; j < n; ++j)
+        p->owner[j] = -1;
+    p->header = header;
+    p->from = from;
+    p->count = n;
+    p->claimed = 0;
+    pthread_cond_broadcast(&p->space_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    int ret = 0;
+    for (size_t j = 0; ret == 0 && j < n; ++j)
+    {
+        file_info_t* fi = &header->items[from + j];
+        uint64_t started = stats_now();
+        pthread_mutex_lock(&p->lock);
+        while (p->owner[j] == -1)
+            pthread_cond_wait(&p->data_cond, &p->lock);
+        struct pipe_reader* r = &p->readers[p->owner[j]];
+        pthread_mutex_unlock(&p->lock);
+
+        uint64_t pos = *off;
+        for (char last = 0; !last;)
+        {
+            pthread_mutex_lock(&p->lock);
+            while (r->head == r->tail)
+                pthread_cond_wait(&p->data_cond, &p->lock);
+            struct pipe_slot* s = &r->slots[r->head % PIPE_DEPTH];
+            pthread_mutex_unlock(&p->lock);
+
+            last = s->last;
+            failed[j] = s->err != 0;
+            if (s->err)
+            {
+                errno = s->err;
+                if (opts->report)
+                    opts->report(header->src[from + j], ARCHIVE_EIO,
+                        opts->report_ctx);
+            }
+            else if (s->fd != -1)
+            {
+                uint64_t stored = 0;
+                uint32_t crc = 0;
+                if (ret == 0)
+                    ret = sparse_store_member(s->fd, s->ext, s->next,
+                        fi->filesize, arch_fd, pos, &stored, &crc);
+                close(s->fd);
+                free(s->ext);
+                s->fd = -1;
+                fi->stored_size = stored;
+                fi->checksum = crc;
+                fi->flags |= FI_SPARSE;
+                pos += stored;
+            }
+            else
+            {
+                if (ret == 0
+                    && pwrite_full(arch_fd, s->buf, s->len, pos) == -1)
+                    ret = ARCHIVE_EIO;
+                pos += s->len;
+                if (last)
+                {
+                    fi->filesize = fi->stored_size = pos - *off;
+                    fi->checksum = s->crc;
+                }
+            }
+
+            pthread_mutex_lock(&p->lock);
+            r->head++;
+            pthread_cond_broadcast(&p->space_cond);
+            pthread_mutex_unlock(&p->lock);
+        }
+        if (failed[j])
+            continue;
+        fi->_offset = *off;
+        fi->flags |= FI_CHECKSUM;
+        *off = pos;
+        stats_member(fi_table_name(header, fi), fi->filesize, started);
+    }
+    return ret;
+}
+
+void pipeline_free(struct pipeline* p)
+{
+    if (!p)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->space_cond);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; ++i)
+        pthread_join(p->threads[i], NULL);
+
+    // После ошибки в кольцах могут остаться непрочитанные куски
+    for (int i = 0; i < p->nthreads; ++i)
+    {
+        struct pipe_reader* r = &p->readers[i];
+        for (; r->head != r->tail; ++r->head)
+        {
+            struct pipe_slot* s = &r->slots[r->head % PIPE_DEPTH];
+            if (s->fd != -1)
+            {
+                close(s->fd);
+                free(s->ext);
+            }
+        }
+    }
+    for (int i = 0; i < p->nreaders; ++i)
+    {
+        for (int k = 0; k < PIPE_DEPTH; ++k)
+            free(p->readers[i].slots[k].buf);
+    }
+    free(p->readers);
+    free(p->threads);
+    free(p->owner);
+    pthread_cond_destroy(&p->space_cond);
+    pthread_cond_destroy(&p->data_cond);
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
@@ -12,6 +12,9 @@ if [[ "$1" = "clean" ]]; then
     echo "cleaning..."
     rm -r template
     rm test.egl
+    rm -f dedup.egl empty.egl cat.egl tree.egl sparse.egl
+    rm -f update.egl grep.egl lock.egl range.egl compact.egl
+    rm -rf out
     echo "done!"
     exit 0
 fi;
@@ -47,6 +50,199 @@ $PWD/archiver test.egl -i $PWD/template/c.txt
 valgrind $PWD/archiver test.egl -r b.txt d.txt
 $PWD/archiver test.egl -s
 
+# Уплотнение на месте пробивает дыры и там, где лежал прежний каталог:
+# дедуплицированный файл после него должен проверяться без ошибок
+echo "compacting archive with dedup members..."
+rm -f dedup.egl
+seq 1 300000 > template/nums.txt
+$PWD/archiver dedup.egl -i template
+$PWD/archiver dedup.egl -i -d template/nums.txt
+$PWD/archiver dedup.egl -r template/c.txt
+$PWD/archiver dedup.egl --compact -t 0
+if ! $PWD/archiver dedup.egl -v; then
+    echo "compact broke dedup members!"
+    exit 1
+fi
+rm dedup.egl
+
+# Неудачная первая вставка оставляет архив из одного суперблока: его все
+# равно должно быть можно открыть и дополнить
+echo "reopening an archive with an empty directory..."
+rm -f empty.egl
+$PWD/archiver empty.egl -i template/missing.txt 2>/dev/null
+if ! $PWD/archiver empty.egl -s \
+    || ! $PWD/archiver empty.egl -i template/a.txt \
+    || ! $PWD/archiver empty.egl -v; then
+    echo "archive with an empty directory can't be opened!"
+    exit 1
+fi
+rm empty.egl
+
+# После повторной вставки --cat должен выводить новую копию файла
+echo "reading a re-inserted file with --cat..."
+rm -f cat.egl
+echo "this is a long first version of the file" > template/v.txt
+$PWD/archiver cat.egl -i template/v.txt
+echo "short" > template/v.txt
+$PWD/archiver cat.egl -i template/v.txt
+if [[ "$($PWD/archiver cat.egl --cat v.txt)" != "short" ]]; then
+    echo "--cat printed a stale copy!"
+    exit 1
+fi
+rm cat.egl
+
+# Потоковый архив: создание в stdout и извлечение из stdin через канал
+echo "streaming an archive through a pipe..."
+rm -rf out
+mkdir out
+$PWD/archiver - -i template/a.txt template/b.txt | (cd out && ../archiver - -e)
+if ! cmp -s template/a.txt out/a.txt || ! cmp -s template/b.txt out/b.txt; then
+    echo "stream round-trip changed the files!"
+    exit 1
+fi
+rm -r out
+
+# Директория вставляется рекурсивно и извлекается с теми же путями
+echo "inserting a directory tree..."
+rm -rf out tree.egl
+mkdir -p template/tree/sub/deep out
+echo "one" > template/tree/1.txt
+echo "two" > template/tree/sub/2.txt
+echo "three" > template/tree/sub/deep/3.txt
+$PWD/archiver tree.egl -i template/tree
+(cd out && ../archiver ../tree.egl -e)
+if ! diff -r template/tree out/tree; then
+    echo "directory tree was not restored!"
+    exit 1
+fi
+rm -r out tree.egl
+
+# Дыры разреженного файла не хранятся в архиве, а после извлечения файл
+# совпадает с исходным побайтно
+echo "round-tripping a sparse file..."
+rm -rf out sparse.egl
+mkdir out
+truncate -s 8M template/sparse.img
+printf 'middle' | dd of=template/sparse.img bs=1 seek=3000000 conv=notrunc \
+    2>/dev/null
+printf 'tail' | dd of=template/sparse.img bs=1 seek=8000000 conv=notrunc \
+    2>/dev/null
+$PWD/archiver sparse.egl -i template/sparse.img
+(cd out && ../archiver ../sparse.egl -e)
+if ! cmp template/sparse.img out/sparse.img; then
+    echo "sparse file changed after round-trip!"
+    exit 1
+fi
+if [[ $(stat -c %s sparse.egl) -ge 1048576 ]]; then
+    echo "holes of the sparse file were stored!"
+    exit 1
+fi
+rm -r out sparse.egl
+
+# -u пропускает неизменившиеся файлы: архив не растет, а изменившийся файл
+# заменяет свою старую копию
+echo "updating an archive with -u..."
+rm -f update.egl
+echo "this is u file" > template/u.txt
+$PWD/archiver update.egl -i template/a.txt template/u.txt
+size=$(stat -c %s update.egl)
+$PWD/archiver update.egl -i -u template/a.txt template/u.txt
+if [[ $(stat -c %s update.egl) -ne $size ]]; then
+    echo "-u re-archived unchanged files!"
+    exit 1
+fi
+echo "this is a changed u file" > template/u.txt
+$PWD/archiver update.egl -i -u template/a.txt template/u.txt
+content=$($PWD/archiver update.egl --cat u.txt)
+if [[ "$content" != "this is a changed u file" ]] \
+    || [[ $($PWD/archiver update.egl -s | grep -c 'u\.txt') -ne 1 ]]; then
+    echo "-u did not replace the changed file!"
+    exit 1
+fi
+rm update.egl
+
+# --grep находит строки в файлах архива и завершается с ошибкой, если
+# совпадений нет
+echo "searching an archive with --grep..."
+rm -f grep.egl
+$PWD/archiver grep.egl -i template/a.txt template/b.txt
+if [[ "$($PWD/archiver grep.egl --grep 'is b')" != "b.txt:1:this is b file" ]]
+then
+    echo "--grep missed a match!"
+    exit 1
+fi
+if $PWD/archiver grep.egl --grep 'no such line' > /dev/null; then
+    echo "--grep reported a match that doesn't exist!"
+    exit 1
+fi
+rm grep.egl
+
+# Писатели одного архива ждут друг друга на flock: пока архив держит чужая
+# блокировка, вставки и переписывание встают в очередь и ничего не теряют
+echo "writing to one archive concurrently..."
+rm -f lock.egl
+$PWD/archiver lock.egl -i template/a.txt
+for i in 1 2 3 4 5 6 7 8; do
+    echo "this is writer $i" > template/w$i.txt
+done
+flock lock.egl sleep 1 &
+sleep 0.2
+for i in 1 2 3 4 5 6 7 8; do
+    $PWD/archiver lock.egl -i template/w$i.txt &
+done
+$PWD/archiver lock.egl --compact -t 0 --rewrite > /dev/null &
+wait
+if ! $PWD/archiver lock.egl -v \
+    || [[ $($PWD/archiver lock.egl -s | grep -c 'w[0-9]\.txt') -ne 8 ]]; then
+    echo "concurrent writers lost data!"
+    exit 1
+fi
+rm lock.egl
+
+# --range: отрицательное начало отсчитывается от конца файла, ДЛИНА
+# ограничивает вывод
+echo "reading ranges with --cat..."
+rm -f range.egl
+$PWD/archiver range.egl -i template/a.txt
+if [[ "$($PWD/archiver range.egl --cat a.txt --range -5)" != "file" ]] \
+    || [[ "$($PWD/archiver range.egl --cat a.txt --range 5:2)" != "is" ]] \
+    || [[ "$($PWD/archiver range.egl --cat a.txt --range -7:2)" != "a " ]]
+then
+    echo "--cat printed a wrong range!"
+    exit 1
+fi
+rm range.egl
+
+# Удаление и оба способа уплотнения: на месте (дыры) и переписыванием.
+# После каждого надгробий не остается, а живые файлы не меняются
+echo "removing and compacting in place and by rewrite..."
+rm -rf out compact.egl
+mkdir out
+seq 1 200000 > template/big.txt
+$PWD/archiver compact.egl -i template/big.txt template/a.txt template/b.txt \
+    template/c.txt
+$PWD/archiver compact.egl -r big.txt b.txt
+$PWD/archiver compact.egl --compact -t 0
+if ! $PWD/archiver compact.egl -v \
+    || $PWD/archiver compact.egl -s | grep -q "Удаленных файлов"; then
+    echo "in-place compact left tombstones or broke files!"
+    exit 1
+fi
+size=$(stat -c %s compact.egl)
+$PWD/archiver compact.egl -r c.txt
+$PWD/archiver compact.egl --compact -t 0 --rewrite
+if ! $PWD/archiver compact.egl -v \
+    || [[ $(stat -c %s compact.egl) -ge $size ]]; then
+    echo "rewrite compact didn't shrink the archive!"
+    exit 1
+fi
+(cd out && ../archiver ../compact.egl -e)
+if [[ "$(ls out)" != "a.txt" ]] || ! cmp -s template/a.txt out/a.txt; then
+    echo "compact changed the live files!"
+    exit 1
+fi
+rm -r out compact.egl
+
 echo "done!"
 
 # ../archiver test.egl -i 
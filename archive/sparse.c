@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * \file sparse.c
+ * Разреженные файлы
+ *
+ * Участки с данными находятся через lseek(SEEK_DATA/SEEK_HOLE), и в архив
+ * пишутся только они, после карты участков:
+ *
+ *     [uint64_t count][sparse_extent...][данные участков подряд]
+ *
+ * Дыры при извлечении не пишутся вовсе: данные пишутся по своим смещениям, а
+ * размер файла выставляется ftruncate, так что дыры остаются дырами. CRC32C
+ * считается по всему содержимому файла, с нулями дыр (crc32c_zeros), и
+ * совпадает с суммой того же файла, сохраненного целиком.
+ */
+
+ssize_t sparse_scan(int fd, uint64_t size, struct sparse_extent** out)
+{
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    if (hole == -1 || (uint64_t)hole >= size)
+        return -1;
+
+    struct sparse_extent* ext = NULL;
+    size_t n = 0, cap = 0;
+    uint64_t pos = 0;
+    while (pos < size)
+    {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1 && errno == ENXIO)
+            break; // дальше только дыра
+        off_t end = data == -1 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (end == -1)
+        {
+            free(ext);
+            return -1;
+        }
+        if ((uint64_t)data >= size)
+            break;
+        if ((uint64_t)end > size)
+            end = size;
+
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            struct sparse_extent* grown = realloc(ext, cap * sizeof(*ext));
+            if (!grown)
+            {
+                free(ext);
+                return -1;
+            }
+            ext = grown;
+        }
+        ext[n++] = (struct sparse_extent) { data, end - data };
+        pos = end;
+    }
+    *out = ext;
+    return n;
+}
+
+int sparse_store_member(int in_fd, struct sparse_extent* ext, size_t n,
+    uint64_t size, int arch_fd, uint64_t off, uint64_t* stored, uint32_t* crc)
+{
+    uint8_t* buf = malloc(COPY_BUFFER_MAX);
+    if (!buf)
+        return ARCHIVE_ENOMEM;
+
+    uint64_t map_size = sizeof(uint64_t) + n * sizeof(struct sparse_extent);
+    uint64_t out = off + map_size, pos = 0;
+    int ret = 0;
+    *crc = 0;
+    for (size_t k = 0; ret == 0 && k < n; ++k)
+    {
+        *crc = crc32c_zeros(*crc, ext[k].offset - pos);
+        uint64_t done = 0;
+        while (done < ext[k].length)
+        {
+            uint64_t left = ext[k].length - done;
+            size_t want = left < COPY_BUFFER_MAX ? left : COPY_BUFFER_MAX;
+            ssize_t r = pread_full(in_fd, buf, want, ext[k].offset + done);
+            if (r == -1 || (r > 0 && pwrite_full(arch_fd, buf, r, out) == -1))
+            {
+                ret = ARCHIVE_EIO;
+                break;
+            }
+            *crc = crc32c(*crc, buf, r);
+            out += r;
+            done += r;
+            if ((size_t)r < want)
+                break;
+        }
+
+        // Если файл успел уменьшиться, в архив идет то, что прочитано, а
+        // остаток до size считается дырой
+        pos = ext[k].offset + done;
+        if (done < ext[k].length)
+        {
+            ext[k].length = done;
+            n = k + 1;
+        }
+    }
+    free(buf);
+    if (ret != 0)
+        return ret;
+    *crc = crc32c_zeros(*crc, size - pos);
+
+    // Карта пишется последней: число участков могло уменьшиться, и данные
+    // тогда сдвигать не нужно - хвост старой карты остается неиспользованным
+    uint64_t count = n;
+    le64_array(&count, 1);
+    le64_array((uint64_t*)ext, 2 * n);
+    int err = pwrite_full(arch_fd, &count, sizeof(count), off) == -1
+        || pwrite_full(arch_fd, ext, n * sizeof(struct sparse_extent),
+               off + sizeof(count))
+            == -1;
+    le64_array((uint64_t*)ext, 2 * n);
+    if (err)
+        return ARCHIVE_EIO;
+    *stored = out - off;
+    return 0;
+}
+
+/**
+ * Читает и проверяет карту участков разреженного файла fi
+ * \param data Куда записать положение данных первого участка в архиве
+ * \return Количество участков или -1, если карта повреждена (или не хватило
+ * памяти)
+ */
+static ssize_t sparse_read_map(const file_info_t* fi, int arch_fd,
+    struct sparse_extent** out, uint64_t* data)
+{
+    uint64_t count;
+    struct sparse_extent* ext;
+    if (fi->stored_size < sizeof(count)
+        || pread_full(arch_fd, &count, sizeof(count), fi->_offset)
+            != sizeof(count))
+        return -1;
+    le64_array(&count, 1);
+    if (count > (fi->stored_size - sizeof(count)) / sizeof(*ext))
+        return -1;
+
+    ext = malloc(count * sizeof(*ext) + 1);
+    size_t size = count * sizeof(*ext);
+    if (!ext
+        || pread_full(arch_fd, ext, size, fi->_offset + sizeof(count))
+            != (ssize_t)size)
+    {
+        free(ext);
+        return -1;
+    }
+    le64_array((uint64_t*)ext, 2 * count);
+
+    // Участки должны идти по возрастанию, не залезать друг на друга и
+    // помещаться и в файл, и в данные записи. Хвост карты может быть не
+    // занят (см. sparse_store_member), поэтому данные лишь не больше
+    uint64_t pos = 0, total = 0;
+    for (uint64_t k = 0; k < count; ++k)
+    {
+        if (ext[k].offset < pos || ext[k].length > fi->filesize
+            || ext[k].offset > fi->filesize - ext[k].length)
+        {
+            free(ext);
+            return -1;
+        }
+        pos = ext[k].offset + ext[k].length;
+        total += ext[k].length;
+    }
+    if (total > fi->stored_size - sizeof(count) - size)
+    {
+        free(ext);
+        return -1;
+    }
+    *data = fi->_offset + fi->stored_size - total;
+    *out = ext;
+    return count;
+}
+
+int sparse_load_member(
+    const file_info_t* fi, int arch_fd, int out_fd, uint32_t* crc)
+{
+    struct sparse_extent* ext;
+    uint64_t in;
+    ssize_t n = sparse_read_map(fi, arch_fd, &ext, &in);
+    uint8_t* buf = n < 0 ? NULL : malloc(COPY_BUFFER_MAX);
+    if (!buf)
+    {
+        if (n >= 0)
+            free(ext);
+        return -1;
+    }
+
+    uint32_t c = 0;
+    uint64_t pos = 0;
+    int ret = 0;
+    for (ssize_t k = 0; ret == 0 && k < n; ++k)
+    {
+        c = crc32c_zeros(c, ext[k].offset - pos);
+        for (uint64_t done = 0; ret == 0 && done < ext[k].length;)
+        {
+            uint64_t left = ext[k].length - done;
+            size_t want = left < COPY_BUFFER_MAX ? left : COPY_BUFFER_MAX;
+            if (pread_full(arch_fd, buf, want, in) != (ssize_t)want
+                || (out_fd != -1
+                    && pwrite_full(out_fd, buf, want, ext[k].offset + done)
+                        == -1))
+                ret = -1;
+            c = crc32c(c, buf, want);
+            in += want;
+            done += want;
+        }
+        pos = ext[k].offset + ext[k].length;
+    }
+    c = crc32c_zeros(c, fi->filesize - pos);
+
+    // Дыры, в том числе в конце файла, появляются сами
+    if (ret == 0 && out_fd != -1 && ftruncate(out_fd, fi->filesize) == -1)
+        ret = -1;
+    free(buf);
+    free(ext);
+    if (crc)
+        *crc = c;
+    return ret;
+}
+
+/**
+ * Добавляет в карту куски участка [off, off + len) не длиннее
+ * SPARSE_PIECE_MAX (orig_len 32-битный). stored_off = UINT64_MAX - дыра
+ * \return Количество кусков; если map = NULL, только считает
+ */
+static size_t sparse_add_pieces(
+    struct piece_map* map, uint64_t off, uint64_t len, uint64_t stored_off)
+{
+    size_t n = 0;
+    for (uint64_t done = 0; done < len; done += SPARSE_PIECE_MAX, ++n)
+    {
+        if (!map)
+            continue;
+        uint64_t left = len - done;
+        struct piece* p = &map->items[map->count++];
+        p->orig_off = off + done;
+        p->orig_len = left < SPARSE_PIECE_MAX ? left : SPARSE_PIECE_MAX;
+        p->hole = stored_off == UINT64_MAX;
+        p->raw = !p->hole;
+        p->stored_off = p->hole ? 0 : stored_off + done;
+        p->stored_len = p->hole ? 0 : p->orig_len;
+    }
+    return n;
+}
+
+struct piece_map* sparse_build_map(const file_info_t* fi, int arch_fd)
+{
+    struct sparse_extent* ext;
+    uint64_t data;
+    ssize_t n = sparse_read_map(fi, arch_fd, &ext, &data);
+    if (n < 0)
+        return NULL;
+
+    // Первый проход считает куски, второй заполняет карту
+    struct piece_map* map = NULL;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        size_t pieces = 0;
+        uint64_t pos = 0, in = data;
+        for (ssize_t k = 0; k < n; ++k)
+        {
+            pieces += sparse_add_pieces(
+                map, pos, ext[k].offset - pos, UINT64_MAX);
+            pieces += sparse_add_pieces(
+                map, ext[k].offset, ext[k].length, in);
+            in += ext[k].length;
+            pos = ext[k].offset + ext[k].length;
+        }
+        pieces += sparse_add_pieces(map, pos, fi->filesize - pos, UINT64_MAX);
+
+        if (pass == 0)
+        {
+            map = malloc(sizeof(struct piece_map)
+                + pieces * sizeof(struct piece));
+            if (!map)
+                break;
+            map->count = 0;
+        }
+    }
+    free(ext);
+    return map;
+}
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * \file stats.c
+ * Статистика работы библиотеки
+ *
+ * Чтобы понять, куда уходит время (чтение каталога, stat, копирование,
+ * fdatasync, rename), не запуская strace, библиотека сама считает время фаз,
+ * системные вызовы с байтами и время копирования каждого файла. Все
+ * счетчики атомарные и общие для процесса; пока сбор выключен, каждая точка
+ * учета - одна проверка флага. Из самых медленных файлов хранятся
+ * STATS_SLOWEST под блокировкой; остальные только добавляются в сумму.
+ *
+ * Время фазы считается в том потоке, который ее ведет, поэтому сумма фаз не
+ * больше общего времени. Время файлов считается в потоках, которые их
+ * копируют, и при нескольких потоках может быть больше общего. Мелкие
+ * файлы, которые идут пачками через io_uring, в файлы не попадают: их время
+ * не отделить друг от друга, видны только вызовы io_uring_enter.
+ */
+
+/**
+ * Медленный файл
+ */
+struct stats_slow
+{
+    char* name;
+    uint64_t bytes;
+    uint64_t ns;
+};
+
+static atomic_char stats_active;
+static atomic_uint_fast64_t stats_started; //!< Начало отсчета, нс
+static atomic_uint_fast64_t phase_ns[STATS_PHASES];
+static atomic_uint_fast64_t counters[STATS_COUNTERS];
+static atomic_uint_fast64_t member_count, member_bytes, member_ns;
+static pthread_mutex_t slow_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_slow slowest[STATS_SLOWEST]; //!< По убыванию времени
+static size_t slow_count;
+
+static const char* phase_names[STATS_PHASES] = {
+    "header",
+    "stat",
+    "copy",
+    "directory",
+    "sync",
+    "rename",
+};
+
+static const char* counter_names[STATS_COUNTERS] = {
+    "read_calls",
+    "read_bytes",
+    "write_calls",
+    "write_bytes",
+    "copy_range_calls",
+    "sendfile_calls",
+    "splice_calls",
+    "kernel_copy_bytes",
+    "uring_enter_calls",
+    "open_calls",
+    "stat_calls",
+    "sync_calls",
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static char active(void)
+{
+    return atomic_load_explicit(&stats_active, memory_order_relaxed);
+}
+
+uint64_t stats_now(void)
+{
+    return active() ? monotonic_ns() : 0;
+}
+
+void stats_phase(enum stats_phase phase, uint64_t start)
+{
+    if (!active() || start == 0)
+        return;
+    atomic_fetch_add_explicit(
+        &phase_ns[phase], monotonic_ns() - start, memory_order_relaxed);
+}
+
+void stats_count(enum stats_counter counter, uint64_t n)
+{
+    if (active())
+        atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+void stats_member(const char* name, uint64_t bytes, uint64_t start)
+{
+    if (!active() || start == 0)
+        return;
+    uint64_t ns = monotonic_ns() - start;
+    atomic_fetch_add_explicit(&member_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&member_bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&member_ns, ns, memory_order_relaxed);
+
+    pthread_mutex_lock(&slow_lock);
+    if (slow_count < STATS_SLOWEST || ns > slowest[slow_count - 1].ns)
+    {
+        char* copy = strdup(name);
+        if (copy)
+        {
+            size_t i = slow_count < STATS_SLOWEST ? slow_count++
+                                                  : slow_count - 1;
+            free(slowest[i].name);
+            for (; i > 0 && slowest[i - 1].ns < ns; --i)
+                slowest[i] = slowest[i - 1];
+            slowest[i] = (struct stats_slow) { copy, bytes, ns };
+        }
+    }
+    pthread_mutex_unlock(&slow_lock);
+}
+
+void archive_stats_reset(void)
+{
+    for (int i = 0; i < STATS_PHASES; ++i)
+        atomic_store(&phase_ns[i], 0);
+    for (int i = 0; i < STATS_COUNTERS; ++i)
+        atomic_store(&counters[i], 0);
+    atomic_store(&member_count, 0);
+    atomic_store(&member_bytes, 0);
+    atomic_store(&member_ns, 0);
+    pthread_mutex_lock(&slow_lock);
+    for (size_t i = 0; i < slow_count; ++i)
+        free(slowest[i].name);
+    memset(slowest, 0, sizeof(slowest));
+    slow_count = 0;
+    pthread_mutex_unlock(&slow_lock);
+    atomic_store(&stats_started, monotonic_ns());
+}
+
+void archive_stats_enable(int on)
+{
+    if (on && !active() && atomic_load(&stats_started) == 0)
+        atomic_store(&stats_started, monotonic_ns());
+    atomic_store(&stats_active, on != 0);
+}
+
+/**
+ * Пишет строку JSON в кавычках, экранируя кавычки, '\' и управляющие символы
+ */
+static void json_string(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s; ++s)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+/**
+ * Скорость в МБ/с (10^6 байт)
+ */
+static double mb_s(uint64_t bytes, uint64_t ns)
+{
+    return ns ? bytes * 1e3 / ns : 0;
+}
+
+int archive_stats_write(int fd)
+{
+    char* text = NULL;
+    size_t len = 0;
+    FILE* f = open_memstream(&text, &len);
+    if (!f)
+        return ARCHIVE_ENOMEM;
+
+    uint64_t started = atomic_load(&stats_started);
+    uint64_t wall = started ? monotonic_ns() - started : 0;
+    fprintf(f, "{\"wall_ms\":%.3f,\"phases_ms\":{", wall / 1e6);
+    for (int i = 0; i < STATS_PHASES; ++i)
+        fprintf(f, "%s\"%s\":%.3f", i ? "," : "", phase_names[i],
+            atomic_load(&phase_ns[i]) / 1e6);
+    fprintf(f, "},\"counters\":{");
+    for (int i = 0; i < STATS_COUNTERS; ++i)
+        fprintf(f, "%s\"%s\":%lu", i ? "," : "", counter_names[i],
+            (unsigned long)atomic_load(&counters[i]));
+
+    uint64_t bytes = atomic_load(&member_bytes), ns = atomic_load(&member_ns);
+    fprintf(f,
+        "},\"members\":{\"count\":%lu,\"bytes\":%lu,\"busy_ms\":%.3f,"
+        "\"mb_s\":%.2f},\"slowest\":[",
+        (unsigned long)atomic_load(&member_count), (unsigned long)bytes,
+        ns / 1e6, mb_s(bytes, ns));
+    pthread_mutex_lock(&slow_lock);
+    for (size_t i = 0; i < slow_count; ++i)
+    {
+        fprintf(f, "%s{\"name\":", i ? "," : "");
+        json_string(f, slowest[i].name);
+        fprintf(f, ",\"bytes\":%lu,\"ms\":%.3f,\"mb_s\":%.2f}",
+            (unsigned long)slowest[i].bytes, slowest[i].ns / 1e6,
+            mb_s(slowest[i].bytes, slowest[i].ns));
+    }
+    pthread_mutex_unlock(&slow_lock);
+    fprintf(f, "]}\n");
+
+    int ret = fclose(f) == 0 ? 0 : ARCHIVE_ENOMEM;
+    // Одна запись, чтобы строки нескольких процессов в общем файле не
+    // перемешивались
+    if (ret == 0 && write_full(fd, text, len) == -1)
+        ret = ARCHIVE_EIO;
+    free(text);
+    return ret;
+}
+
+/**
+ * Включает сбор, если задана STATS_ENV
+ */
+__attribute__((constructor)) static void stats_env_init(void)
+{
+    if (getenv(STATS_ENV))
+        archive_stats_enable(1);
+}
+
+/**
+ * Дописывает статистику в файл из STATS_ENV при выходе из программы (или
+ * выгрузке библиотеки)
+ */
+__attribute__((destructor)) static void stats_env_flush(void)
+{
+    const char* path = getenv(STATS_ENV);
+    if (!path || !active())
+        return;
+    if (*path == '\0' || strcmp(path, "-") == 0 || strcmp(path, "1") == 0)
+    {
+        archive_stats_write(STDERR_FILENO);
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd == -1)
+        return;
+    archive_stats_write(fd);
+    close(fd);
+}
@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \file stream.c
+ * Потоковый архив
+ *
+ * Обычный архив нельзя писать в канал: суперблок в начале файла
+ * перезаписывается последним. Потоковый архив пишется и читается строго
+ * последовательно, за один проход:
+ *
+ *     [stream_head]
+ *     "MEMB" [file_info] [имя] [кадр]... [0: uint32_t] [stream_member_end]
+ *     ...
+ *     "TRLR" [количество: uint64_t] [размер строк: uint64_t] [file_info]...
+ *     [таблица строк] [stream_tail]
+ *
+ * Данные файла режутся на кадры: uint32_t-заголовок (длина кадра, старший
+ * бит LZ_RAW_BLOCK - кадр не сжат) и сами данные. Поэтому размер файла не
+ * нужно знать заранее, а с флагом -c кадры - это блоки LZ, сжатые так же
+ * параллельно, как и в обычном архиве. Сумма и настоящий размер файла идут
+ * после его кадров.
+ *
+ * Имя файла идет сразу за его записью (name_length байт без '\0'). Индекс в
+ * конце устроен как каталог обычного архива: записи всех файлов (в _offset -
+ * положение записи "MEMB" от начала потока) и таблица строк, а stream_tail позволяет найти его с конца, если
+ * поток сохранен в файл. Дедупликация в потоке не поддерживается: чанк
+ * пришлось бы искать в уже отправленных данных.
+ */
+
+/**
+ * Буферизованная запись потока. Ошибка запоминается и проверяется один раз
+ * в конце
+ */
+struct stream_writer
+{
+    int fd;
+    uint8_t* buf;
+    size_t have; //!< Сколько байт ждет в buf
+    uint64_t pos; //!< Сколько байт потока выдано (включая buf)
+    int err; //!< Первая ошибка записи
+};
+
+/**
+ * Буферизованное чтение потока
+ */
+struct stream_reader
+{
+    int fd;
+    uint8_t* buf;
+    size_t pos; //!< Первый непрочитанный байт в buf
+    size_t have; //!< Сколько байт в buf
+};
+
+static void sw_flush(struct stream_writer* w)
+{
+    if (w->err == 0 && w->have && write_full(w->fd, w->buf, w->have) == -1)
+        w->err = ARCHIVE_EIO;
+    w->have = 0;
+}
+
+static void sw_put(struct stream_writer* w, const void* data, size_t n)
+{
+    w->pos += n;
+    if (w->have + n > STREAM_BUFFER_SIZE)
+        sw_flush(w);
+
+    // Крупные кадры идут мимо буфера, чтобы не копировать их лишний раз
+    if (n >= STREAM_BUFFER_SIZE / 2)
+    {
+        sw_flush(w);
+        if (w->err == 0 && write_full(w->fd, data, n) == -1)
+            w->err = ARCHIVE_EIO;
+        return;
+    }
+    memcpy(w->buf + w->have, data, n);
+    w->have += n;
+}
+
+/**
+ * Читает из потока ровно n байт
+ * \return 0, ARCHIVE_EIO или ARCHIVE_EFORMAT, если поток оборвался
+ */
+static int sr_get(struct stream_reader* r, void* dst, size_t n)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        if (r->pos < r->have)
+        {
+            size_t m = r->have - r->pos < n - done ? r->have - r->pos : n - done;
+            memcpy((uint8_t*)dst + done, r->buf + r->pos, m);
+            r->pos += m;
+            done += m;
+            continue;
+        }
+
+        if (n - done >= STREAM_BUFFER_SIZE / 2)
+        {
+            ssize_t k = read_full(r->fd, (uint8_t*)dst + done, n - done);
+            if (k == -1)
+                return ARCHIVE_EIO;
+            return (size_t)k == n - done ? 0 : ARCHIVE_EFORMAT;
+        }
+
+        // Один read: из канала приходит столько, сколько уже есть
+        ssize_t k = read(r->fd, r->buf, STREAM_BUFFER_SIZE);
+        if (k == -1 && errno == EINTR)
+            continue;
+        if (k == -1)
+            return ARCHIVE_EIO;
+        if (k == 0)
+            return ARCHIVE_EFORMAT;
+        r->pos = 0;
+        r->have = k;
+    }
+    return 0;
+}
+
+/**
+ * Пропускает n байт потока
+ * \param buf Буфер на STREAM_FRAME_SIZE байт
+ * \return 0, ARCHIVE_EIO или ARCHIVE_EFORMAT, если поток оборвался
+ */
+static int sr_skip(struct stream_reader* r, uint64_t n, uint8_t* buf)
+{
+    int ret = 0;
+    while (ret == 0 && n)
+    {
+        size_t m = n < STREAM_FRAME_SIZE ? n : STREAM_FRAME_SIZE;
+        ret = sr_get(r, buf, m);
+        n -= m;
+    }
+    return ret;
+}
+
+/**
+ * Пишет в поток данные файла fd кадрами, пока файл не кончится
+ * \param in Буфер на batch * LZ_BLOCK_SIZE (или STREAM_FRAME_SIZE без сжатия)
+ * \param out Буфер того же размера для сжатых блоков
+ * \param fi Запись файла: сюда записываются размер, размер кадров и сумма
+ * \return 0 или ARCHIVE_EIO, если файл не удалось дочитать
+ */
+static int stream_put_data(struct stream_writer* w, int fd, file_info_t* fi,
+    const struct archive_opts* opts, uint8_t* in, uint8_t* out,
+    struct lz_task* tasks, size_t batch)
+{
+    size_t chunk = opts->compress ? batch * LZ_BLOCK_SIZE : STREAM_FRAME_SIZE;
+    uint64_t size = 0, stored = 0;
+    uint32_t crc = 0;
+    int ret = 0;
+    for (;;)
+    {
+        ssize_t r = read_full(fd, in, chunk);
+        if (r == -1)
+            ret = ARCHIVE_EIO;
+        if (r <= 0)
+            break;
+        crc = crc32c(crc, in, r);
+        size += r;
+
+        if (!opts->compress)
+        {
+            uint32_t h = htole32(r | LZ_RAW_BLOCK);
+            sw_put(w, &h, sizeof(h));
+            sw_put(w, in, r);
+            stored += sizeof(h) + r;
+        }
+        else
+        {
+            size_t n = (r + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE;
+            for (size_t k = 0; k < n; ++k)
+            {
+                size_t len = r - k * LZ_BLOCK_SIZE;
+                tasks[k].src = in + k * LZ_BLOCK_SIZE;
+                tasks[k].src_len = len < LZ_BLOCK_SIZE ? len : LZ_BLOCK_SIZE;
+                tasks[k].dst = out + k * LZ_BLOCK_SIZE;
+            }
+            lz_run_batch(tasks, n, 0, opts->jobs);
+
+            for (size_t k = 0; k < n; ++k)
+            {
+                const uint8_t* data = tasks[k].raw ? tasks[k].src : tasks[k].dst;
+                uint32_t len = tasks[k].raw ? tasks[k].src_len : tasks[k].dst_len;
+                uint32_t h = htole32(len | (tasks[k].raw ? LZ_RAW_BLOCK : 0));
+                sw_put(w, &h, sizeof(h));
+                sw_put(w, data, len);
+                stored += sizeof(h) + len;
+            }
+        }
+        if ((size_t)r < chunk)
+            break;
+    }
+
+    // Если файл изменился по ходу чтения, в поток попадает то, что
+    // действительно прочитано: размер и сумма пишутся после данных
+    uint32_t end_frame = 0;
+    sw_put(w, &end_frame, sizeof(end_frame));
+    struct stream_member_end end = { .filesize = htole64(size),
+        .stored_size = htole64(stored),
+        .checksum = htole32(crc) };
+    sw_put(w, &end, sizeof(end));
+
+    fi->filesize = size;
+    fi->stored_size = stored;
+    fi->checksum = crc;
+    return ret;
+}
+
+/**
+ * Пишет в поток один файл path под именем name и добавляет его в индекс
+ * \param fi Запись с заполненными filesize (оценка) и mask
+ * \return 0 или ARCHIVE_ENOMEM. Файлы, которые не удалось прочитать,
+ * сообщаются через opts->report
+ */
+static int stream_put_file(struct stream_writer* w, fi_table_t* index,
+    file_info_t* fi, const char* path, const char* name,
+    const struct archive_opts* opts, uint8_t* in, uint8_t* out,
+    struct lz_task* tasks, size_t batch)
+{
+    fi->name_length = strlen(name);
+    if (fi->name_length >= STREAM_NAME_MAX)
+    {
+        if (opts->report)
+            opts->report(path, ARCHIVE_EINVAL, opts->report_ctx);
+        return 0;
+    }
+    uint64_t started = stats_now();
+    stats_count(STATS_OPEN_CALLS, 1);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        if (opts->report)
+            opts->report(path, ARCHIVE_EIO, opts->report_ctx);
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    fi->flags = FI_CHECKSUM | (opts->compress ? FI_COMPRESSED : 0);
+    fi->_offset = w->pos;
+    file_info_t le = *fi;
+    file_info_le(&le, 1);
+    sw_put(w, STREAM_TAG_MEMBER, STREAM_TAG_SIZE);
+    sw_put(w, &le, sizeof(file_info_t));
+    sw_put(w, name, fi->name_length);
+    if (stream_put_data(w, fd, fi, opts, in, out, tasks, batch)
+        && opts->report)
+    {
+        opts->report(path, ARCHIVE_EIO, opts->report_ctx);
+    }
+    close(fd);
+    stats_member(name, fi->filesize, started);
+
+    return fi_table_push(index, fi, name, NULL) < 0 ? ARCHIVE_ENOMEM : 0;
+}
+
+int archive_stream_write(
+    int out_fd, int fnums, char** fnames, const struct archive_opts* opts)
+{
+    if (opts->dedup || opts->update)
+        return ARCHIVE_EINVAL;
+
+    size_t batch = opts->compress ? opts->jobs * LZ_BATCH_PER_JOB : 1;
+    size_t chunk = opts->compress ? batch * LZ_BLOCK_SIZE : STREAM_FRAME_SIZE;
+    struct stream_writer w = { .fd = out_fd };
+    w.buf = malloc(STREAM_BUFFER_SIZE);
+    uint8_t* in = malloc(chunk);
+    uint8_t* out = opts->compress ? malloc(chunk) : NULL;
+    struct lz_task* tasks = calloc(batch, sizeof(struct lz_task));
+    fi_table_t index;
+    fi_table_init(&index);
+    int ret = w.buf && in && tasks && (out || !opts->compress)
+        ? 0
+        : ARCHIVE_ENOMEM;
+
+    struct stream_head head;
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, STREAM_MAGIC, ARCH_MAGIC_SIZE);
+    head.version = htole32(STREAM_VERSION);
+    if (ret == 0)
+        sw_put(&w, &head, sizeof(head));
+
+    uint64_t started = stats_now();
+    for (int i = 0; ret == 0 && w.err == 0 && i < fnums; ++i)
+    {
+        struct stat st;
+        stats_count(STATS_STAT_CALLS, 1);
+        if (stat(fnames[i], &st) == -1)
+        {
+            if (opts->report)
+                opts->report(fnames[i], ARCHIVE_EIO, opts->report_ctx);
+            continue;
+        }
+        file_info_t fi;
+        memset(&fi, 0, sizeof(file_info_t));
+        if (S_ISDIR(st.st_mode))
+        {
+            // Директория обходится в фоне, пока пишутся уже найденные файлы
+            struct walker* walk;
+            int err = walk_start(&walk, fnames[i], opts);
+            if (err != 0 && opts->report)
+                opts->report(fnames[i], err, opts->report_ctx);
+            struct walk_batch* b;
+            while (err == 0 && ret == 0 && w.err == 0 && (b = walk_next(walk)))
+            {
+                for (size_t k = 0; ret == 0 && k < b->count; ++k)
+                {
+                    memset(&fi, 0, sizeof(file_info_t));
+                    fi.filesize = b->items[k].size; // пока только оценка
+                    fi.mask = b->items[k].mask;
+                    fi.mtime = b->items[k].mtime;
+                    ret = stream_put_file(&w, &index, &fi,
+                        b->arena + b->items[k].path,
+                        b->arena + b->items[k].name, opts, in, out, tasks,
+                        batch);
+                }
+                walk_release(b);
+            }
+            if (err == 0)
+                walk_free(walk);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+        {
+            if (opts->report)
+                opts->report(fnames[i], ARCHIVE_ENOTREG, opts->report_ctx);
+            continue;
+        }
+
+        const char* plain_name = strrchr(fnames[i], '/');
+        plain_name = plain_name ? plain_name + 1 : fnames[i];
+        fi.filesize = st.st_size; // пока только оценка
+        fi.mask = st.st_mode & 0777;
+        fi.mtime = stat_mtime(&st);
+        ret = stream_put_file(&w, &index, &fi, fnames[i], plain_name, opts, in,
+            out, tasks, batch);
+    }
+    stats_phase(STATS_COPY, started);
+
+    if (ret == 0)
+    {
+        struct stream_tail tail = { .trailer_offset = htole64(w.pos) };
+        memcpy(tail.magic, STREAM_MAGIC, ARCH_MAGIC_SIZE);
+        uint64_t count = htole64(index.count);
+        uint64_t names_size = htole64(index.names_size);
+        file_info_le(index.items, index.count);
+        sw_put(&w, STREAM_TAG_TRAILER, STREAM_TAG_SIZE);
+        sw_put(&w, &count, sizeof(count));
+        sw_put(&w, &names_size, sizeof(names_size));
+        sw_put(&w, index.items, index.count * sizeof(file_info_t));
+        sw_put(&w, index.names, index.names_size);
+        sw_put(&w, &tail, sizeof(tail));
+        sw_flush(&w);
+        ret = w.err;
+    }
+    if (ret == 0 && index.count == 0)
+        ret = ARCHIVE_ENOFILES;
+    if (ret == 0)
+        ret = index.count;
+
+    fi_table_free(&index);
+    free(tasks);
+    free(out);
+    free(in);
+    free(w.buf);
+    return ret;
+}
+
+/**
+ * Читает поток, извлекая (extract = 1) или только проверяя файлы
+ * \param stats Куда записать итоги
+ * \return 0 или код ошибки, после которой поток дальше читать нельзя
+ */
+static int stream_read(int in_fd, int fnums, char** fnames,
+    const struct archive_opts* opts, char extract,
+    struct archive_verify_stats* stats)
+{
+    memset(stats, 0, sizeof(struct archive_verify_stats));
+
+    // Имена нужных файлов, чтобы искать их через хеш-индекс
+    fi_table_t wanted;
+    fi_table_init(&wanted);
+    int ret = 0;
+    for (int i = 0; ret == 0 && i < fnums; ++i)
+    {
+        file_info_t fi;
+        memset(&fi, 0, sizeof(file_info_t));
+        if (fi_table_push(&wanted, &fi, fnames[i], NULL) < 0)
+            ret = ARCHIVE_ENOMEM;
+    }
+
+    struct stream_reader r = { .fd = in_fd };
+    r.buf = malloc(STREAM_BUFFER_SIZE);
+    uint8_t* frame = malloc(STREAM_FRAME_SIZE);
+    uint8_t* plain = malloc(LZ_BLOCK_SIZE);
+    if (!r.buf || !frame || !plain)
+        ret = ARCHIVE_ENOMEM;
+
+    struct stream_head head;
+    if (ret == 0)
+        ret = sr_get(&r, &head, sizeof(head));
+    if (ret == 0 && memcmp(head.magic, STREAM_MAGIC, ARCH_MAGIC_SIZE) != 0)
+        ret = ARCHIVE_EFORMAT;
+    if (ret == 0 && le32toh(head.version) != STREAM_VERSION)
+        ret = ARCHIVE_EVERSION;
+
+    uint64_t members = 0;
+    uint64_t started = stats_now();
+    while (ret == 0)
+    {
+        char tag[STREAM_TAG_SIZE];
+        if ((ret = sr_get(&r, tag, STREAM_TAG_SIZE)))
+            break;
+
+        if (memcmp(tag, STREAM_TAG_TRAILER, STREAM_TAG_SIZE) == 0)
+        {
+            // Индекс нужен только для чтения с конца; здесь он лишь
+            // сверяется с тем, что пришло
+            uint64_t count, names_size;
+            struct stream_tail tail;
+            ret = sr_get(&r, &count, sizeof(count));
+            if (ret == 0)
+                ret = sr_get(&r, &names_size, sizeof(names_size));
+            count = le64toh(count);
+            names_size = le64toh(names_size);
+            if (ret == 0 && count != members)
+                ret = ARCHIVE_EFORMAT;
+            for (uint64_t i = 0; ret == 0 && i < count; ++i)
+                ret = sr_skip(&r, sizeof(file_info_t), frame);
+            if (ret == 0)
+                ret = sr_skip(&r, names_size, frame);
+            if (ret == 0)
+                ret = sr_get(&r, &tail, sizeof(tail));
+            if (ret == 0 && memcmp(tail.magic, STREAM_MAGIC, ARCH_MAGIC_SIZE))
+                ret = ARCHIVE_EFORMAT;
+            break;
+        }
+        if (memcmp(tag, STREAM_TAG_MEMBER, STREAM_TAG_SIZE) != 0)
+        {
+            ret = ARCHIVE_EFORMAT;
+            break;
+        }
+
+        file_info_t fi;
+        char name[STREAM_NAME_MAX];
+        if ((ret = sr_get(&r, &fi, sizeof(file_info_t))))
+            break;
+        file_info_le(&fi, 1);
+        if (fi.name_length >= STREAM_NAME_MAX)
+        {
+            ret = ARCHIVE_EFORMAT;
+            break;
+        }
+        if ((ret = sr_get(&r, name, fi.name_length)))
+            break;
+        name[fi.name_length] = '\0';
+        char want = fnums == 0 || fi_table_find(&wanted, name) != -1;
+        uint64_t member_started = stats_now();
+        members++;
+
+        // Файл с опасным именем (абсолютным или с "..") не извлекается и
+        // считается поврежденным
+        int out_fd = -1;
+        char bad = want && extract && !member_name_safe(name);
+        if (want && extract && !bad)
+        {
+            out_fd = create_member_file(name, fi.mask & 0777);
+            if (out_fd == -1 && opts->report)
+                opts->report(name, ARCHIVE_EIO, opts->report_ctx);
+            if (out_fd != -1)
+                fchmod(out_fd, fi.mask & 0777);
+        }
+
+        uint32_t crc = 0;
+        uint64_t size = 0;
+        for (;;)
+        {
+            uint32_t h;
+            if ((ret = sr_get(&r, &h, sizeof(h))) || h == 0)
+                break;
+            h = le32toh(h);
+
+            size_t len = h & ~LZ_RAW_BLOCK;
+            if (len > ((h & LZ_RAW_BLOCK) ? STREAM_FRAME_SIZE : LZ_BLOCK_SIZE))
+            {
+                ret = ARCHIVE_EFORMAT;
+                break;
+            }
+            if ((ret = sr_get(&r, frame, len)))
+                break;
+            if (!want)
+                continue;
+
+            const uint8_t* data = frame;
+            if (!(h & LZ_RAW_BLOCK))
+            {
+                ssize_t d = lz_decompress(frame, len, plain, LZ_BLOCK_SIZE);
+                if (d < 0)
+                {
+                    bad = 1;
+                    continue;
+                }
+                data = plain;
+                len = d;
+            }
+            crc = crc32c(crc, data, len);
+            size += len;
+            if (out_fd != -1 && write_full(out_fd, data, len) == -1)
+                bad = 1;
+        }
+
+        struct stream_member_end end;
+        if (ret == 0)
+            ret = sr_get(&r, &end, sizeof(end));
+        if (out_fd != -1)
+            close(out_fd);
+        if (ret != 0 || !want)
+            continue;
+
+        stats_member(name, size, member_started);
+        stats->checked++;
+        if (bad || le32toh(end.checksum) != crc
+            || le64toh(end.filesize) != size)
+        {
+            stats->failed++;
+            if (opts->report)
+                opts->report(name, ARCHIVE_ECORRUPT, opts->report_ctx);
+        }
+    }
+
+    stats_phase(STATS_COPY, started);
+    free(plain);
+    free(frame);
+    free(r.buf);
+    fi_table_free(&wanted);
+    return ret;
+}
+
+int archive_stream_extract(
+    int in_fd, int fnums, char** fnames, const struct archive_opts* opts)
+{
+    struct archive_verify_stats stats;
+    int ret = stream_read(in_fd, fnums, fnames, opts, 1, &stats);
+    return ret ? ret : (int)stats.failed;
+}
+
+int archive_stream_verify(int in_fd, int fnums, char** fnames,
+    const struct archive_opts* opts, struct archive_verify_stats* stats)
+{
+    return stream_read(in_fd, fnums, fnames, opts, 0, stats);
+}
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * \file uring.c
+ * Пакетный ввод-вывод мелких файлов через io_uring
+ *
+ * Кольца настраиваются напрямую системными вызовами io_uring_setup и
+ * io_uring_enter, без liburing. Работа над пачкой файлов идет фазами: в
+ * каждой фазе одна и та же операция (открыть, прочитать, записать, закрыть)
+ * ставится сразу для всех файлов пачки, и все они отправляются и
+ * дожидаются одним io_uring_enter. Так на пачку из URING_BATCH файлов
+ * приходится несколько системных вызовов вместо нескольких на каждый файл.
+ */
+
+int uring_init(struct uring* r, unsigned entries)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    const char* env = getenv(URING_ENV);
+    if (env && strcmp(env, "0") == 0)
+        return -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd == -1)
+        return -1;
+
+    // OPENAT, READ, WRITE и CLOSE появились вместе с IORING_FEAT_RW_CUR_POS
+    // (5.6); одно кольцо на SQ и CQ - тогда же (5.4)
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)
+        || !(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(fd);
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size
+        = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->ring == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        munmap(r->ring, r->ring_size);
+        close(fd);
+        return -1;
+    }
+
+    char* ring = r->ring;
+    r->sq_head = (unsigned*)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned*)(ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned*)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(ring + p.sq_off.array);
+    r->cq_head = (unsigned*)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned*)(ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+    r->entries = p.sq_entries;
+    r->fd = fd;
+    return 0;
+}
+
+void uring_free(struct uring* r)
+{
+    if (r->fd == -1)
+        return;
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->ring, r->ring_size);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/**
+ * Ставит операцию op над файлом i пачки f в очередь отправки (место в
+ * очереди должно быть)
+ */
+static void uring_prep(struct uring* r, struct small_file* f, size_t i,
+    enum uring_op op, int arch_fd)
+{
+    unsigned tail = *r->sq_tail + r->queued;
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)i << URING_OP_BITS | op;
+
+    switch (op)
+    {
+    case URING_OPEN_READ:
+    case URING_OPEN_CREATE:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)f[i].path;
+        sqe->open_flags = op == URING_OPEN_READ
+            ? O_RDONLY | O_CLOEXEC
+            : O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC;
+        sqe->len = f[i].mask;
+        break;
+    case URING_READ_FILE:
+    case URING_READ_ARCH:
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = op == URING_READ_FILE ? f[i].fd : arch_fd;
+        sqe->addr = (uintptr_t)f[i].buf;
+        sqe->len = f[i].size;
+        sqe->off = op == URING_READ_FILE ? 0 : f[i].off;
+        break;
+    case URING_WRITE_FILE:
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = f[i].fd;
+        sqe->addr = (uintptr_t)f[i].buf;
+        sqe->len = f[i].size;
+        sqe->off = 0;
+        break;
+    case URING_CLOSE:
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = f[i].fd;
+        break;
+    }
+    r->sq_array[idx] = idx;
+    r->queued++;
+}
+
+/**
+ * Разбирает результат операции
+ */
+static void uring_complete(struct small_file* f, enum uring_op op, int res)
+{
+    if (res < 0)
+    {
+        if (op == URING_CLOSE)
+        {
+            f->fd = -1;
+            return;
+        }
+        f->err = -res;
+        f->failed_op = op;
+        return;
+    }
+
+    switch (op)
+    {
+    case URING_OPEN_READ:
+    case URING_OPEN_CREATE:
+        f->fd = res;
+        break;
+    case URING_READ_FILE:
+        // Файл мог уменьшиться с момента stat: в архив идет прочитанное
+        f->size = res;
+        break;
+    case URING_READ_ARCH:
+        if ((uint32_t)res != f->size)
+        {
+            f->err = EIO;
+            f->failed_op = op;
+        }
+        break;
+    case URING_WRITE_FILE:
+        // Короткая запись в обычный файл - редкость, дописываем обычным путем
+        if ((uint32_t)res != f->size
+            && pwrite_full(f->fd, f->buf + res, f->size - res, res) == -1)
+        {
+            f->err = errno;
+            f->failed_op = op;
+        }
+        break;
+    case URING_CLOSE:
+        f->fd = -1;
+        break;
+    }
+}
+
+/**
+ * Отправляет все поставленные операции и дожидается их завершения
+ * \return 0 или -1, если io_uring_enter не удался
+ */
+static int uring_flush(struct uring* r, struct small_file* f)
+{
+    if (r->queued == 0)
+        return 0;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + r->queued, __ATOMIC_RELEASE);
+    unsigned submit = r->queued, wait = r->queued;
+    r->queued = 0;
+
+    while (wait > 0)
+    {
+        int ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        stats_count(STATS_URING_ENTER_CALLS, 1);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1)
+            return -1;
+        submit -= ret;
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, --wait)
+        {
+            const struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+            uring_complete(&f[cqe->user_data >> URING_OP_BITS],
+                cqe->user_data & ((1 << URING_OP_BITS) - 1), cqe->res);
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * Выполняет фазу: операции ops для всех файлов пачки, где до сих пор не
+ * было ошибок. Если пачка не помещается в кольцо, отправляется частями
+ * \return 0 или -1
+ */
+static int uring_phase(
+    struct uring* r, struct small_file* f, size_t n, unsigned ops, int arch_fd)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        for (unsigned op = 1; op < 1u << URING_OP_BITS; op <<= 1)
+        {
+            if (!(ops & op) || f[i].err)
+                continue;
+            if (r->queued == r->entries && uring_flush(r, f) == -1)
+                return -1;
+            uring_prep(r, f, i, op, arch_fd);
+        }
+    }
+    return uring_flush(r, f);
+}
+
+/**
+ * Закрывает все дескрипторы пачки, оставшиеся открытыми
+ */
+static int uring_close_all(struct uring* r, struct small_file* f, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (f[i].fd == -1)
+            continue;
+        if (r->queued == r->entries && uring_flush(r, f) == -1)
+            return -1;
+        uring_prep(r, f, i, URING_CLOSE, -1);
+    }
+    return uring_flush(r, f);
+}
+
+int uring_load_files(struct uring* r, struct small_file* f, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        f[i].fd = -1;
+        f[i].err = 0;
+    }
+    int ret = uring_phase(r, f, n, URING_OPEN_READ, -1);
+    if (ret == 0)
+        ret = uring_phase(r, f, n, URING_READ_FILE, -1);
+    if (uring_close_all(r, f, n) == -1)
+        ret = -1;
+
+    for (size_t i = 0; ret == -1 && i < n; ++i)
+    {
+        if (f[i].fd != -1)
+            close(f[i].fd);
+        f[i].fd = -1;
+    }
+    return ret;
+}
+
+int uring_store_files(
+    struct uring* r, struct small_file* f, size_t n, int arch_fd)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        f[i].fd = -1;
+        f[i].err = 0;
+    }
+    int ret = uring_phase(r, f, n, URING_READ_ARCH | URING_OPEN_CREATE, arch_fd);
+
+    // У io_uring нет fchmod. Права ставятся всегда, как в extract_member:
+    // O_CREAT не трогает права уже существующего файла
+    for (size_t i = 0; ret == 0 && i < n; ++i)
+    {
+        if (f[i].fd != -1)
+            fchmod(f[i].fd, f[i].mask);
+    }
+    if (ret == 0)
+        ret = uring_phase(r, f, n, URING_WRITE_FILE, -1);
+    if (uring_close_all(r, f, n) == -1)
+        ret = -1;
+
+    for (size_t i = 0; ret == -1 && i < n; ++i)
+    {
+        if (f[i].fd != -1)
+            close(f[i].fd);
+        f[i].fd = -1;
+    }
+    return ret;
+}
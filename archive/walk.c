@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include "archiver_impl.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \file walk.c
+ * Параллельный обход дерева директорий для вставки
+ *
+ * Несколько потоков разбирают общий стек директорий: поток открывает
+ * директорию, читает ее записи и для каждой делает fstatat относительно
+ * дескриптора директории, а поддиректории кладет обратно в стек, сразу
+ * открыв их через openat (пока открытых директорий в стеке не больше
+ * WALK_MAX_OPEN_DIRS; остальные потом открываются по пути). Найденные
+ * регулярные файлы складываются в пачки (walk_batch), которые по мере
+ * готовности забирает вызывающий поток - он тем временем копирует данные
+ * предыдущих пачек в архив.
+ */
+
+/**
+ * Директория, ждущая обхода
+ */
+struct walk_dir
+{
+    int fd; //!< Открытый дескриптор или -1 - открыть по пути
+    char* path; //!< Путь (для open, сообщений и путей файлов)
+};
+
+/**
+ * Состояние обхода. Все поля, кроме неизменных после walk_start, защищены
+ * lock
+ */
+struct walker
+{
+    pthread_mutex_t lock;
+    pthread_cond_t dirs_cond; //!< Появилась директория или обход кончился
+    pthread_cond_t ready_cond; //!< Появилась пачка или обход кончился
+    struct walk_dir* dirs; //!< Стек директорий
+    size_t ndirs;
+    size_t dirs_cap;
+    size_t busy; //!< Потоков, которые сейчас читают директорию
+    size_t open_dirs; //!< Открытых дескрипторов в стеке
+    struct walk_batch* ready; //!< Готовые пачки (очередь)
+    struct walk_batch* ready_tail;
+    char done; //!< Стек пуст и никто не занят - обход закончен
+    char stop; //!< Вызывающий больше не ждет пачек
+    size_t name_off; //!< С какого байта пути начинается имя в архиве
+    const struct archive_opts* opts;
+    pthread_t* threads;
+    int nthreads;
+};
+
+static void walk_report(struct walker* w, const char* path, int err)
+{
+    if (w->opts && w->opts->report)
+        w->opts->report(path, err, w->opts->report_ctx);
+}
+
+/**
+ * Добавляет к пачке файл path размера size
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+static int batch_push(struct walk_batch* b, const char* path, size_t name_off,
+    const struct stat* st)
+{
+    size_t len = strlen(path) + 1;
+    if (b->arena_size + len > b->arena_cap)
+    {
+        size_t cap = b->arena_cap ? b->arena_cap * 2 : 4096;
+        while (cap < b->arena_size + len)
+            cap *= 2;
+        char* arena = realloc(b->arena, cap);
+        if (!arena)
+            return ARCHIVE_ENOMEM;
+        b->arena = arena;
+        b->arena_cap = cap;
+    }
+    struct walk_entry* e = &b->items[b->count++];
+    e->path = b->arena_size;
+    e->name = b->arena_size + name_off;
+    e->size = st->st_size;
+    e->mask = st->st_mode & 0777;
+    e->mtime = stat_mtime(st);
+    memcpy(b->arena + b->arena_size, path, len);
+    b->arena_size += len;
+    return 0;
+}
+
+/**
+ * Отдает пачку вызывающему потоку (пустую - освобождает)
+ */
+static void batch_publish(struct walker* w, struct walk_batch* b)
+{
+    if (b->count == 0)
+    {
+        walk_release(b);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    if (w->ready_tail)
+        w->ready_tail->next = b;
+    else
+        w->ready = b;
+    w->ready_tail = b;
+    pthread_cond_signal(&w->ready_cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Кладет директорию в стек. Если открытых директорий в стеке немного, она
+ * открывается сразу относительно родителя
+ * \return 0 или ARCHIVE_ENOMEM
+ */
+static int push_dir(struct walker* w, int parent_fd, const char* name,
+    const char* path)
+{
+    char* copy = strdup(path);
+    if (!copy)
+        return ARCHIVE_ENOMEM;
+
+    pthread_mutex_lock(&w->lock);
+    char open_now = w->open_dirs < WALK_MAX_OPEN_DIRS;
+    w->open_dirs += open_now;
+    pthread_mutex_unlock(&w->lock);
+
+    int fd = -1;
+    if (open_now)
+    {
+        stats_count(STATS_OPEN_CALLS, 1);
+        fd = openat(parent_fd, name,
+            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&w->lock);
+    if (open_now && fd == -1)
+        w->open_dirs--;
+    if (w->ndirs == w->dirs_cap)
+    {
+        size_t cap = w->dirs_cap ? w->dirs_cap * 2 : 64;
+        struct walk_dir* dirs = realloc(w->dirs, cap * sizeof(*dirs));
+        if (dirs)
+        {
+            w->dirs = dirs;
+            w->dirs_cap = cap;
+        }
+        else
+        {
+            ret = ARCHIVE_ENOMEM;
+        }
+    }
+    if (ret == 0)
+    {
+        w->dirs[w->ndirs++] = (struct walk_dir) { fd, copy };
+        pthread_cond_signal(&w->dirs_cond);
+    }
+    else if (fd != -1)
+    {
+        w->open_dirs--;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (ret != 0)
+    {
+        if (fd != -1)
+            close(fd);
+        free(copy);
+    }
+    return ret;
+}
+
+/**
+ * Читает одну директорию: файлы - в пачки, поддиректории - в стек
+ */
+static void scan_dir(struct walker* w, struct walk_dir* d)
+{
+    char held = d->fd != -1;
+    stats_count(STATS_OPEN_CALLS, !held);
+    int fd = held ? d->fd
+                  : open(d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+                          | O_CLOEXEC);
+    DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+    if (!dir)
+    {
+        walk_report(w, d->path, ARCHIVE_EIO);
+        if (fd != -1)
+            close(fd);
+    }
+
+    // Путь к записи собирается в одном буфере: путь директории, '/', имя
+    size_t plen = strlen(d->path);
+    char* path = malloc(plen + 1 + NAME_MAX + 1);
+    struct walk_batch* b = calloc(1, sizeof(struct walk_batch));
+    if (dir && (!path || !b))
+        walk_report(w, d->path, ARCHIVE_ENOMEM);
+    if (path)
+    {
+        memcpy(path, d->path, plen);
+        path[plen] = '/';
+    }
+
+    struct dirent* de;
+    while (dir && path && b && !w->stop && (de = readdir(dir)))
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        size_t nlen = strlen(de->d_name);
+        memcpy(path + plen + 1, de->d_name, nlen + 1);
+
+        // Для директорий размер не нужен, поэтому fstatat делается, только
+        // если без него не обойтись
+        struct stat st;
+        unsigned char type = de->d_type;
+        if (type == DT_REG || type == DT_UNKNOWN)
+        {
+            stats_count(STATS_STAT_CALLS, 1);
+            if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW)
+                == -1)
+            {
+                walk_report(w, path, ARCHIVE_EIO);
+                continue;
+            }
+            type = S_ISREG(st.st_mode) ? DT_REG
+                : S_ISDIR(st.st_mode)  ? DT_DIR
+                                       : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR)
+        {
+            if (push_dir(w, dirfd(dir), de->d_name, path))
+                walk_report(w, path, ARCHIVE_ENOMEM);
+        }
+        else if (type != DT_REG)
+        {
+            walk_report(w, path, ARCHIVE_ENOTREG);
+        }
+        else if (batch_push(b, path, w->name_off, &st))
+        {
+            walk_report(w, path, ARCHIVE_ENOMEM);
+        }
+        else if (b->count == WALK_BATCH_SIZE)
+        {
+            batch_publish(w, b);
+            b = calloc(1, sizeof(struct walk_batch));
+            if (!b)
+                walk_report(w, d->path, ARCHIVE_ENOMEM);
+        }
+    }
+
+    if (b)
+        batch_publish(w, b);
+    free(path);
+    if (dir)
+        closedir(dir);
+    if (held)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->open_dirs--;
+        pthread_mutex_unlock(&w->lock);
+    }
+    free(d->path);
+}
+
+static void* walk_worker(void* arg)
+{
+    struct walker* w = arg;
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (w->ndirs == 0 && w->busy > 0 && !w->stop)
+            pthread_cond_wait(&w->dirs_cond, &w->lock);
+        if (w->ndirs == 0 || w->stop)
+            break;
+
+        struct walk_dir d = w->dirs[--w->ndirs];
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+        scan_dir(w, &d);
+        pthread_mutex_lock(&w->lock);
+        w->busy--;
+    }
+
+    // Кто первым увидел пустой стек без занятых потоков, будит остальных
+    if (!w->done)
+    {
+        w->done = 1;
+        pthread_cond_broadcast(&w->dirs_cond);
+        pthread_cond_broadcast(&w->ready_cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+int walk_start(struct walker** out, const char* root,
+    const struct archive_opts* opts)
+{
+    struct walker* w = calloc(1, sizeof(struct walker));
+    if (!w)
+        return ARCHIVE_ENOMEM;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->dirs_cond, NULL);
+    pthread_cond_init(&w->ready_cond, NULL);
+    w->opts = opts;
+
+    // Имена в архиве начинаются с последнего компонента root: для "a/b/src"
+    // это "src/...". У ".", ".." и "/" такого компонента нет, и в архив
+    // попадают пути внутри root
+    char* path = strdup(root);
+    if (!path)
+    {
+        walk_free(w);
+        return ARCHIVE_ENOMEM;
+    }
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+        path[--len] = '\0';
+    char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0)
+        w->name_off = len + 1;
+    else
+        w->name_off = base - path;
+
+    int fd = open(len ? path : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        free(path);
+        walk_free(w);
+        return ARCHIVE_EIO;
+    }
+    w->dirs = malloc(64 * sizeof(struct walk_dir));
+    if (!w->dirs)
+    {
+        close(fd);
+        free(path);
+        walk_free(w);
+        return ARCHIVE_ENOMEM;
+    }
+    w->dirs_cap = 64;
+    w->dirs[w->ndirs++] = (struct walk_dir) { fd, path };
+    w->open_dirs = 1;
+
+    int jobs = opts->jobs > WALK_MIN_JOBS ? opts->jobs : WALK_MIN_JOBS;
+    w->threads = malloc(jobs * sizeof(pthread_t));
+    for (int i = 0; w->threads && i < jobs; ++i)
+    {
+        if (pthread_create(&w->threads[i], NULL, walk_worker, w) != 0)
+            break;
+        w->nthreads++;
+    }
+
+    // Без потоков дерево обходится сразу, целиком
+    if (w->nthreads == 0)
+        walk_worker(w);
+    *out = w;
+    return 0;
+}
+
+struct walk_batch* walk_next(struct walker* w)
+{
+    pthread_mutex_lock(&w->lock);
+    while (!w->ready && !w->done)
+        pthread_cond_wait(&w->ready_cond, &w->lock);
+    struct walk_batch* b = w->ready;
+    if (b)
+    {
+        w->ready = b->next;
+        if (!w->ready)
+            w->ready_tail = NULL;
+        b->next = NULL;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return b;
+}
+
+void walk_release(struct walk_batch* b)
+{
+    if (!b)
+        return;
+    free(b->arena);
+    free(b);
+}
+
+void walk_free(struct walker* w)
+{
+    if (!w)
+        return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->dirs_cond);
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 0; i < w->nthreads; ++i)
+        pthread_join(w->threads[i], NULL);
+    free(w->threads);
+
+    for (size_t i = 0; i < w->ndirs; ++i)
+    {
+        if (w->dirs[i].fd != -1)
+            close(w->dirs[i].fd);
+        free(w->dirs[i].path);
+    }
+    free(w->dirs);
+    while (w->ready)
+    {
+        struct walk_batch* b = w->ready;
+        w->ready = b->next;
+        walk_release(b);
+    }
+    pthread_cond_destroy(&w->ready_cond);
+    pthread_cond_destroy(&w->dirs_cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <linux/limits.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -54,38 +56,60 @@ enum ERRCODES
 //     };
 // };
 
+// directory entry together with its metadata, filled once while reading the
+// directory. The name lives in the arena
+struct ls_entry
+{
+    const char *name;
+    size_t name_len;
+    struct statx st;
+};
+
+// block of the bump allocator for names; blocks are never moved, so names
+// stay valid until exit
+struct arena_block
+{
+    struct arena_block *next;
+    size_t used;
+    size_t cap;
+    char data[];
+};
+
 const int _COL_CODES[] = {39, 34, 32, 36};
 
 const char * const _OPLIST = "hla";
 const char * const _RWX = "rwx";
-const char * _prefix = NULL;
 
-const int _PATH_SIZE = 4048;
-char * _path = NULL;
+// statx fields needed by the short and the long output formats
+const unsigned _SHORT_MASK = STATX_TYPE | STATX_MODE;
+const unsigned _LONG_MASK = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID
+    | STATX_GID | STATX_SIZE | STATX_MTIME | STATX_BLOCKS;
+
+// getdents64 buffer: a few large syscalls even for huge directories
+const size_t _DENTS_BUF_SIZE = 1 << 20;
+const size_t _ARENA_BLOCK_SIZE = 1 << 20;
 
-DIR *_dir = NULL;
+int _dir_fd = -1;
+struct arena_block *_arena = NULL;
 size_t _files_list_size = 0;
+size_t _files_list_cap = 0;
 size_t _hidden_files_list_size = 0;
 size_t _blocks = 0;
-struct dirent ** _files_list = NULL;
+struct ls_entry * _files_list = NULL;
 int flags = 0;  // bitwise OR of the flags from LS_ARGS
 
 void _list_routine(const char *dir);
 void _close_dir_at_exit();
-void _print_file(struct dirent* file);
+void _print_file(const struct ls_entry* file);
 void _invoke_error(enum ERRCODES);
-void _my_ls_init();
-void _free_path_at_exit();
-void _prepare_path(const char * file);
 void _prepare_files_list();
 void _free_files_list_at_exit();
-int _dirent_cmp(const void* a, const void* b);
+int _entry_cmp(const void* a, const void* b);
+const char *_arena_copy(const char *str, size_t len);
 
 
 int main(int argc, char **argv)
 {
-    _my_ls_init();
-
     // --- option parser ---
     opterr = 0; // don't print error from getopt()
     int option;
@@ -129,19 +153,15 @@ int main(int argc, char **argv)
 
 void _list_routine(const char *dir)
 {
-    _dir = opendir(dir); 
-    if (_dir == NULL)
+    _dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (_dir_fd == -1)
     {
         _invoke_error(ERR_OPENDIR);
     }
 
     atexit(_close_dir_at_exit);
 
-    _prefix = dir;
-
     // scanning directories
-    errno = 0; // for detecting error in readdir()
-
     _prepare_files_list();
     if (flags & LS_LONG)
     {
@@ -150,7 +170,7 @@ void _list_routine(const char *dir)
 
     for (size_t i = 0; i < _files_list_size; ++i)
     {
-        _print_file(_files_list[i]);
+        _print_file(&_files_list[i]);
     }
 
     // after printing files without LS_LONG flag there is no '\n' at the end of
@@ -161,47 +181,36 @@ void _list_routine(const char *dir)
     }
 }
 
-void _print_file(struct dirent *file)
+void _print_file(const struct ls_entry *file)
 {
-    if (file->d_name[0] == '.' && !(flags & LS_ALL))
-    {
-        return;
-    }
-
-    _prepare_path(file->d_name);
-
+    // hidden files are not even in the list without LS_ALL
     enum COLORS filename_color = COL_FILE;
-    struct stat file_info;
-    if (lstat(_path, &file_info) == -1) 
-    {
-        // printf("%s\n", _path);
-        _invoke_error(ERR_STAT);
-    }
+    const struct statx *file_info = &file->st;
 
 
     if (flags & LS_LONG) // long output
     {
         // type of the file
 
-        if (S_ISREG(file_info.st_mode))
+        if (S_ISREG(file_info->stx_mode))
         {
             putchar('-');
             // check whether the file is executable
-            if (file_info.st_mode & S_IXUSR)
+            if (file_info->stx_mode & S_IXUSR)
             {
                 filename_color = COL_EXEC;
             }
         }
-        else if (S_ISDIR(file_info.st_mode))
+        else if (S_ISDIR(file_info->stx_mode))
         {
             putchar('d');
             filename_color = COL_DIR;
         }
-        else if (S_ISBLK(file_info.st_mode))
+        else if (S_ISBLK(file_info->stx_mode))
         {
             putchar('b');
         }
-        else if (S_ISLNK(file_info.st_mode))
+        else if (S_ISLNK(file_info->stx_mode))
         {
             putchar('l');
             filename_color = COL_LN;
@@ -216,12 +225,12 @@ void _print_file(struct dirent *file)
         int i = 0;
         for (uint64_t mask = S_IRUSR; mask > 0; mask >>= 1, i++)
         {
-            putchar(file_info.st_mode & mask ? _RWX[i%3] : '-');
+            putchar(file_info->stx_mode & mask ? _RWX[i%3] : '-');
         }
         putchar(' ');
 
         errno = 0;
-        struct passwd *pwd_file = getpwuid(file_info.st_uid);
+        struct passwd *pwd_file = getpwuid(file_info->stx_uid);
         if (pwd_file == NULL && errno)
         {
             _invoke_error(ERR_PWD);
@@ -229,14 +238,14 @@ void _print_file(struct dirent *file)
 
         // valgrind reports about a memory leak here 
         errno = 0;
-        struct group *grp_file = getgrgid(file_info.st_gid);
+        struct group *grp_file = getgrgid(file_info->stx_gid);
         if (grp_file == NULL && errno)
         {
             _invoke_error(ERR_PWD);
         }
 
         // hard links, groups, size
-        printf("%lu ", file_info.st_nlink);
+        printf("%u ", file_info->stx_nlink);
 
         if (pwd_file)
         {
@@ -244,7 +253,7 @@ void _print_file(struct dirent *file)
         }
         else
         {
-            printf("%d ", file_info.st_uid);
+            printf("%d ", file_info->stx_uid);
 
         }
 
@@ -254,12 +263,13 @@ void _print_file(struct dirent *file)
         }
         else
         {
-            printf("%d ", file_info.st_gid);
+            printf("%d ", file_info->stx_gid);
         }
-        printf("%lu ", file_info.st_size);
+        printf("%llu ", (unsigned long long)file_info->stx_size);
 
         // time
-        char* time_str = ctime(&file_info.st_mtim.tv_sec);
+        time_t mtime = file_info->stx_mtime.tv_sec;
+        char* time_str = ctime(&mtime);
         char output_time_str[13];
         strncpy(output_time_str, time_str + 4, 12); 
         output_time_str[12] = '\0';
@@ -267,27 +277,27 @@ void _print_file(struct dirent *file)
 
         // name 
         // filename: "several words" -> `several words`
-        if (strchr(file->d_name, ' ') != NULL)
+        if (memchr(file->name, ' ', file->name_len) != NULL)
         {
             printf("\x1b[;%dm`%s`\x1b[0m", _COL_CODES[filename_color],
-                   file->d_name);
+                   file->name);
         }
         else
         {
             printf("\x1b[;%dm%s\x1b[0m", _COL_CODES[filename_color],
-                   file->d_name);
+                   file->name);
         }
 
-        if (S_ISLNK(file_info.st_mode))
+        if (S_ISLNK(file_info->stx_mode))
         {
             size_t bufsize
-                = file_info.st_size + 1 ? file_info.st_size + 1 : PATH_MAX;
+                = file_info->stx_size + 1 ? file_info->stx_size + 1 : PATH_MAX;
             char* buf = malloc(bufsize);
             if (!buf)
             {
                 _invoke_error(ERR_STAT);
             }
-            int a = readlink(_path, buf, bufsize);
+            int a = readlinkat(_dir_fd, file->name, buf, bufsize);
             if (a == -1)
             {
                 _invoke_error(ERR_STAT);
@@ -301,34 +311,34 @@ void _print_file(struct dirent *file)
     }
     else // short output
     {
-        if (S_ISREG(file_info.st_mode) && (file_info.st_mode & S_IXUSR))
+        if (S_ISREG(file_info->stx_mode) && (file_info->stx_mode & S_IXUSR))
         {
             filename_color = COL_EXEC;
         }
-        else if (S_ISDIR(file_info.st_mode))
+        else if (S_ISDIR(file_info->stx_mode))
         {
             filename_color = COL_DIR;
         }
-        else if (S_ISLNK(file_info.st_mode))
+        else if (S_ISLNK(file_info->stx_mode))
         {
             filename_color = COL_LN;
         }
 
         // filename: "several words" -> `several words`
-        if (strchr(file->d_name, ' ') != NULL)
+        if (memchr(file->name, ' ', file->name_len) != NULL)
         {
             printf("\x1b[;%dm`%s`\x1b[0m  ", _COL_CODES[filename_color],
-                   file->d_name);
+                   file->name);
         }
         else
         {
             printf("\x1b[;%dm%s\x1b[0m  ", _COL_CODES[filename_color],
-                   file->d_name);
+                   file->name);
         }
     }
 }
 
-void _close_dir_at_exit() { closedir(_dir); }
+void _close_dir_at_exit() { close(_dir_fd); }
 
 void _invoke_error(enum ERRCODES err)
 {
@@ -375,67 +385,113 @@ void _invoke_error(enum ERRCODES err)
     exit(EXIT_FAILURE);
 }
 
-void _my_ls_init()
-{
-    _path = (char *)malloc(_PATH_SIZE);
-    atexit(_free_path_at_exit);
-}
-
-void _free_path_at_exit() { free(_path); }
-
-void _prepare_path(const char * file)
-{
-    _path[0] = '\0';
-    strcat(_path, _prefix);
-    strcat(_path, "/");
-    strcat(_path, file);
-}
-
+// single pass over the directory with getdents64: every shown entry is
+// stat'ed once, relative to the directory fd, and only for the fields the
+// output needs. Names are copied to the arena, because the buffer is reused
 void _prepare_files_list()
 {
-    errno = 0;
-    for (struct dirent *cur_file; (cur_file = readdir(_dir)) != NULL;
-         _files_list_size++)
+    atexit(_free_files_list_at_exit);
+    unsigned mask = flags & LS_LONG ? _LONG_MASK : _SHORT_MASK;
+    char *buf = (char *)malloc(_DENTS_BUF_SIZE);
+    if (!buf)
     {
-        if (cur_file->d_name[0] == '.')
-        {
-            _hidden_files_list_size++;
-        }
+        _invoke_error(ERR_READDIR);
+    }
 
-        struct stat temp;
-        _prepare_path(cur_file->d_name);
-        if (lstat(_path, &temp) == -1)
+    ssize_t n;
+    while ((n = getdents64(_dir_fd, buf, _DENTS_BUF_SIZE)) > 0)
+    {
+        for (ssize_t pos = 0; pos < n;)
         {
-            _invoke_error(ERR_OPENDIR);
-        }
+            struct dirent64 *cur_file = (struct dirent64 *)(buf + pos);
+            pos += cur_file->d_reclen;
+
+            if (cur_file->d_name[0] == '.')
+            {
+                _hidden_files_list_size++;
+                if (!(flags & LS_ALL))
+                {
+                    continue;
+                }
+            }
+
+            if (_files_list_size == _files_list_cap)
+            {
+                _files_list_cap = _files_list_cap ? _files_list_cap * 2 : 64;
+                struct ls_entry *list = (struct ls_entry *)realloc(
+                    _files_list, _files_list_cap * sizeof(struct ls_entry));
+                if (!list)
+                {
+                    _invoke_error(ERR_READDIR);
+                }
+                _files_list = list;
+            }
 
-        if ((flags & LS_ALL) || cur_file->d_name[0] != '.')
-            _blocks += temp.st_blocks;
+            struct ls_entry *entry = &_files_list[_files_list_size];
+            if (statx(_dir_fd, cur_file->d_name, AT_SYMLINK_NOFOLLOW, mask,
+                      &entry->st) == -1)
+            {
+                _invoke_error(ERR_STAT);
+            }
+            entry->name_len = strlen(cur_file->d_name);
+            entry->name = _arena_copy(cur_file->d_name, entry->name_len);
+            _files_list_size++;
+            _blocks += entry->st.stx_blocks;
+        }
     }
+    free(buf);
 
-    if (errno)
+    if (n == -1)
     {
         _invoke_error(ERR_READDIR);
     }
 
-    _files_list =
-        (struct dirent **)malloc(_files_list_size * sizeof(struct dirent *));
-    atexit(_free_files_list_at_exit);
-
-    rewinddir(_dir);
+    qsort(_files_list, _files_list_size, sizeof(struct ls_entry), _entry_cmp);
+}
 
-    int i = 0;
-    for (struct dirent *cur_file; (cur_file = readdir(_dir)) != NULL;
-         _files_list[i++] = cur_file)
-        ;
+const char *_arena_copy(const char *str, size_t len)
+{
+    if (!_arena || _arena->cap - _arena->used < len + 1)
+    {
+        size_t cap = len + 1 > _ARENA_BLOCK_SIZE ? len + 1 : _ARENA_BLOCK_SIZE;
+        struct arena_block *block =
+            (struct arena_block *)malloc(sizeof(struct arena_block) + cap);
+        if (!block)
+        {
+            _invoke_error(ERR_READDIR);
+        }
+        block->next = _arena;
+        block->used = 0;
+        block->cap = cap;
+        _arena = block;
+    }
 
-    qsort(_files_list, _files_list_size, sizeof(struct dirent *), _dirent_cmp);
+    char *copy = _arena->data + _arena->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    _arena->used += len + 1;
+    return copy;
 }
 
-void _free_files_list_at_exit() { free(_files_list); }
+void _free_files_list_at_exit()
+{
+    while (_arena)
+    {
+        struct arena_block *next = _arena->next;
+        free(_arena);
+        _arena = next;
+    }
+    free(_files_list);
+}
 
-int _dirent_cmp(const void *a, const void *b)
+int _entry_cmp(const void *a, const void *b)
 {
-    struct dirent *f = *(struct dirent **)a, *s = *(struct dirent **)b;
-    return strcmp(f->d_name, s->d_name);
+    const struct ls_entry *f = a, *s = b;
+    size_t len = f->name_len < s->name_len ? f->name_len : s->name_len;
+    int cmp = memcmp(f->name, s->name, len);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return (f->name_len > s->name_len) - (f->name_len < s->name_len);
 }